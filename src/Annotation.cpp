@@ -0,0 +1,77 @@
+#include <algorithm> /* sort, lower_bound */
+#include "Annotation.hpp"
+using namespace std;
+
+Annotation::Annotation() {}
+
+Annotation::~Annotation() {}
+
+/**
+ * Adds the transcripts of one chromosome. Adding a chromosome twice appends
+ * to its transcripts.
+ *
+ * @param name          name of the chromosome, as in the GFF
+ * @param transcripts   transcripts of the chromosome, in any order
+ */
+void Annotation::addChrom(const string &name,
+        const deque<Transcript> &transcripts) {
+    auto it = names.find(name);
+    if (it == names.end()) {
+        it = names.emplace(name, chroms.size()).first;
+        chroms.push_back(Chrom());
+        chroms.back().maxLength = 0;
+    }
+    Chrom &chrom = chroms[it->second];
+    for (auto t = transcripts.begin(); t != transcripts.end(); ++t) {
+        chrom.transcripts.push_back(*t);
+        chrom.maxLength = max(chrom.maxLength, t->getEnd() - t->getStart());
+    }
+    sort(chrom.transcripts.begin(), chrom.transcripts.end(),
+            [](const Transcript &a, const Transcript &b) {
+                return a.getStart() < b.getStart();
+            });
+}
+
+/**
+ * @return      index of chromosome `name`, or -1 if it is not annotated.
+ */
+int Annotation::getChromIndex(const string &name) const {
+    auto it = names.find(name);
+    return it == names.end() ? -1 : it->second;
+}
+
+int Annotation::size() const {
+    return chroms.size();
+}
+
+/**
+ * Appends to EC the IDs of all transcripts on chromosome `chrom` that the
+ * alignment maps to. If mateExons is given, a transcript must also take the
+ * mate's alignment to be included.
+ *
+ * @param chrom             index from getChromIndex
+ * @param alignmentExons    blocks of the alignment, as from getAlignmentExons
+ * @return                  number of transcripts compared with the alignment.
+ */
+int Annotation::getEC(int chrom, const vector<Exon> &alignmentExons,
+        bool genomebam, vector<int> &EC, const vector<Exon> *mateExons) const {
+    if (chrom < 0 || chrom >= chroms.size() || alignmentExons.empty()) {
+        return 0;
+    }
+    const Chrom &c = chroms[chrom];
+    int begin = alignmentExons.front().start;
+    auto it = lower_bound(c.transcripts.begin(), c.transcripts.end(),
+            begin - c.maxLength, [](const Transcript &t, int pos) {
+                return t.getStart() < pos;
+            });
+    int tested = 0;
+    for (; it != c.transcripts.end() && it->getStart() <= begin; ++it) {
+        ++tested;
+        if (it->mapsToTranscript(alignmentExons, genomebam)
+                && (mateExons == nullptr
+                    || it->mapsToTranscript(*mateExons, genomebam))) {
+            EC.push_back(it->getID());
+        }
+    }
+    return tested;
+}
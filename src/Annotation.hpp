@@ -0,0 +1,38 @@
+#ifndef __ANNOTATION_HPP__
+#define __ANNOTATION_HPP__
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Exon.hpp"
+#include "Transcript.hpp"
+
+/**
+ * Read-only, whole-genome view of the transcripts in the GFFs. Unlike the
+ * per-chromosome deques used by Mapper::readSAM, alignments can be looked up
+ * in any order, so it may be shared by all threads once loaded.
+ */
+class Annotation {
+private:
+    struct Chrom {
+        /* Sorted by start coordinate. */
+        std::vector<Transcript> transcripts;
+        /* Length of the longest transcript, bounds the search window. */
+        int maxLength;
+    };
+    std::vector<Chrom> chroms;
+    std::unordered_map<std::string, int> names;
+public:
+    Annotation();
+    ~Annotation();
+    void addChrom(const std::string &name,
+            const std::deque<Transcript> &transcripts);
+    int getChromIndex(const std::string &name) const;
+    int size() const;
+    int getEC(int chrom, const std::vector<Exon> &alignmentExons,
+            bool genomebam, std::vector<int> &EC,
+            const std::vector<Exon> *mateExons=nullptr) const;
+};
+
+#endif
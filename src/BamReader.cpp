@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <climits>
+#include <sys/stat.h>
+#include "BamReader.hpp"
+#include "BamTags.hpp"
+using namespace std;
+
+/* Tags copied into records by toRecord. Everything else is skipped. */
+static const char *KEPT_TAGS[] = {"NH", "MC", "CB", "CR", "UB", "UR"};
+
+/* Largest decompressed BGZF block, and largest block overall. */
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+/* Size of a BGZF block header, including the BC extra subfield. */
+#define BGZF_HEADER_SIZE 18
+
+BamReader::BamReader() : file(nullptr), start(0), end(0), nextBlock(0),
+        fileSize(0), body(0), limit(LLONG_MAX), eof(true) {
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, -15);
+}
+
+BamReader::~BamReader() {
+    close();
+    inflateEnd(&zs);
+}
+
+/**
+ * Opens filename and reads its header.
+ *
+ * @return      false if the file can't be opened or isn't a BAM file.
+ */
+bool BamReader::open(const string &filename) {
+    close();
+    file = fopen(filename.c_str(), "rb");
+    if (file == nullptr) { return false; }
+    this->filename = filename;
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    fseeko(file, 0, SEEK_END);
+    fileSize = ftello(file);
+    fseeko(file, 0, SEEK_SET);
+    eof = false;
+    if (!readHeader()) {
+        close();
+        return false;
+    }
+    body = tell();
+    return true;
+}
+
+void BamReader::close() {
+    if (file != nullptr) {
+        fclose(file);
+    }
+    file = nullptr;
+    start = end = 0;
+    blocks.clear();
+    nextBlock = fileSize = body = 0;
+    limit = LLONG_MAX;
+    eof = true;
+    header.clear();
+    pg.clear();
+    contigs.clear();
+}
+
+/**
+ * Decompresses the next BGZF block onto the end of buffer.
+ *
+ * @return      false at end of file or if the block is malformed.
+ */
+bool BamReader::readBlock() {
+    unsigned char header[BGZF_HEADER_SIZE];
+    if (eof || fread(header, 1, BGZF_HEADER_SIZE, file) != BGZF_HEADER_SIZE
+            || header[0] != 31 || header[1] != 139 || header[3] != 4
+            || header[12] != 'B' || header[13] != 'C') {
+        eof = true;
+        return false;
+    }
+    size_t blockSize = (header[16] | (header[17] << 8)) + 1;
+    if (blockSize < BGZF_HEADER_SIZE + 8) {
+        eof = true;
+        return false;
+    }
+    compressed.resize(blockSize - BGZF_HEADER_SIZE);
+    if (fread(compressed.data(), 1, compressed.size(), file)
+            != compressed.size()) {
+        eof = true;
+        return false;
+    }
+    uint32_t inflatedSize;
+    memcpy(&inflatedSize, compressed.data() + compressed.size() - 4, 4);
+    if (buffer.size() < end + inflatedSize) {
+        buffer.resize(end + max((size_t)inflatedSize, (size_t)BGZF_MAX_BLOCK_SIZE));
+    }
+    inflateReset(&zs);
+    zs.next_in = (Bytef *)compressed.data();
+    zs.avail_in = compressed.size() - 8;
+    zs.next_out = (Bytef *)buffer.data() + end;
+    zs.avail_out = inflatedSize;
+    if (inflatedSize != 0 && inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        eof = true;
+        return false;
+    }
+    blocks.push_back(make_pair(end, nextBlock));
+    nextBlock += blockSize;
+    end += inflatedSize;
+    return true;
+}
+
+/**
+ * Makes sure at least size unread bytes are in buffer.
+ *
+ * @return      false if the file ends first.
+ */
+bool BamReader::fill(size_t size) {
+    while (end - start < size) {
+        if (start != 0) {
+            memmove(buffer.data(), buffer.data() + start, end - start);
+            while (blocks.size() > 1 && blocks[1].first <= (long long)start) {
+                blocks.pop_front();
+            }
+            for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+                it->first -= start;
+            }
+            end -= start;
+            start = 0;
+        }
+        if (!readBlock()) { return false; }
+    }
+    return true;
+}
+
+/**
+ * Reads the header text (for the @PG ID) and the reference names.
+ */
+bool BamReader::readHeader() {
+    if (!fill(8) || memcmp(buffer.data() + start, "BAM\1", 4) != 0) {
+        return false;
+    }
+    int32_t textSize, count;
+    memcpy(&textSize, buffer.data() + start + 4, 4);
+    if (!fill(8 + textSize + 4)) { return false; }
+    header.assign(buffer.data() + start, 8 + textSize + 4);
+    start += 8;
+
+    pg = "N/A";
+    string text(buffer.data() + start, textSize);
+    size_t line = text.find("@PG");
+    while (line != string::npos && line != 0 && text[line - 1] != '\n') {
+        line = text.find("@PG", line + 1);
+    }
+    if (line != string::npos) {
+        size_t id = text.find("\tID:", line), lineEnd = text.find('\n', line);
+        if (id != string::npos && id < lineEnd) {
+            id += 4;
+            pg = text.substr(id, text.find_first_of("\t\n", id) - id);
+        }
+    }
+    start += textSize;
+
+    memcpy(&count, buffer.data() + start, 4);
+    start += 4;
+    for (int i = 0; i < count; ++i) {
+        int32_t nameSize;
+        if (!fill(4)) { return false; }
+        memcpy(&nameSize, buffer.data() + start, 4);
+        if (!fill(nameSize + 8)) { return false; }
+        header.append(buffer.data() + start, nameSize + 8);
+        contigs.push_back(string(buffer.data() + start + 4, nameSize - 1));
+        start += nameSize + 8;
+    }
+    return true;
+}
+
+/**
+ * @return      the header as stored in the file, from the magic string to the
+ *              end of the reference list.
+ */
+const string &BamReader::getHeader() const {
+    return header;
+}
+
+string BamReader::getPGName() const {
+    return pg;
+}
+
+int BamReader::getContigCount() const {
+    return contigs.size();
+}
+
+const string &BamReader::getContigName(int rID) const {
+    return contigs[rID];
+}
+
+/**
+ * @return      virtual offset of the next record.
+ */
+long long BamReader::tell() {
+    fill(1);
+    auto block = blocks.rbegin();
+    while (block != blocks.rend() && block->first > (long long)start) {
+        ++block;
+    }
+    if (block == blocks.rend()) { return nextBlock << 16; }
+    return (block->second << 16) | (start - block->first);
+}
+
+/**
+ * Goes to a virtual offset, which must be the start of a record.
+ */
+bool BamReader::seek(long long offset) {
+    start = end = 0;
+    blocks.clear();
+    nextBlock = offset >> 16;
+    eof = fseeko(file, nextBlock, SEEK_SET) != 0;
+    if (!readBlock()) { return false; }
+    start = offset & 0xffff;
+    return start <= end;
+}
+
+/**
+ * Restricts reading to the records whose virtual offsets are in [start, end),
+ * where start is one returned by tell or getRanges.
+ */
+bool BamReader::setRange(long long start, long long end) {
+    limit = end;
+    if (start == LLONG_MAX) {
+        eof = true;
+        this->start = this->end = 0;
+        return true;
+    }
+    return seek(start);
+}
+
+/**
+ * Splits the records into count ranges of about equal compressed size, to be
+ * given to setRange: each split is at the first record starting in or after
+ * the BGZF block at its share of the file. Record starts are taken from the
+ * file's BAI or CSI index if there is one, else found by reading through the
+ * records. Ranges may be empty. Leaves the reader at the first record.
+ */
+void BamReader::getRanges(int count, vector<pair<long long, long long>> &ranges)
+{
+    vector<long long> offsets, splits, starts;
+    for (int i = 1; i < count; ++i) {
+        offsets.push_back(fileSize * i / count);
+    }
+    if (offsets.size() != 0 && readIndex(starts)) {
+        for (auto it = offsets.begin(); it != offsets.end(); ++it) {
+            auto split = lower_bound(starts.begin(), starts.end(), *it << 16);
+            splits.push_back(split == starts.end() ? LLONG_MAX : *split);
+        }
+    } else {
+        findRecords(offsets, splits);
+    }
+    long long prev = body;
+    for (int i = 0; i < count; ++i) {
+        long long next = i == count - 1 ? LLONG_MAX : max(prev, splits[i]);
+        ranges.push_back(make_pair(prev, next));
+        prev = next;
+    }
+    limit = LLONG_MAX;
+    seek(body);
+}
+
+/**
+ * Reads the record starts listed in the file's index, <file>.bai, <file
+ * without .bam>.bai or <file>.csi, into starts, sorted: the start of every
+ * chunk, and for BAI of every 16 kb window. Indexes older than the file are
+ * ignored.
+ *
+ * @return      false if there is no index that can be read.
+ */
+bool BamReader::readIndex(vector<long long> &starts) {
+    struct stat bam, index;
+    if (stat(filename.c_str(), &bam) != 0) { return false; }
+    vector<string> names = {filename + ".bai", filename + ".csi"};
+    if (filename.size() > 4
+            && filename.compare(filename.size() - 4, 4, ".bam") == 0) {
+        names.insert(names.begin() + 1,
+                filename.substr(0, filename.size() - 4) + ".bai");
+    }
+    for (auto name = names.begin(); name != names.end(); ++name) {
+        if (stat(name->c_str(), &index) != 0
+                || index.st_mtime < bam.st_mtime) {
+            continue;
+        }
+        /* CSI is BGZF compressed and BAI is not; gzread reads both. */
+        gzFile in = gzopen(name->c_str(), "rb");
+        if (in == nullptr) { continue; }
+        bool read = readIndex(in, starts);
+        gzclose(in);
+        if (read) {
+            sort(starts.begin(), starts.end());
+            starts.erase(unique(starts.begin(), starts.end()), starts.end());
+            return true;
+        }
+        starts.clear();
+    }
+    return false;
+}
+
+static bool readIndexValue(gzFile in, void *value, unsigned size) {
+    return gzread(in, value, size) == (int)size;
+}
+
+/**
+ * Reads the record starts listed in an open BAI or CSI index (see readIndex).
+ * The metadata pseudo-bin's chunks are not records and are skipped.
+ */
+bool BamReader::readIndex(gzFile in, vector<long long> &starts) {
+    char magic[4];
+    int32_t minShift, depth = 5, auxSize, refs;
+    if (!readIndexValue(in, magic, 4)) { return false; }
+    bool csi = memcmp(magic, "CSI\1", 4) == 0;
+    if (!csi && memcmp(magic, "BAI\1", 4) != 0) { return false; }
+    if (csi && (!readIndexValue(in, &minShift, 4)
+                || !readIndexValue(in, &depth, 4)
+                || !readIndexValue(in, &auxSize, 4)
+                || gzseek(in, auxSize, SEEK_CUR) < 0)) {
+        return false;
+    }
+    uint32_t pseudoBin = ((1LL << ((depth + 1) * 3)) - 1) / 7 + 1;
+    if (!readIndexValue(in, &refs, 4)) { return false; }
+    for (int32_t r = 0; r < refs; ++r) {
+        int32_t bins, chunks, intervals;
+        if (!readIndexValue(in, &bins, 4)) { return false; }
+        for (int32_t b = 0; b < bins; ++b) {
+            uint32_t bin;
+            uint64_t loffset, chunk[2];
+            if (!readIndexValue(in, &bin, 4)
+                    || (csi && !readIndexValue(in, &loffset, 8))
+                    || !readIndexValue(in, &chunks, 4)) {
+                return false;
+            }
+            for (int32_t c = 0; c < chunks; ++c) {
+                if (!readIndexValue(in, chunk, 16)) { return false; }
+                if (bin != pseudoBin) { starts.push_back(chunk[0]); }
+            }
+        }
+        if (csi) { continue; }
+        if (!readIndexValue(in, &intervals, 4)) { return false; }
+        for (int32_t i = 0; i < intervals; ++i) {
+            uint64_t offset;
+            if (!readIndexValue(in, &offset, 8)) { return false; }
+            if (offset != 0) { starts.push_back(offset); }
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads through the records to find, for each of offsets (ascending offsets
+ * in the file), the first record starting in or after the BGZF block there.
+ * Its virtual offset, or LLONG_MAX if there is none, goes in records.
+ */
+void BamReader::findRecords(const vector<long long> &offsets,
+        vector<long long> &records) {
+    limit = LLONG_MAX;
+    seek(body);
+    BamRecordView view;
+    size_t i = 0;
+    while (i < offsets.size()) {
+        long long at = tell();
+        if (!nextRecord(view)) { break; }
+        for (; i < offsets.size() && (at >> 16) >= offsets[i]; ++i) {
+            records.push_back(at);
+        }
+    }
+    for (; i < offsets.size(); ++i) {
+        records.push_back(LLONG_MAX);
+    }
+}
+
+bool BamReader::atEnd() {
+    return !fill(1) || (limit != LLONG_MAX && tell() >= limit);
+}
+
+/**
+ * Points view at the next record. Nothing in the record is decoded.
+ *
+ * @return      false at end of file or of the range given to setRange.
+ */
+bool BamReader::nextRecord(BamRecordView &view) {
+    if (!fill(4) || (limit != LLONG_MAX && tell() >= limit)) { return false; }
+    int32_t size;
+    memcpy(&size, buffer.data() + start, 4);
+    if (!fill(size + 4)) { return false; }
+    view.data = buffer.data() + start + 4;
+    view.size = size;
+    start += size + 4;
+    return true;
+}
+
+/**
+ * Reads the next record into rec. See toRecord for what is filled in.
+ */
+bool BamReader::readRecord(seqan::BamAlignmentRecord &rec) {
+    BamRecordView view;
+    if (!nextRecord(view)) { return false; }
+    toRecord(view, rec);
+    return true;
+}
+
+/**
+ * Fills in the fields of rec that bam2tcc uses: flag, rID, beginPos, rNextId
+ * and pNext, and those of qName, cigar and the tags in KEPT_TAGS asked for in
+ * fields (see BAM_FIELD_*). The others are left empty; decodeFields can fill
+ * them in later from the same view.
+ */
+void BamReader::toRecord(const BamRecordView &view,
+        seqan::BamAlignmentRecord &rec, int fields) {
+    rec.flag = view.flag();
+    rec.rID = view.rID();
+    rec.beginPos = view.beginPos();
+    rec.rNextId = view.rNextId();
+    rec.pNext = view.pNext();
+    seqan::clear(rec.qName);
+    seqan::clear(rec.cigar);
+    seqan::clear(rec.tags);
+    decodeFields(view, rec, fields);
+}
+
+/**
+ * Fills in those of qName, cigar and the kept tags asked for in fields.
+ */
+void BamReader::decodeFields(const BamRecordView &view,
+        seqan::BamAlignmentRecord &rec, int fields) {
+    static const char *CIGAR_OPS = "MIDNSHP=X";
+    if (fields & BAM_FIELD_QNAME) {
+        seqan::resize(rec.qName, view.qNameSize());
+        if (view.qNameSize() != 0) {
+            memcpy(&rec.qName[0], view.qName(), view.qNameSize());
+        }
+    }
+
+    if (fields & BAM_FIELD_CIGAR) {
+        seqan::clear(rec.cigar);
+        for (int i = 0; i < view.cigarCount(); ++i) {
+            uint32_t op = view.cigar(i);
+            seqan::appendValue(rec.cigar, seqan::CigarElement<>(
+                        (op & 0xf) < 9 ? CIGAR_OPS[op & 0xf] : '?', op >> 4));
+        }
+    }
+
+    if (!(fields & BAM_FIELD_TAGS)) { return; }
+    seqan::clear(rec.tags);
+    size_t offset = view.tagsOffset();
+    const char *tags = view.data + offset;
+    for (auto key : KEPT_TAGS) {
+        const char *value;
+        char type;
+        if (!findTag(tags, view.size - offset, key, value, type)) { continue; }
+        /* Copy the tag as is, key and type included. */
+        const char *tag = value - 3, *tagEnd;
+        findTag(tag, view.size - offset - (tag - tags), nullptr, tagEnd, type);
+        for (const char *c = tag; c < tagEnd; ++c) {
+            seqan::appendValue(rec.tags, *c);
+        }
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef __BAM_READER_HPP__
+#define __BAM_READER_HPP__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+#include <seqan/bam_io.h>
+
+/* Parts of a record that toRecord decodes only when asked, besides the flag,
+ * reference IDs and positions it always fills in. */
+#define BAM_FIELD_QNAME 1
+#define BAM_FIELD_CIGAR 2
+#define BAM_FIELD_TAGS 4
+#define BAM_FIELDS_ALL 7
+
+/**
+ * View of one alignment record in a BAM file's decompressed data. Fields are
+ * decoded only when asked for, and SEQ and QUAL are never touched. Valid until
+ * the next call to BamReader::nextRecord. Assumes a little-endian host, like
+ * the BAM format itself.
+ */
+struct BamRecordView {
+    /* Record without its leading block_size. */
+    const char *data;
+    size_t size;
+
+    int32_t getInt32(size_t at) const {
+        int32_t n;
+        memcpy(&n, data + at, 4);
+        return n;
+    }
+    uint16_t getUInt16(size_t at) const {
+        uint16_t n;
+        memcpy(&n, data + at, 2);
+        return n;
+    }
+    int rID() const { return getInt32(0); }
+    int beginPos() const { return getInt32(4); }
+    int qNameSize() const { return (uint8_t)data[8] - 1; }
+    int cigarCount() const { return getUInt16(12); }
+    int flag() const { return getUInt16(14); }
+    int seqLength() const { return getInt32(16); }
+    int rNextId() const { return getInt32(20); }
+    int pNext() const { return getInt32(24); }
+    const char *qName() const { return data + 32; }
+    uint32_t cigar(int i) const {
+        uint32_t op;
+        memcpy(&op, data + 32 + qNameSize() + 1 + 4 * i, 4);
+        return op;
+    }
+    size_t tagsOffset() const {
+        return 32 + qNameSize() + 1 + 4 * cigarCount()
+            + (seqLength() + 1) / 2 + seqLength();
+    }
+};
+
+/**
+ * Reader for BAM files that decompresses the BGZF blocks itself and decodes
+ * only what bam2tcc uses. Unlike seqan::readRecord, SEQ, QUAL and the tags
+ * bam2tcc ignores are never decoded or copied.
+ *
+ * Positions are BGZF virtual offsets: the block's offset in the file shifted
+ * left 16 bits, plus the offset in the decompressed block. A record's position
+ * is always taken in the block holding its first byte, so that records can be
+ * split into ranges without overlap.
+ */
+class BamReader {
+private:
+    FILE *file;
+    std::string filename;
+    z_stream zs;
+    std::vector<char> compressed;
+    /* Decompressed data; [start, end) is not yet read. */
+    std::vector<char> buffer;
+    size_t start, end;
+    /* Where each block in buffer starts, and its offset in the file. */
+    std::deque<std::pair<long long, long long>> blocks;
+    long long nextBlock, fileSize, body, limit;
+    bool eof;
+    std::string header, pg;
+    std::vector<std::string> contigs;
+    bool readBlock();
+    bool fill(size_t size);
+    bool readHeader();
+    bool seek(long long offset);
+    bool readIndex(std::vector<long long> &starts);
+    bool readIndex(gzFile in, std::vector<long long> &starts);
+    void findRecords(const std::vector<long long> &offsets,
+            std::vector<long long> &records);
+public:
+    BamReader();
+    ~BamReader();
+    bool open(const std::string &filename);
+    void close();
+    const std::string &getHeader() const;
+    std::string getPGName() const;
+    int getContigCount() const;
+    const std::string &getContigName(int rID) const;
+    long long tell();
+    bool setRange(long long start, long long end);
+    void getRanges(int count,
+            std::vector<std::pair<long long, long long>> &ranges);
+    bool atEnd();
+    bool nextRecord(BamRecordView &view);
+    bool readRecord(seqan::BamAlignmentRecord &rec);
+    static void toRecord(const BamRecordView &view,
+            seqan::BamAlignmentRecord &rec, int fields=BAM_FIELDS_ALL);
+    static void decodeFields(const BamRecordView &view,
+            seqan::BamAlignmentRecord &rec, int fields);
+};
+
+#endif
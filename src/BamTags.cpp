@@ -0,0 +1,97 @@
+#include <cstdint>
+#include <cstring>
+#include "BamTags.hpp"
+using namespace std;
+
+/**
+ * Size of a tag value of the given type, or 0 if not fixed.
+ */
+static size_t tagValueSize(char type) {
+    switch (type) {
+        case 'A': case 'c': case 'C': return 1;
+        case 's': case 'S': return 2;
+        case 'i': case 'I': case 'f': return 4;
+        default: return 0;
+    }
+}
+
+/**
+ * Finds a tag in BAM-encoded tags without building a BamTagsDict. With key
+ * nullptr, instead sets value to the end of the first tag.
+ *
+ * @param value     set to the start of the tag's value.
+ * @param type      set to the tag's type character.
+ * @return          false if the tag isn't there (or tags are malformed).
+ */
+bool findTag(const char *tags, size_t size, const char *key,
+        const char *&value, char &type) {
+    const char *p = tags, *tagsEnd = tags + size;
+    while (p + 3 <= tagsEnd) {
+        bool match = key != nullptr && p[0] == key[0] && p[1] == key[1];
+        char t = p[2];
+        const char *v = p + 3, *next;
+        if (t == 'Z' || t == 'H') {
+            next = (const char *)memchr(v, '\0', tagsEnd - v);
+            if (next == nullptr) { return false; }
+            ++next;
+        } else if (t == 'B') {
+            /* Subtype and count, then count values, all within tags. */
+            if (tagsEnd - v < 5) { return false; }
+            uint32_t count;
+            memcpy(&count, v + 1, 4);
+            size_t width = tagValueSize(v[0]);
+            if (width == 0 || v[0] == 'A'
+                    || count > (size_t)(tagsEnd - v - 5) / width) {
+                return false;
+            }
+            next = v + 5 + count * width;
+        } else if (tagValueSize(t) != 0) {
+            if ((size_t)(tagsEnd - v) < tagValueSize(t)) { return false; }
+            next = v + tagValueSize(t);
+        } else {
+            return false;
+        }
+        if (key == nullptr) {
+            value = next;
+            type = t;
+            return true;
+        }
+        if (match) {
+            value = v;
+            type = t;
+            return true;
+        }
+        p = next;
+    }
+    return false;
+}
+
+/**
+ * Gets the value of an integer tag, of any integer type.
+ */
+bool getIntTag(const char *tags, size_t size, const char *key, int &value) {
+    const char *v;
+    char type;
+    if (!findTag(tags, size, key, v, type)) { return false; }
+    switch (type) {
+        case 'c': value = (int8_t)v[0]; return true;
+        case 'C': value = (uint8_t)v[0]; return true;
+        case 's': { int16_t n; memcpy(&n, v, 2); value = n; return true; }
+        case 'S': { uint16_t n; memcpy(&n, v, 2); value = n; return true; }
+        case 'i': { int32_t n; memcpy(&n, v, 4); value = n; return true; }
+        case 'I': { uint32_t n; memcpy(&n, v, 4); value = n; return true; }
+        default: return false;
+    }
+}
+
+/**
+ * Gets the value of a string (Z) tag.
+ */
+bool getStringTag(const char *tags, size_t size, const char *key,
+        string &value) {
+    const char *v;
+    char type;
+    if (!findTag(tags, size, key, v, type) || type != 'Z') { return false; }
+    value = v;
+    return true;
+}
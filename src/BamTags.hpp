@@ -0,0 +1,21 @@
+#ifndef __BAM_TAGS_HPP__
+#define __BAM_TAGS_HPP__
+
+#include <cstddef>
+#include <string>
+
+/*
+ * Lookups in BAM-encoded optional fields, as held in
+ * seqan::BamAlignmentRecord::tags or a BAM record, without building a
+ * BamTagsDict.
+ */
+
+bool findTag(const char *tags, size_t size, const char *key,
+        const char *&value, char &type);
+
+bool getIntTag(const char *tags, size_t size, const char *key, int &value);
+
+bool getStringTag(const char *tags, size_t size, const char *key,
+        std::string &value);
+
+#endif
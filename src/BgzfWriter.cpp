@@ -0,0 +1,181 @@
+#include <cstring>
+#include "BgzfWriter.hpp"
+using namespace std;
+
+/* Size of a BGZF block header (with the BC extra subfield) and footer. */
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+
+BgzfWriter::BgzfWriter() : file(nullptr), level(Z_DEFAULT_COMPRESSION),
+        nThreads(1), jobs(nullptr) {}
+
+BgzfWriter::~BgzfWriter() {
+    close();
+}
+
+/**
+ * Opens filename for writing, truncating it.
+ *
+ * @param level     zlib compression level, 0 (none) to 9.
+ * @param nThreads  number of blocks compressed at once. With more than one,
+ *                  as many workers compress blocks until close.
+ */
+bool BgzfWriter::open(const string &filename, int level, int nThreads) {
+    close();
+    file = fopen(filename.c_str(), "wb");
+    if (file == nullptr) { return false; }
+    this->level = level;
+    this->nThreads = nThreads < 1 ? 1 : nThreads;
+    data.clear();
+    if (this->nThreads > 1) {
+        jobs = new BlockingQueue<Job*>(this->nThreads
+                * BGZF_BLOCKS_PER_THREAD);
+        for (int i = 0; i < this->nThreads; ++i) {
+            workers.push_back(async(launch::async, &BgzfWriter::compressJobs,
+                        this));
+        }
+    }
+    return true;
+}
+
+/**
+ * Compresses input into one BGZF block.
+ *
+ * @return      the block, or nothing if input doesn't fit in one.
+ */
+vector<char> BgzfWriter::compressBlock(const vector<char> &input,
+        int level) {
+    vector<char> block(BGZF_MAX_BLOCK_SIZE);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)
+            != Z_OK) {
+        return vector<char>();
+    }
+    zs.next_in = (Bytef *)input.data();
+    zs.avail_in = input.size();
+    zs.next_out = (Bytef *)block.data() + BGZF_HEADER_SIZE;
+    zs.avail_out = block.size() - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    int status = deflate(&zs, Z_FINISH);
+    size_t blockSize = BGZF_HEADER_SIZE + zs.total_out + BGZF_FOOTER_SIZE;
+    deflateEnd(&zs);
+    if (status != Z_STREAM_END) { return vector<char>(); }
+
+    static const unsigned char HEADER[] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255,
+        6, 0, 'B', 'C', 2, 0};
+    memcpy(block.data(), HEADER, sizeof(HEADER));
+    block[16] = (blockSize - 1) & 0xff;
+    block[17] = (blockSize - 1) >> 8;
+    uint32_t footer[2] = {(uint32_t)crc32(crc32(0, nullptr, 0),
+            (const Bytef *)input.data(), input.size()), (uint32_t)input.size()};
+    memcpy(block.data() + blockSize - BGZF_FOOTER_SIZE, footer,
+            BGZF_FOOTER_SIZE);
+    block.resize(blockSize);
+    return block;
+}
+
+/**
+ * A worker: compresses the jobs queued by writeBlock until the queue is
+ * closed.
+ */
+void BgzfWriter::compressJobs() {
+    Job *job;
+    while (jobs->pop(job)) {
+        job->block = compressBlock(job->input, level);
+        vector<char>().swap(job->input);
+        job->done.inc();
+    }
+}
+
+/**
+ * Writes out compressed blocks, oldest first, until at most keep are left
+ * being compressed.
+ */
+bool BgzfWriter::drain(size_t keep) {
+    bool success = true;
+    while (pending.size() > keep) {
+        Job *job = pending.front();
+        pending.pop_front();
+        job->done.dec();
+        success = success && job->block.size() != 0
+            && fwrite(job->block.data(), 1, job->block.size(), file)
+                == job->block.size();
+        delete job;
+    }
+    return success;
+}
+
+/**
+ * Queues input (which is taken) to be compressed into one block and written.
+ * Without workers, the block is compressed and written right away.
+ */
+bool BgzfWriter::writeBlock(vector<char> &input) {
+    Job *job = new Job;
+    job->input.swap(input);
+    pending.push_back(job);
+    if (jobs == nullptr) {
+        job->block = compressBlock(job->input, level);
+        job->done.inc();
+        return drain(0);
+    }
+    jobs->push(job);
+    return drain(nThreads * BGZF_BLOCKS_PER_THREAD);
+}
+
+/**
+ * Buffers input, queueing every full block.
+ */
+bool BgzfWriter::write(const char *input, size_t size) {
+    if (file == nullptr) { return false; }
+    bool success = true;
+    while (size != 0) {
+        size_t n = min(size, BGZF_BLOCK_DATA_SIZE - data.size());
+        data.insert(data.end(), input, input + n);
+        input += n;
+        size -= n;
+        if (data.size() == BGZF_BLOCK_DATA_SIZE) {
+            success = writeBlock(data) && success;
+            data = vector<char>();
+            data.reserve(BGZF_BLOCK_DATA_SIZE);
+        }
+    }
+    return success;
+}
+
+/**
+ * Writes whatever is buffered as a (short) block, and waits for every block to
+ * be written.
+ */
+bool BgzfWriter::flush() {
+    if (file == nullptr) { return false; }
+    bool success = true;
+    if (!data.empty()) {
+        success = writeBlock(data);
+        data = vector<char>();
+    }
+    return drain(0) && success;
+}
+
+/**
+ * Flushes, then ends the file with the empty block that marks a complete
+ * BGZF file, and stops the workers.
+ */
+bool BgzfWriter::close() {
+    if (file == nullptr) { return true; }
+    bool success = flush();
+    vector<char> eof;
+    success = writeBlock(eof) && drain(0) && success;
+    if (jobs != nullptr) {
+        jobs->close();
+        for (auto it = workers.begin(); it != workers.end(); ++it) {
+            it->get();
+        }
+        workers.clear();
+        delete jobs;
+        jobs = nullptr;
+    }
+    success = fclose(file) == 0 && success;
+    file = nullptr;
+    return success;
+}
@@ -0,0 +1,53 @@
+#ifndef __BGZF_WRITER_HPP__
+#define __BGZF_WRITER_HPP__
+
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "BlockingQueue.hpp"
+#include "Semaphore.hpp"
+
+/* Most uncompressed data put in one BGZF block, as in htslib. */
+#define BGZF_BLOCK_DATA_SIZE 0xff00
+/* Blocks being compressed at once, per thread. */
+#define BGZF_BLOCKS_PER_THREAD 4
+
+/**
+ * Writes BGZF, the blocked gzip that BAM files are made of. Data is cut into
+ * blocks as it comes, so a record may span blocks. Blocks are compressed by a
+ * fixed set of nThreads workers, started on open, and written in order.
+ */
+class BgzfWriter {
+private:
+    /* A block to compress: done is incremented once block holds it. */
+    struct Job {
+        std::vector<char> input, block;
+        Semaphore done;
+        Job() : done(0) {}
+    };
+    FILE *file;
+    int level, nThreads;
+    std::vector<char> data;
+    /* Blocks not yet written, in order, and those for the workers. */
+    std::deque<Job*> pending;
+    BlockingQueue<Job*> *jobs;
+    std::vector<std::future<void>> workers;
+    static std::vector<char> compressBlock(const std::vector<char> &input,
+            int level);
+    void compressJobs();
+    bool writeBlock(std::vector<char> &input);
+    bool drain(size_t keep);
+public:
+    BgzfWriter();
+    ~BgzfWriter();
+    bool open(const std::string &filename, int level=Z_DEFAULT_COMPRESSION,
+            int nThreads=1);
+    bool write(const char *input, size_t size);
+    bool flush();
+    bool close();
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __BLOCKING_QUEUE_HPP__
+#define __BLOCKING_QUEUE_HPP__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ * Bounded multi-producer, multi-consumer queue. push blocks while the queue is
+ * full, and pop blocks until an item is available or the queue is closed.
+ */
+template <typename T>
+class BlockingQueue {
+private:
+    std::mutex m;
+    std::condition_variable notEmpty, notFull;
+    std::deque<T> items;
+    unsigned long capacity;
+    bool closed;
+
+public:
+    BlockingQueue(unsigned long capacity) : capacity(capacity),
+        closed(false) {}
+    ~BlockingQueue() {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(m);
+        while (items.size() >= capacity) {
+            notFull.wait(lock);
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    /**
+     * Takes the oldest item into item. Returns false once the queue is closed
+     * and empty.
+     */
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(m);
+        while (items.empty() && !closed) {
+            notEmpty.wait(lock);
+        }
+        if (items.empty()) { return false; }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /**
+     * Marks that no more items will be pushed, waking every waiting pop.
+     */
+    void close() {
+        std::unique_lock<std::mutex> lock(m);
+        closed = true;
+        notEmpty.notify_all();
+    }
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <cstring>
+#include "BusWriter.hpp"
+using namespace std;
+
+#define BUS_MAGIC "BUS\0"
+#define BUS_VERSION 1
+
+const char BusWriter::BASES[] = "ACGT";
+
+BusWriter::BusWriter() : barcodeLength(0), UMILength(0) {}
+
+BusWriter::~BusWriter() {
+    close();
+}
+
+/**
+ * Writes the header: magic, version, barcode and UMI lengths, and an empty
+ * text header.
+ */
+void BusWriter::writeHeader() {
+    uint32_t fields[] = {BUS_VERSION, barcodeLength, UMILength, 0};
+    out.write(BUS_MAGIC, 4);
+    out.write((const char*)fields, sizeof(fields));
+}
+
+bool BusWriter::open(const string &filename) {
+    out.open(filename, ios::binary);
+    if (!out.is_open()) { return false; }
+    writeHeader();
+    return !out.fail();
+}
+
+/**
+ * Writes records, a buffer of whole BusRecords. The header's barcode and UMI
+ * lengths are the longest any write reports.
+ */
+void BusWriter::write(const string &records, uint32_t barcodeLength,
+        uint32_t UMILength) {
+    sem.dec();
+    out.write(records.data(), records.size());
+    this->barcodeLength = max(this->barcodeLength, barcodeLength);
+    this->UMILength = max(this->UMILength, UMILength);
+    sem.inc();
+}
+
+/**
+ * Rewrites the header with the final barcode and UMI lengths and closes the
+ * file.
+ */
+bool BusWriter::close() {
+    if (!out.is_open()) { return true; }
+    out.seekp(0);
+    writeHeader();
+    out.close();
+    return !out.fail();
+}
+
+/**
+ * Packs a sequence of up to 32 bases two bits each (A, C, G, T as 0 to 3),
+ * the first base highest, as kallisto does. Only the first length characters
+ * of seq are packed, if it is longer.
+ *
+ * @return      false if seq is too long or has other than ACGT.
+ */
+bool BusWriter::encode(const string &seq, uint64_t &code, size_t length) {
+    length = min(length, seq.size());
+    if (length > 32) { return false; }
+    code = 0;
+    for (size_t i = 0; i < length; ++i) {
+        const char *base = strchr(BASES, seq[i]);
+        if (seq[i] == '\0' || base == nullptr) { return false; }
+        code = (code << 2) | (base - BASES);
+    }
+    return true;
+}
+
+/* The length bases packed in code by encode. */
+string BusWriter::decode(uint64_t code, size_t length) {
+    string seq(length, 'A');
+    for (size_t i = 0; i < length; ++i) {
+        seq[i] = BASES[(code >> (2 * (length - 1 - i))) & 3];
+    }
+    return seq;
+}
+
+void BusWriter::appendRecord(string &records, uint64_t barcode, uint64_t UMI,
+        int ec, uint32_t flags) {
+    BusRecord rec = {barcode, UMI, ec, 1, flags, 0};
+    records.append((const char*)&rec, sizeof(rec));
+}
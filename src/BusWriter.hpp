@@ -0,0 +1,46 @@
+#ifndef __BUS_WRITER_HPP__
+#define __BUS_WRITER_HPP__
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include "Semaphore.hpp"
+
+/* A record of kallisto's BUS format: one read (fragment). */
+struct BusRecord {
+    uint64_t barcode;
+    uint64_t UMI;
+    int32_t ec;
+    uint32_t count;
+    uint32_t flags;
+    uint32_t pad;
+};
+
+/**
+ * Output of BUS records (see https://github.com/BUStools/BUS-format), written
+ * while mapping. Any number of threads may write buffers of whole records;
+ * records are in no particular order, so bustools sort should come first.
+ */
+class BusWriter {
+private:
+    std::ofstream out;
+    uint32_t barcodeLength, UMILength;
+    Semaphore sem;
+    void writeHeader();
+public:
+    BusWriter();
+    ~BusWriter();
+    bool open(const std::string &filename);
+    void write(const std::string &records, uint32_t barcodeLength,
+            uint32_t UMILength);
+    bool close();
+    /* The bases in the order of their 2-bit codes. */
+    static const char BASES[];
+    static bool encode(const std::string &seq, uint64_t &code,
+            size_t length=std::string::npos);
+    static std::string decode(uint64_t code, size_t length);
+    static void appendRecord(std::string &records, uint64_t barcode,
+            uint64_t UMI, int ec, uint32_t flags);
+};
+
+#endif
@@ -1,10 +1,19 @@
 #ifndef __FILE_META_INFO__
 #define __FILE_META_INFO__
 
+#include <string>
+
 struct FileMetaInfo {
     int fileNum, start, end, count;
-    FileMetaInfo(int fileNum, int start, int end, int count) :
-        fileNum(fileNum), start(start), end(end), count(count) {};
+    /* Range in the file if known (byte offsets for SAM, BGZF virtual offsets
+     * for BAM), else -1. */
+    long long startByte, endByte;
+    /* Chromosome of the range, if it is one. */
+    std::string name;
+    FileMetaInfo(int fileNum, int start, int end, int count,
+            long long startByte=-1, long long endByte=-1) :
+        fileNum(fileNum), start(start), end(end), count(count),
+        startByte(startByte), endByte(endByte) {};
 };
 
 #endif
@@ -1,29 +1,25 @@
 #include <iostream>
 #include <fstream>
+#include <sys/stat.h>
 #include <seqan/bam_io.h>
+#include "BamReader.hpp"
 #include "FileUtil.hpp"
+#include "SamReader.hpp"
 #include "common.hpp"
 using namespace std;
 
 int getLineCountSAM(string filename) {
     int count = 0;
     if (hasSAMExt(filename)) {
-        ifstream in(filename);
-        if (!in.is_open()) { return -1; }
-        string inp;
-        while (getline(in, inp)) {
-            if (inp.size() != 0 && inp[0] != '@') { ++count; }
-        }
+        SamReader in;
+        if (!in.open(filename)) { return -1; }
+        SamField inp;
+        while (in.nextLine(inp)) { ++count; }
     } else {
-        seqan::BamFileIn bam;
-        if (!seqan::open(bam, filename.c_str())) { return -1; }
-        seqan::BamHeader head;
-        seqan::readHeader(head, bam);
-        seqan::BamAlignmentRecord rec;
-        while (!seqan::atEnd(bam)) {
-            ++count;
-            seqan::readRecord(rec, bam);
-        }
+        BamReader in;
+        if (!in.open(filename)) { return -1; }
+        BamRecordView rec;
+        while (in.nextRecord(rec)) { ++count; }
     }
     return count;
 }
@@ -33,15 +29,57 @@ bool hasSAMExt(string filename) {
             filename.size()).compare(".sam") == 0;
 }
 
-bool getECOrder(string ec, vector<string> &order,
-        unordered_set<string> &ecSet) {
+/**
+ * Whether filename can only be read once, in order: `-` (stdin), a named
+ * pipe, or a character device such as /dev/stdin on some systems.
+ */
+bool isStreamInput(string filename) {
+    if (filename.compare("-") == 0) { return true; }
+    struct stat info;
+    return stat(filename.c_str(), &info) == 0
+        && (S_ISFIFO(info.st_mode) || S_ISCHR(info.st_mode));
+}
+
+/**
+ * Size of filename in bytes, or -1 if it can't be read.
+ */
+long long getFileSize(string filename) {
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) { return -1; }
+    return info.st_size;
+}
+
+/**
+ * Appends the SAM/BAM files listed in manifest to files, and their labels to
+ * labels. Each line is a path, optionally followed by a tab and a label (e.g.
+ * the sample or well); files without one get an empty label. Empty lines and
+ * lines starting with # are skipped.
+ */
+bool readManifest(string manifest, vector<string> &files,
+        vector<string> &labels) {
+    ifstream in(manifest);
+    if (!in.is_open()) { return false; }
+    string inp;
+    while (getline(in, inp)) {
+        if (inp.size() != 0 && inp[inp.size() - 1] == '\r') { inp.pop_back(); }
+        if (inp.size() == 0 || inp[0] == '#') { continue; }
+        size_t tab = inp.find('\t');
+        files.push_back(inp.substr(0, tab));
+        labels.push_back(tab == string::npos ? "" : inp.substr(tab + 1));
+    }
+    return true;
+}
+
+bool getECOrder(string ec, vector<string> &order) {
    ifstream in(ec);
    if (!in.is_open()) { return false; }
    string inp;
    while (getline(in, inp)) {
-        string ec = parseString(inp, "\t", 0)[1];
-        order.push_back(ec);
-        ecSet.emplace(ec);
+        size_t tab = inp.find('\t');
+        if (tab == string::npos) { continue; }
+        size_t end = inp.find('\t', tab + 1);
+        order.push_back(inp.substr(tab + 1,
+                    end == string::npos ? string::npos : end - tab - 1));
    }
    return true;
 }
@@ -13,10 +13,16 @@ int getLineCountSAM(std::string filename);
 
 bool hasSAMExt(std::string filename);
 
+bool isStreamInput(std::string filename);
+
+long long getFileSize(std::string filename);
+
+bool readManifest(std::string manifest, std::vector<std::string> &files,
+        std::vector<std::string> &labels);
+
 bool readTranscriptome(std::vector<std::string> &files,
         std::unordered_map<std::string, int> &indexMap);
 
-bool getECOrder(std::string ec, std::vector<std::string> &order,
-            std::unordered_set<std::string> &ecSet);
+bool getECOrder(std::string ec, std::vector<std::string> &order);
 
 #endif
@@ -7,43 +7,68 @@
  */
 #include <seqan/gff_io.h>
 #include <seqan/bam_io.h>
+#include <algorithm>
+#include <climits>
 #include <fstream>
+#include <atomic>
 #include <future>
 #include "Mapper.hpp"
+#include "BamReader.hpp"
+#include "BamTags.hpp"
 #include "Exon.hpp"
 #include "FileUtil.hpp"
+#include "RecordWriter.hpp"
+#include "Trace.hpp"
 #include "common.hpp"
 using namespace std;
 
 Mapper::Mapper(vector<string> gffs, vector<string> sams, vector<string> fas,
-        bool paired, bool recordUnmapped,
-        bool pgProvided, bool genomebam, bool rapmap) : gffs(gffs), sams(sams),
-        paired(paired), recordUnmapped(recordUnmapped), pgProvided(pgProvided),
-        genomebam(genomebam), rapmap(rapmap) {
+        bool paired, vector<string> unmappedOut,
+        bool pgProvided, bool genomebam, bool rapmap, bool mateCigar,
+        bool collated, int compressionLevel, string busOut, string cellTag,
+        bool collapseUMIs, Whitelist *whitelist, vector<string> labels,
+        Stats *stats) :
+        gffs(gffs), sams(sams), labels(labels), unmappedOut(unmappedOut),
+        compressionLevel(compressionLevel), outThreads(1), busOut(busOut),
+        busWriter(nullptr), cellTag(cellTag.size() != 0 ? cellTag : "CB"),
+        byCell(cellTag.size() != 0), whitelist(whitelist),
+        collapseUMIs(collapseUMIs),
+        stats(stats), paired(paired),
+        recordUnmapped(unmappedOut.size() != 0),
+        pgProvided(pgProvided), genomebam(genomebam), rapmap(rapmap),
+        mateCigar(mateCigar), collated(collated) {
     indexMap = new unordered_map<string, int>;
+    annotation = nullptr;
+    this->labels.resize(sams.size());
     for (int i = 0; i < sams.size(); ++i) {
-        reads.push_back(new unordered_map<string, Read*>());
-        readsSems.push_back(new Semaphore);
-        if (recordUnmapped) {
-            unmappedQNames.push_back(new unordered_set<string>);
-            unmappedQNamesSems.push_back(new Semaphore);
-        }
+        /* Allocated by mapFile. */
+        reads.push_back(nullptr);
+        readsSems.push_back(nullptr);
+        unmappedWriters.push_back(nullptr);
+        skipped.push_back(nullptr);
 #if READ_DIST
         mappedQNames.push_back(new unordered_set<string>);
         mappedQNamesSems.push_back(new Semaphore);
 #endif
     }
-    matrix = new TCC_Matrix(sams.size());
 
+    /* Transcript IDs are below the transcriptome's count and the GFFs'. */
+    int transcriptCount = 0;
     readTranscriptome(fas, *indexMap);
     if (!(pgProvided && rapmap)) {
-        getChromsGFFs();
+        getChromsGFFs(transcriptCount);
+    }
+    for (auto it = indexMap->begin(); it != indexMap->end(); ++it) {
+        transcriptCount = max(transcriptCount, it->second + 1);
     }
+    matrix = new TCC_Matrix(byCell ? 0 : sams.size(), transcriptCount);
 }
 
 Mapper::~Mapper() {
     delete indexMap;
+    delete annotation;
     for (auto it = reads.begin(); it != reads.end(); ++it) {
+        if (*it == nullptr) { continue; }
         for (auto it2 = (*it)->begin(); it2 != (*it)->end(); ++it2) {
             delete it2->second;
         }
@@ -52,16 +77,14 @@ Mapper::~Mapper() {
     for (auto it = readsSems.begin(); it != readsSems.end(); ++it) {
         delete *it;
     }
-    if (recordUnmapped) {
-        for (auto it = unmappedQNames.begin(); it != unmappedQNames.end(); ++it)
-        {
-            delete *it;
-        }
-        for (auto it = unmappedQNamesSems.begin();
-                it != unmappedQNamesSems.end(); ++it) {
-            delete *it;
-        }
+    for (auto it = unmappedWriters.begin(); it != unmappedWriters.end(); ++it)
+    {
+        delete *it;
     }
+    for (auto it = skipped.begin(); it != skipped.end(); ++it) {
+        delete *it;
+    }
+    delete busWriter;
 #if READ_DIST
     for (auto it = mappedQNames.begin(); it != mappedQNames.end(); ++it) {
         delete *it;
@@ -74,11 +97,32 @@ Mapper::~Mapper() {
     delete matrix;
 }
 
+/**
+ * Reads the transcripts of the chromosome inf from its GFF, adding the time
+ * taken to stage gff_load.
+ */
 bool Mapper::readGFF(FileMetaInfo &inf, deque<Transcript> &chrom) {
+    TraceSpan span("read GFF", "io", -1, &inf.name);
+    Stats::Clock clock = Stats::start(true);
     seqan::GffFileIn gff;
     if (!seqan::open(gff, gffs[inf.fileNum].c_str())) { return false; }
-    int line = 0, transcriptCount = inf.count;
+    int line = 0;
     seqan::GffRecord rec;
+    readGFFRange(gff, rec, line, inf, chrom);
+    if (stats != nullptr) {
+        stats->endStage("gff_load", clock);
+    }
+    return true;
+}
+
+/**
+ * Reads the transcripts of one chromosome from an open GFF. `line` is the
+ * number of records read from gff so far (rec holding the last of them), so
+ * consecutive chromosomes of the same file may be read without reopening it.
+ */
+void Mapper::readGFFRange(seqan::GffFileIn &gff, seqan::GffRecord &rec,
+        int &line, FileMetaInfo &inf, deque<Transcript> &chrom) {
+    int transcriptCount = inf.count;
     while (line < inf.start) {
         ++line;
         seqan::readRecord(rec, gff);
@@ -114,15 +158,44 @@ bool Mapper::readGFF(FileMetaInfo &inf, deque<Transcript> &chrom) {
         } else if (type.compare("exon") == 0) {
             transcript.addExonEntry(rec);
         }
+        if (line + 1 == inf.end) { break; }
         ++line;
-        if (line == inf.end) { break; }
         seqan::readRecord(rec, gff);
     }
 
     for (auto it = transcripts.begin(); it != transcripts.end(); ++it) {
         chrom.push_back(*it);
     }
+}
 
+/**
+ * Loads every annotated chromosome into `annotation`, reading each GFF once.
+ */
+bool Mapper::loadAnnotation() {
+    TraceSpan span("load annotation", "io");
+    for (int i = 0; i < gffs.size(); ++i) {
+        vector<pair<int, string>> starts;
+        for (auto it = chroms.begin(); it != chroms.end(); ++it) {
+            if (it->second.fileNum == i) {
+                starts.push_back(make_pair(it->second.start, it->first));
+            }
+        }
+        sort(starts.begin(), starts.end());
+
+        seqan::GffFileIn gff;
+        if (!seqan::open(gff, gffs[i].c_str())) {
+            cerr << "WARNING: error while reading " << gffs[i] << endl;
+            continue;
+        }
+        int line = 0;
+        seqan::GffRecord rec;
+        for (auto it = starts.begin(); it != starts.end(); ++it) {
+            deque<Transcript> chrom;
+            readGFFRange(gff, rec, line, chroms.at(it->second), chrom);
+            annotation->addChrom(it->second, chrom);
+        }
+        seqan::close(gff);
+    }
     return true;
 }
 
@@ -147,56 +220,432 @@ vector<Exon> getAlignmentExons(const seqan::BamAlignmentRecord &alignment) {
     return exons;
 }
 
-bool Mapper::readSAM(FileMetaInfo &inf, deque<Transcript> &chrom,
-        bool genomebam, bool rapmap, bool sameQName) {
-    seqan::BamFileIn bam;
-    if (!seqan::open(bam, sams[inf.fileNum].c_str())) { return false; }
-    int line = 0;
-    seqan::BamAlignmentRecord rec;
-    seqan::BamHeader head;
-    seqan::readHeader(head, bam);
-    while (line < inf.start) {
-        ++line;
-        readRecord(rec, bam);
+/**
+ * Same as above, but for a CIGAR given as text (e.g. the value of an MC tag)
+ * of an alignment starting at beginPos.
+ */
+vector<Exon> getAlignmentExons(int beginPos, const string &cigar) {
+    vector<Exon> exons;
+    int start = beginPos, end = start, count = 0;
+    for (uint i = 0; i < cigar.size(); ++i) {
+        if (isdigit(cigar[i])) {
+            count = count * 10 + (cigar[i] - '0');
+            continue;
+        }
+        switch (cigar[i]) {
+            case 'M':
+            case 'D':
+            case '=':
+            case 'X': end += count;
+                      break;
+            case 'N': exons.push_back(Exon(start, end));
+                      start = end + count;
+                      end = start;
+                      break;
+            default: /* do nothing */ break;
+        }
+        count = 0;
     }
+    exons.push_back(Exon(start, end));
+    return exons;
+}
 
-    while (true) {
-        vector<int> EC;
-        if (rapmap) {
-            if (rec.rID == seqan::BamAlignmentRecord::INVALID_REFID) {
-                cerr << "Unexpectedly unable to find REFID for "
-                    << seqan::toCString(rec.qName) << endl;
-            } else if (!seqan::hasFlagUnmapped(rec)
-                    && (!seqan::hasFlagMultiple(rec)
-                        || (seqan::hasFlagAllProper(rec)
-                            && rec.rID == rec.rNextId))) {
-                int id = rec.rID;
-                if (indexMap->size()) {
-                    string transcript_id
-                        = seqan::toCString(seqan::getContigName(rec, bam));
-                    if (indexMap->find(transcript_id) == indexMap->end()) {
-                        id = -1;
-                    } else {
-                        id = indexMap->at(transcript_id);
-                    }
-                }
-                EC = {id};
+/**
+ * Gets the mate CIGAR (MC tag) of an alignment, if it has one.
+ *
+ * @return      true if the MC tag was found, else false.
+ */
+bool getMateCigar(const seqan::BamAlignmentRecord &alignment, string &cigar) {
+    size_t size = seqan::length(alignment.tags);
+    if (size == 0 || !getStringTag(&alignment.tags[0], size, "MC", cigar)) {
+        return false;
+    }
+    return cigar.size() != 0 && cigar.compare("*") != 0;
+}
+
+/**
+ * Whether alignment is the leftmost mate of its pair. Ties go to the first
+ * segment of the template.
+ */
+bool isLeftMate(const seqan::BamAlignmentRecord &alignment) {
+    return alignment.beginPos < alignment.pNext
+        || (alignment.beginPos == alignment.pNext
+                && seqan::hasFlagFirst(alignment));
+}
+
+/**
+ * Decodes the given BAM_FIELD_* of rec, the record last read from in, if in is
+ * not nullptr (see SamInput::decode).
+ */
+static void decode(SamInput *in, seqan::BamAlignmentRecord &rec, int fields) {
+    if (in != nullptr) {
+        in->decode(rec, fields);
+    }
+}
+
+/**
+ * Whether an alignment should be tested against the annotation at all.
+ */
+bool Mapper::isCountable(const seqan::BamAlignmentRecord &rec,
+        bool genomebam) {
+    return (!genomebam && !seqan::hasFlagUnmapped(rec)
+                && (!seqan::hasFlagMultiple(rec)
+                    || (seqan::hasFlagAllProper(rec)
+                        && rec.rID == rec.rNextId)))
+        || (genomebam && (!paired || (rec.rID == rec.rNextId
+                && seqan::hasFlagMultiple(rec))));
+}
+
+/**
+ * Adds a record that isCountable rejects to counts, under the first of its
+ * reasons.
+ */
+void Mapper::countRejected(const seqan::BamAlignmentRecord &rec,
+        bool genomebam, MapCounts &counts) {
+    if (!genomebam && seqan::hasFlagUnmapped(rec)) {
+        ++counts.unmappedFlag;
+    } else if (rec.rID != rec.rNextId && (genomebam
+                || seqan::hasFlagAllProper(rec))) {
+        ++counts.mateOtherRef;
+    } else {
+        ++counts.improperPair;
+    }
+}
+
+/**
+ * A UMI as a number: 2-bit packed with its length above, or for UMIs that
+ * are long or have other than ACGT, hashed with the top bit set.
+ */
+static uint64_t getUMIKey(const string &UMI) {
+    uint64_t code;
+    if (UMI.size() <= 28 && BusWriter::encode(UMI, code)) {
+        return code | ((uint64_t)UMI.size() << 56);
+    }
+    return hash<string>()(UMI) | (1ULL << 63);
+}
+
+/**
+ * Adds a finished read to the matrix, or records it as unmapped if its EC is
+ * empty: its records go to unmapped, the calling thread's buffer for the
+ * file's unmapped output, if there is one. If
+ * byCell, the read is counted in its cell's column, and not at all if it has
+ * no barcode.
+ */
+void Mapper::countRead(int fileNum, const string &qName, Read *read,
+        bool genomebam, OutputBuffers &buffers) {
+    vector<int> EC;
+    read->getEC(EC, genomebam);
+    if (EC.size() == 0) {
+        ++buffers.counts.unmapped;
+        if (unmappedWriters[fileNum] != nullptr) {
+            buffers.unmapped += read->getRecords();
+            if (buffers.unmapped.size() >= UNMAPPED_BUFFER_SIZE) {
+                flushOutput(fileNum, buffers);
             }
+        }
+    } else {
+        ++buffers.counts.mapped;
+        int column = byCell ? getCellColumn(read->getBarcode(), buffers)
+            : fileNum;
+        bool counted = column != -1
+            && !(collapseUMIs && read->getUMI().size() == 0);
+        int ecID = -1;
+        if (counted && !collapseUMIs) {
+            ecID = matrix->inc_TCC(EC, column);
+        } else if (counted || (busWriter != nullptr && column != -1)) {
+            ecID = matrix->add_TCC(EC);
+        }
+        /* Reads not counted in the matrix for want of a UMI still have a BUS
+         * record; those without a barcode don't. */
+        if (busWriter != nullptr && column != -1
+                && !appendBus(fileNum, read, ecID, buffers)) {
+            ++buffers.counts.busDropped;
+        }
+        if (column == -1) {
+            ++buffers.counts.noBarcode;
+            return;
+        }
+        if (collapseUMIs) {
+            if (!counted) {
+                ++buffers.counts.noUMI;
+                return;
+            }
+            buffers.molecules.push_back(Molecule{
+                    ((uint64_t)column << 32) | (uint32_t)ecID,
+                    getUMIKey(read->getUMI())});
+            if (buffers.molecules.size()
+                    >= 2 * buffers.uniqueMolecules + MOLECULE_BUFFER_SIZE) {
+                sortMolecules(buffers);
+            }
+        }
+#if READ_DIST
+        mappedQNamesSems[fileNum]->dec();
+#if DEBUG
+        if (mappedQNames[fileNum]->find(qName)
+                != mappedQNames[fileNum]->end()) {
+            cerr << "Read " << qName << " twice!" << endl;
+        }
+#endif
+        mappedQNames[fileNum]->emplace(qName);
+        mappedQNamesSems[fileNum]->inc();
+#endif
+    }
+}
+
+/**
+ * Whether the mate of the alignment at rec, among the alignments of its read
+ * in [begin, end), has an MC tag.
+ */
+static bool mateHasMateCigar(vector<seqan::BamAlignmentRecord>::iterator rec,
+        vector<seqan::BamAlignmentRecord>::iterator begin,
+        vector<seqan::BamAlignmentRecord>::iterator end) {
+    string mc;
+    for (auto mate = begin; mate != end; ++mate) {
+        if (mate != rec && mate->rID == rec->rNextId
+                && mate->rNextId == rec->rID && mate->beginPos == rec->pNext
+                && mate->pNext == rec->beginPos
+                && seqan::hasFlagFirst(*mate) != seqan::hasFlagFirst(*rec)) {
+            return getMateCigar(*mate, mc);
+        }
+    }
+    return false;
+}
+
+/**
+ * The matrix column of a cell barcode, added when first seen; -1 if the
+ * barcode is empty. Columns are looked up in the calling thread's buffers
+ * first, so that cellColumnsSem is only taken for barcodes new to the thread.
+ */
+int Mapper::getCellColumn(const string &barcode, OutputBuffers &buffers) {
+    if (barcode.size() == 0) { return -1; }
+    auto cached = buffers.cellColumns.find(barcode);
+    if (cached != buffers.cellColumns.end()) { return cached->second; }
+    Trace::lock(cellColumnsSem, "lock cells");
+    auto it = cellColumns.find(barcode);
+    int column = it != cellColumns.end() ? it->second
+        : cellColumns.emplace(barcode, matrix->add_file()).first->second;
+    cellColumnsSem.inc();
+    buffers.cellColumns.emplace(barcode, column);
+    return column;
+}
+
+/**
+ * Gets the barcode of rec (its cellTag, or if that is CB and missing, its CR)
+ * corrected against the whitelist. Returns false if it has none, or it is not
+ * listed and can't be corrected.
+ */
+bool Mapper::getWhitelisted(const seqan::BamAlignmentRecord &rec,
+        string &barcode) {
+    size_t size = seqan::length(rec.tags);
+    if (size == 0) { return false; }
+    if (!getStringTag(&rec.tags[0], size, cellTag.c_str(), barcode)
+            && (cellTag.compare("CB") != 0
+                || !getStringTag(&rec.tags[0], size, "CR", barcode))) {
+        return false;
+    }
+    return whitelist->correct(barcode);
+}
+
+/**
+ * Adds a BUS record of read, counted with EC ecID, to buffers. The barcode
+ * and UMI are its cellTag and UB tags; those without a UB get the UMI 0. A
+ * -1 suffix of the barcode, as CellRanger writes, is left out. The flags hold
+ * the file number. Returns false, adding nothing, if the barcode is not
+ * made of ACGT only (or too long) to be encoded.
+ */
+bool Mapper::appendBus(int fileNum, const Read *read, int ecID,
+        OutputBuffers &buffers) {
+    uint64_t barcode = 0, UMI = 0;
+    size_t length = min(read->getBarcode().find('-'),
+            read->getBarcode().size());
+    if (length == 0
+            || !BusWriter::encode(read->getBarcode(), barcode, length)) {
+        return false;
+    }
+    buffers.barcodeLength = max(buffers.barcodeLength, (uint32_t)length);
+    if (BusWriter::encode(read->getUMI(), UMI)) {
+        buffers.UMILength = max(buffers.UMILength,
+                (uint32_t)read->getUMI().size());
+    } else {
+        UMI = 0;
+    }
+    BusWriter::appendRecord(buffers.bus, barcode, UMI, ecID, fileNum);
+    if (buffers.bus.size() >= BUS_BUFFER_SIZE) {
+        flushOutput(fileNum, buffers);
+    }
+    return true;
+}
+
+/**
+ * Hands a thread's buffered unmapped records to the file's unmapped output,
+ * and its BUS records to the BUS output.
+ */
+void Mapper::flushOutput(int fileNum, OutputBuffers &buffers) {
+    TraceSpan span("flush", "io", fileNum);
+    if (!buffers.unmapped.empty() && unmappedWriters[fileNum] != nullptr) {
+        unmappedWriters[fileNum]->write(buffers.unmapped);
+    }
+    buffers.unmapped.clear();
+    if (!buffers.bus.empty() && busWriter != nullptr) {
+        busWriter->write(buffers.bus, buffers.barcodeLength,
+                buffers.UMILength);
+    }
+    buffers.bus.clear();
+    if (!buffers.molecules.empty()) {
+        addMolecules(buffers);
+    }
+    if (stats != nullptr && buffers.counts.records
+            + buffers.counts.mapped + buffers.counts.unmapped != 0) {
+        stats->addCounts(fileNum, buffers.chrom, buffers.counts);
+    }
+    buffers.counts = MapCounts();
+}
+
+/**
+ * Sorts and deduplicates a thread's molecules. Done whenever they have doubled
+ * since last time, so that memory stays in proportion to the number of
+ * distinct molecules.
+ */
+void Mapper::sortMolecules(OutputBuffers &buffers) {
+    sort(buffers.molecules.begin(), buffers.molecules.end());
+    buffers.molecules.erase(unique(buffers.molecules.begin(),
+                buffers.molecules.end()), buffers.molecules.end());
+    buffers.uniqueMolecules = buffers.molecules.size();
+}
+
+/**
+ * Hands a thread's molecules, deduplicated, over to moleculeRuns, leaving
+ * its buffer empty.
+ */
+void Mapper::addMolecules(OutputBuffers &buffers) {
+    sortMolecules(buffers);
+    Trace::lock(moleculesSem, "lock molecules");
+    moleculeRuns.push_back(vector<Molecule>());
+    moleculeRuns.back().swap(buffers.molecules);
+    moleculesSem.inc();
+    buffers.uniqueMolecules = 0;
+}
+
+/**
+ * Counts each distinct molecule once in the matrix, once mapping is done.
+ */
+void Mapper::countMolecules() {
+    TraceSpan span("count molecules", "finalize");
+    size_t total = 0;
+    for (auto run = moleculeRuns.begin(); run != moleculeRuns.end(); ++run) {
+        total += run->size();
+    }
+    vector<Molecule> molecules;
+    molecules.reserve(total);
+    for (auto run = moleculeRuns.begin(); run != moleculeRuns.end(); ++run) {
+        molecules.insert(molecules.end(), run->begin(), run->end());
+        vector<Molecule>().swap(*run);
+    }
+    moleculeRuns.clear();
+    sort(molecules.begin(), molecules.end());
+    molecules.erase(unique(molecules.begin(), molecules.end()),
+            molecules.end());
+    for (size_t i = 0; i < molecules.size();) {
+        size_t j = i;
+        while (j < molecules.size()
+                && molecules[j].columnEC == molecules[i].columnEC) {
+            ++j;
+        }
+        matrix->add_count((uint32_t)molecules[i].columnEC,
+                molecules[i].columnEC >> 32, j - i);
+        i = j;
+    }
+}
+
+/**
+ * Maps one alignment of a coordinate-sorted file against chrom, the
+ * transcripts of its chromosome that it has not yet passed, and adds it to its
+ * read.
+ *
+ * @param in        the input rec was just read from, to decode the parts of it
+ *                  that readRecord left out once they are needed, or nullptr
+ *                  if rec is complete.
+ * @param raw       the alignment as stored in the input, to be kept with its
+ *                  read for unmapped output, or nullptr.
+ * @param id        (RapMap only) transcript ID of the alignment's reference.
+ * @param buffers   the calling thread's output buffers (see countRead).
+ * @return          false once there are no transcripts left in chrom, i.e. the
+ *                  rest of the chromosome need not be read.
+ */
+bool Mapper::mapRecord(int fileNum, seqan::BamAlignmentRecord &rec,
+        SamInput *in, const string *raw, deque<Transcript> &chrom, int id,
+        bool genomebam, bool rapmap, bool sameQName, OutputBuffers &buffers) {
+    ++buffers.counts.records;
+    string barcode;
+    if (whitelist != nullptr) {
+        decode(in, rec, BAM_FIELD_TAGS);
+    }
+    if (whitelist != nullptr && !getWhitelisted(rec, barcode)) {
+        ++buffers.counts.barcodeDropped;
+        return true;
+    }
+    vector<int> EC;
+    /* mateResolved: EC already covers both mates (from the MC tag).
+     * mateSkipped: the leftmost mate resolved this pair, so ignore. */
+    bool mateResolved = false, mateSkipped = false, countable = false;
+    /* rightMate: the rightmost mate, without an MC tag, of a pair its
+     * leftmost mate may have resolved. */
+    bool rightMate = false;
+    if (rapmap) {
+        if (!isCountable(rec, false)) {
+            countRejected(rec, false, buffers.counts);
+        } else if (rec.rID == seqan::BamAlignmentRecord::INVALID_REFID) {
+            decode(in, rec, BAM_FIELD_QNAME);
+            cerr << "Unexpectedly unable to find REFID for "
+                << seqan::toCString(rec.qName) << endl;
+            ++buffers.counts.notAnnotated;
+        } else {
+            EC = {id};
+            countable = true;
+        }
+    } else {
+        while (!chrom.empty()
+            && chrom.front().getEnd() <= rec.beginPos) {
+            chrom.pop_front();
+        }
+        if (chrom.empty()) {
+            ++buffers.counts.pastAnnotation;
+            return false;
+        }
+
+        countable = isCountable(rec, genomebam);
+        if (!countable) {
+            countRejected(rec, genomebam, buffers.counts);
         } else {
-            while (!chrom.empty()
-                && chrom.front().getEnd() <= rec.beginPos) {
-                chrom.pop_front();
-            }
-            if (chrom.empty()) { return true; }
-
-            if ((!genomebam && !seqan::hasFlagUnmapped(rec)
-                    && (!seqan::hasFlagMultiple(rec)
-                        || (seqan::hasFlagAllProper(rec)
-                            && rec.rID == rec.rNextId)))
-                    || (genomebam && (!paired || (rec.rID == rec.rNextId
-                            && seqan::hasFlagMultiple(rec)))))
-            {
-                vector<Exon> alignmentExons = getAlignmentExons(rec);
+            decode(in, rec, BAM_FIELD_CIGAR | BAM_FIELD_TAGS);
+            vector<Exon> alignmentExons = getAlignmentExons(rec);
+            string mc;
+            /* The leftmost mate resolves the pair if it has an MC tag. The
+             * other mate, which comes later, is skipped if it has one; else
+             * it is matched against its read below. Mates at the same
+             * position may come in either order, so are paired as usual. A
+             * pair whose right mate alone has the tag waits for the end of
+             * the file, where it is counted from its left mate alone. With
+             * unmapped output (raw), right mates still reach their read to
+             * be kept with it, so resolved reads wait for them. */
+            if (mateCigar && !genomebam && seqan::hasFlagMultiple(rec)
+                    && rec.beginPos != rec.pNext) {
+                bool hasMC = getMateCigar(rec, mc);
+                mateResolved = hasMC && isLeftMate(rec);
+                mateSkipped = hasMC && !mateResolved;
+                rightMate = !hasMC && !isLeftMate(rec);
+            }
+            if (mateResolved) {
+                vector<Exon> mateExons = getAlignmentExons(rec.pNext, mc);
+                buffers.counts.tested += chrom.size();
+                for (auto it = chrom.begin(); it != chrom.end(); ++it) {
+                    if (it->mapsToTranscript(alignmentExons, genomebam)
+                            && it->mapsToTranscript(mateExons, genomebam)) {
+                        EC.push_back(it->getID());
+                    }
+                }
+            } else if (!mateSkipped) {
+                buffers.counts.tested += chrom.size();
                 for (auto it = chrom.begin(); it != chrom.end(); ++it) {
                     if (it->mapsToTranscript(alignmentExons, genomebam)) {
                         EC.push_back(it->getID());
@@ -204,67 +653,533 @@ bool Mapper::readSAM(FileMetaInfo &inf, deque<Transcript> &chrom,
                 }
             }
         }
+    }
 
-        string qName = seqan::toCString(rec.qName);
-        if (!sameQName) {
-            qName = qName.substr(0, qName.size() - 2);
-        }
+    if (mateSkipped) {
+        ++buffers.counts.mateSkipped;
+        if (raw == nullptr) { return true; }
+    } else if (countable) {
+        ++(EC.empty() ? buffers.counts.noTranscript : buffers.counts.matched);
+    }
 
-        readsSems[inf.fileNum]->dec();
-        Read *read;
-        if (reads[inf.fileNum]->find(qName) == reads[inf.fileNum]->end()) {
-            read = new Read(rec, EC);
-            reads[inf.fileNum]->emplace(qName, read);
-        } else {
-            read = reads[inf.fileNum]->at(qName);
+    decode(in, rec, BAM_FIELD_QNAME | BAM_FIELD_TAGS);
+    string qName = seqan::toCString(rec.qName);
+    if (!sameQName) {
+        qName = qName.substr(0, qName.size() - 2);
+    }
+
+    Trace::lock(*readsSems[fileNum], "lock reads");
+    Read *read;
+    if (reads[fileNum]->find(qName) == reads[fileNum]->end()) {
+        if (rightMate || mateSkipped) {
+            /* Its leftmost mate resolved the pair and completed the read. */
+            readsSems[fileNum]->inc();
+            return true;
+        }
+        read = new Read(rec, EC, mateResolved, raw == nullptr,
+                cellTag.c_str());
+        if (whitelist != nullptr) { read->setBarcode(barcode); }
+        reads[fileNum]->emplace(qName, read);
+    } else {
+        read = reads[fileNum]->at(qName);
+        if (mateResolved) {
+            read->addPair(rec, EC, raw == nullptr);
+        } else if (mateSkipped) {
+            read->addSkippedMate(rec);
+        } else if (!rightMate || !read->addResolvedMate(rec, raw == nullptr)) {
             read->addAlignment(rec, EC, genomebam);
         }
-        bool complete = read->isComplete();
-        if (!genomebam && complete) {
-            reads[inf.fileNum]->erase(qName);
+    }
+    if (raw != nullptr) {
+        read->addRecord(*raw);
+    }
+    bool complete = read->isComplete();
+    if (!genomebam && complete) {
+        reads[fileNum]->erase(qName);
+    }
+    readsSems[fileNum]->inc();
+
+    if (!genomebam && complete) {
+        countRead(fileNum, qName, read, genomebam, buffers);
+        delete read;
+    }
+    return true;
+}
+
+bool Mapper::readSAM(FileMetaInfo &inf, deque<Transcript> &chrom,
+        bool genomebam, bool rapmap, bool sameQName) {
+    SamInput in;
+    if (!in.open(sams[inf.fileNum])) { return false; }
+    seqan::BamAlignmentRecord rec;
+    string raw;
+    OutputBuffers buffers;
+    buffers.chrom = inf.name;
+    bool keepRaw = unmappedWriters[inf.fileNum] != nullptr;
+    /* Number of records left to map, or -1 to map the whole byte range. */
+    int count = -1;
+    if (!in.setRange(inf.startByte, inf.endByte)) {
+        for (int line = 1; line < inf.start && !in.atEnd(); ++line) {
+            in.readRecord(rec, nullptr, 0);
         }
-        readsSems[inf.fileNum]->inc();
+        count = inf.end - inf.start;
+    }
 
-        if (!genomebam && complete) {
-            string stringEC = read->getEC(genomebam);
-            if (stringEC.size() == 0) {
-                if (recordUnmapped) {
-                    unmappedQNamesSems[inf.fileNum]->dec();
-                    unmappedQNames[inf.fileNum]->emplace(qName);
-                    unmappedQNamesSems[inf.fileNum]->inc();
-                }
+    /* Transcript ID of each reference ID, looked up once from the header. */
+    vector<int> refs;
+    if (rapmap) {
+        getRefs(in, rapmap, refs);
+    }
+
+    while (count != 0 && !in.atEnd()) {
+        long long offset = keepRaw ? in.tell() : -1;
+        /* Only the flag and positions; mapRecord decodes the rest as needed. */
+        in.readRecord(rec, keepRaw ? &raw : nullptr, 0);
+        --count;
+        int id = rec.rID;
+        if (rapmap && rec.rID != seqan::BamAlignmentRecord::INVALID_REFID) {
+            if (rec.rID >= refs.size()) {
+                /* SAM references missing from the header are added as met. */
+                refs.clear();
+                getRefs(in, rapmap, refs);
             }
-            else {
-                matrix->inc_TCC(stringEC, inf.fileNum);
-#if READ_DIST
-                mappedQNamesSems[inf.fileNum]->dec();
+            id = refs[rec.rID];
+        }
+        if (!mapRecord(inf.fileNum, rec, &in, keepRaw ? &raw : nullptr, chrom,
+                    id, genomebam, rapmap, sameQName, buffers)) {
+            if (keepRaw && count == -1) {
+                /* The rest may hold alignments of reads yet to be written as
+                 * unmapped; it is read (and counted) by attachSkipped. */
+                --buffers.counts.records;
+                --buffers.counts.pastAnnotation;
+                FileMetaInfo tail(inf.fileNum, -1, -1, -1, offset,
+                        inf.endByte);
+                tail.name = inf.name;
+                readsSems[inf.fileNum]->dec();
+                skipped[inf.fileNum]->push_back(tail);
+                readsSems[inf.fileNum]->inc();
+                break;
+            }
+            /* The rest of the range is only read to be counted. */
+            while (stats != nullptr && count != 0 && !in.atEnd()) {
+                in.readRecord(rec, nullptr, 0);
+                --count;
+                ++buffers.counts.records;
+                ++buffers.counts.pastAnnotation;
+            }
+            break;
+        }
 #if DEBUG
-                if (mappedQNames[inf.fileNum]->find(qName)
-                        != mappedQNames[inf.fileNum]->end()) {
-                    cerr << "Read " << qName << " twice!" << endl;
-                }
-#endif
-                mappedQNames[inf.fileNum]->emplace(qName);
-                mappedQNamesSems[inf.fileNum]->inc();
+        //cout << "." << flush;
 #endif
-            }
+    }
+
+    flushOutput(inf.fileNum, buffers);
+    return true;
+}
+
+/**
+ * Maps a batch of whole qname groups from a collated (name-grouped) file. Each
+ * group is every alignment of one read, so its EC is final once the group
+ * ends. Takes ownership of batch and raw.
+ *
+ * @param raw       the batch's records as stored in the input, for unmapped
+ *                  output, or nullptr.
+ * @param refs      for each reference ID of the file, the transcript ID
+ *                  (RapMap) or the annotation chromosome index (otherwise).
+ */
+bool Mapper::mapCollated(int fileNum,
+        vector<seqan::BamAlignmentRecord> *batch, vector<string> *raw,
+        const vector<int> &refs, bool genomebam, bool rapmap, bool sameQName) {
+    TraceSpan span("map batch", "task", fileNum);
+    Read *read = nullptr;
+    string qName, barcode;
+    OutputBuffers buffers;
+    auto readName = [sameQName](const seqan::BamAlignmentRecord &rec) {
+        string name = seqan::toCString(rec.qName);
+        return sameQName ? name : name.substr(0, name.size() - 2);
+    };
+    /* The alignments of the current read. */
+    auto groupBegin = batch->begin(), groupEnd = batch->begin();
+    for (auto rec = batch->begin(); rec != batch->end(); ++rec) {
+        string name = readName(*rec);
+        if (read != nullptr && name.compare(qName) != 0) {
+            countRead(fileNum, qName, read, genomebam, buffers);
             delete read;
+            read = nullptr;
+        }
+        if (rec == groupEnd) {
+            groupBegin = rec;
+            while (groupEnd != batch->end() && readName(*groupEnd) == name) {
+                ++groupEnd;
+            }
+        }
+        qName = name;
+        ++buffers.counts.records;
+        if (whitelist != nullptr && !getWhitelisted(*rec, barcode)) {
+            ++buffers.counts.barcodeDropped;
+            continue;
         }
 
-        ++line;
+        vector<int> EC;
+        bool mateResolved = false, mateSkipped = false;
+        bool validRef = rec->rID != seqan::BamAlignmentRecord::INVALID_REFID
+            && rec->rID < refs.size();
+        bool countable = isCountable(*rec, !rapmap && genomebam);
+        if (!countable) {
+            countRejected(*rec, !rapmap && genomebam, buffers.counts);
+        } else if (!validRef || (!rapmap && refs[rec->rID] == -1)) {
+            ++buffers.counts.notAnnotated;
+            countable = false;
+        } else if (rapmap) {
+            EC = {refs[rec->rID]};
+        } else {
+            vector<Exon> alignmentExons = getAlignmentExons(*rec);
+            string mc;
+            /* Only pairs whose mates both have an MC tag are resolved from
+             * it; the read's alignments are all in its group. */
+            if (mateCigar && !genomebam && seqan::hasFlagMultiple(*rec)
+                    && getMateCigar(*rec, mc)
+                    && mateHasMateCigar(rec, groupBegin, groupEnd)) {
+                mateResolved = isLeftMate(*rec);
+                mateSkipped = !mateResolved;
+            }
+            if (mateResolved) {
+                vector<Exon> mateExons = getAlignmentExons(rec->pNext, mc);
+                buffers.counts.tested += annotation->getEC(refs[rec->rID],
+                        alignmentExons, genomebam, EC, &mateExons);
+            } else if (!mateSkipped) {
+                buffers.counts.tested += annotation->getEC(refs[rec->rID],
+                        alignmentExons, genomebam, EC);
+            }
+        }
+        if (mateSkipped) {
+            ++buffers.counts.mateSkipped;
+            continue;
+        }
+        if (countable) {
+            ++(EC.empty() ? buffers.counts.noTranscript
+                    : buffers.counts.matched);
+        }
+
+        if (read == nullptr) {
+            read = new Read(*rec, EC, mateResolved, true, cellTag.c_str());
+            if (whitelist != nullptr) { read->setBarcode(barcode); }
+            /* Every record of the group, including skipped mates, goes to
+             * the unmapped output. */
+            for (auto r = groupBegin; raw != nullptr && r != groupEnd; ++r) {
+                read->addRecord((*raw)[r - batch->begin()]);
+            }
+        } else if (mateResolved) {
+            read->addPair(*rec, EC);
+        } else {
+            read->addAlignment(*rec, EC, genomebam);
+        }
+    }
+    if (read != nullptr) {
+        countRead(fileNum, qName, read, genomebam, buffers);
+        delete read;
+    }
+    flushOutput(fileNum, buffers);
+    delete batch;
+    delete raw;
+    return true;
+}
+
+/**
+ * For each reference ID of in, the transcript ID (RapMap) or the index of the
+ * chromosome in the annotation (otherwise), -1 if there is none.
+ */
+void Mapper::getRefs(SamInput &in, bool rapmap, vector<int> &refs) {
+    int count = in.getContigCount();
+    for (int i = 0; i < count; ++i) {
+        string name = in.getContigName(i);
+        if (!rapmap) {
+            refs.push_back(annotation->getChromIndex(name));
+        } else if (indexMap->size()) {
+            auto it = indexMap->find(name);
+            refs.push_back(it == indexMap->end() ? -1 : it->second);
+        } else {
+            refs.push_back(i);
+        }
+    }
+}
+
+/**
+ * Maps a whole file whose alignments are grouped by qname (e.g. straight from
+ * the aligner), without holding unfinished reads. The file is read once, in
+ * order, and cut into batches of whole groups that are mapped by up to
+ * nThreads threads against the whole-genome annotation.
+ */
+bool Mapper::readSAMCollated(int fileNum, int nThreads, bool genomebam,
+        bool rapmap, bool sameQName) {
+    SamInput in;
+    if (!in.open(sams[fileNum])) { return false; }
+    return readSAMCollated(fileNum, in, nThreads, genomebam, rapmap,
+            sameQName);
+}
+
+bool Mapper::readSAMCollated(int fileNum, SamInput &in, int nThreads,
+        bool genomebam, bool rapmap, bool sameQName) {
+    annotationSem.dec();
+    if (!rapmap && annotation == nullptr) {
+        Stats::Clock clock = Stats::start(true);
+        annotation = new Annotation;
+        loadAnnotation();
+        if (stats != nullptr) {
+            stats->endStage("gff_load", clock);
+        }
+    }
+    annotationSem.inc();
+    vector<int> refs;
+    getRefs(in, rapmap, refs);
+
+    future<bool> threads[nThreads];
+    int batches = 0;
+    bool keepRaw = unmappedWriters[fileNum] != nullptr;
+    auto *batch = new vector<seqan::BamAlignmentRecord>;
+    auto *raw = keepRaw ? new vector<string> : nullptr;
+    string qName, line;
+    seqan::BamAlignmentRecord rec;
+    while (!in.atEnd()) {
+        in.readRecord(rec, keepRaw ? &line : nullptr);
+        string name = seqan::toCString(rec.qName);
+        if (!sameQName) {
+            name = name.substr(0, name.size() - 2);
+        }
+        if (batch->size() >= COLLATED_BATCH_SIZE && name.compare(qName) != 0) {
+            future<bool> &thread = threads[batches++ % nThreads];
+            uint64_t wait = Trace::beginWait();
+            if (thread.valid() && !thread.get()) {
+                cerr << "  WARNING: thread failed." << endl;
+            }
+            Trace::endWait("wait thread", wait);
+            thread = async(launch::async, &Mapper::mapCollated, this,
+                    fileNum, batch, raw, cref(refs), genomebam, rapmap,
+                    sameQName);
+            batch = new vector<seqan::BamAlignmentRecord>;
+            raw = keepRaw ? new vector<string> : nullptr;
+        }
+        qName = name;
+        batch->push_back(rec);
+        if (keepRaw) {
+            raw->push_back(line);
+        }
+    }
+    bool success = mapCollated(fileNum, batch, raw, refs, genomebam, rapmap,
+            sameQName);
+    for (int i = 0; i < nThreads; ++i) {
+        if (threads[i].valid() && !threads[i].get()) {
+            cerr << "  WARNING: thread failed." << endl;
+            success = false;
+        }
+    }
+    return success;
+}
+
+/**
+ * Maps one chromosome of a streamed file, taking its alignments in batches
+ * from records until it is closed. Takes ownership of records.
+ */
+bool Mapper::mapStreamChrom(FileMetaInfo &gffInf, int fileNum,
+        RecordQueue *records, bool genomebam, bool sameQName,
+        int thread, condition_variable &cv, mutex &m, queue<int> &completed) {
+    TraceSpan span("map chromosome", "task", fileNum, &gffInf.name);
+    Stats::Clock clock = Stats::start(true);
+    deque<Transcript> chrom;
+    bool success = readGFF(gffInf, chrom), mapping = success;
+    vector<seqan::BamAlignmentRecord> *batch;
+    OutputBuffers buffers;
+    buffers.chrom = gffInf.name;
+    /* Keep draining records once the chromosome is done so that the reader
+     * never blocks on it. */
+    uint64_t wait = Trace::beginWait();
+    while (records->pop(batch)) {
+        Trace::endWait("wait records", wait);
+        auto rec = batch->begin();
+        for (; mapping && rec != batch->end(); ++rec) {
+            mapping = mapRecord(fileNum, *rec, nullptr, nullptr, chrom,
+                    rec->rID, genomebam, false, sameQName, buffers);
+        }
+        buffers.counts.records += batch->end() - rec;
+        buffers.counts.pastAnnotation += batch->end() - rec;
+        delete batch;
+        wait = Trace::beginWait();
+    }
+    delete records;
+    flushOutput(fileNum, buffers);
+    if (stats != nullptr) {
+        stats->endChrom(gffInf.name, clock);
+    }
+
+    m.lock();
+    completed.push(thread);
+    m.unlock();
+    cv.notify_one();
+    return success;
+}
+
+/**
+ * Maps batches of a streamed RapMap file from records until it is closed.
+ * Any number of threads may share records.
+ */
+bool Mapper::mapStreamBatches(int fileNum, RecordQueue *records,
+        const vector<int> &refs, bool genomebam, bool sameQName) {
+    TraceSpan span("map batches", "task", fileNum);
+    deque<Transcript> chrom;
+    vector<seqan::BamAlignmentRecord> *batch;
+    OutputBuffers buffers;
+    uint64_t wait = Trace::beginWait();
+    while (records->pop(batch)) {
+        Trace::endWait("wait records", wait);
+        for (auto rec = batch->begin(); rec != batch->end(); ++rec) {
+            int id = rec->rID >= 0 && rec->rID < refs.size()
+                ? refs[rec->rID] : rec->rID;
+            mapRecord(fileNum, *rec, nullptr, nullptr, chrom, id, genomebam,
+                    true, sameQName, buffers);
+        }
+        delete batch;
+        wait = Trace::beginWait();
+    }
+    flushOutput(fileNum, buffers);
+    return true;
+}
+
+/**
+ * Maps a file that can only be read once, such as stdin or a named pipe. The
+ * header and a short lookahead stand in for the usual pre-scans of the file,
+ * and a new task is started every time the reference ID changes. The file
+ * must be sorted by coordinate unless running in collated mode. genomebam
+ * and rapmap are set from the header's PG unless given on the command line.
+ */
+bool Mapper::mapStream(int fileNum, int nThreads, bool &genomebam,
+        bool &rapmap) {
+    SamInput in;
+    if (!in.open(sams[fileNum])) { return false; }
+    bool sameQName;
+    if ((!pgProvided && !getPG(in.getPGName(), genomebam, rapmap))
+            || !getSameQName(in, sameQName)) {
+        return false;
+    }
 #if DEBUG
-        //cout << "." << flush;
+    debugOutSem.dec();
+    cout << sams[fileNum] << ": sameQName:" << sameQName << " genomebam:"
+        << genomebam << " rapmap:" << rapmap << endl;
+    debugOutSem.inc();
 #endif
-        if (line == inf.end) { break; }
-        readRecord(rec, bam);
+    if (collated) {
+        return readSAMCollated(fileNum, in, nThreads, genomebam, rapmap,
+                sameQName);
     }
 
+    future<bool> threads[nThreads];
+    auto *batch = new vector<seqan::BamAlignmentRecord>;
+    seqan::BamAlignmentRecord rec;
+    if (rapmap) {
+        vector<int> refs;
+        getRefs(in, rapmap, refs);
+        RecordQueue records(STREAM_QUEUE_SIZE * nThreads);
+        for (int i = 0; i < nThreads; ++i) {
+            threads[i] = async(launch::async, &Mapper::mapStreamBatches, this,
+                    fileNum, &records, cref(refs), genomebam, sameQName);
+        }
+        while (!in.atEnd()) {
+            in.readRecord(rec);
+            batch->push_back(rec);
+            if (batch->size() == STREAM_BATCH_SIZE) {
+                records.push(batch);
+                batch = new vector<seqan::BamAlignmentRecord>;
+            }
+        }
+        records.push(batch);
+        records.close();
+        for (int i = 0; i < nThreads; ++i) {
+            if (!threads[i].get()) {
+                cerr << "  WARNING: thread failed." << endl;
+            }
+        }
+        return true;
+    }
+
+    condition_variable cv;
+    mutex m;
+    queue<int> completed;
+    for (int i = 0; i < nThreads; ++i) {
+        completed.push(i);
+    }
+    RecordQueue *records = nullptr;
+    /* Counts of the records of unannotated references, which are skipped. */
+    OutputBuffers skipped;
+    int currRef = seqan::BamAlignmentRecord::INVALID_REFID - 1;
+    while (!in.atEnd()) {
+        in.readRecord(rec);
+        if (rec.rID != currRef) {
+            flushOutput(fileNum, skipped);
+            if (records != nullptr) {
+                records->push(batch);
+                records->close();
+                records = nullptr;
+                batch = new vector<seqan::BamAlignmentRecord>;
+            }
+            currRef = rec.rID;
+            auto chrom = chroms.end();
+            skipped.chrom = "*";
+            if (currRef != seqan::BamAlignmentRecord::INVALID_REFID) {
+                skipped.chrom = in.getContigName(currRef);
+                chrom = chroms.find(skipped.chrom);
+            }
+            if (chrom != chroms.end()) {
+                unique_lock<mutex> lk(m);
+                if (completed.empty()) {
+                    uint64_t wait = Trace::beginWait();
+                    cv.wait(lk, [&completed] { return !completed.empty(); });
+                    Trace::endWait("wait thread", wait);
+                }
+                int done = completed.front();
+                completed.pop();
+                lk.unlock();
+                if (threads[done].valid() && !threads[done].get()) {
+                    cerr << "  WARNING: thread failed." << endl;
+                }
+                records = new RecordQueue(STREAM_QUEUE_SIZE);
+                threads[done] = async(launch::async, &Mapper::mapStreamChrom,
+                        this, ref(chrom->second), fileNum, records,
+                        genomebam, sameQName,
+                        done, ref(cv), ref(m), ref(completed));
+            }
+        }
+        if (records == nullptr) {
+            ++skipped.counts.records;
+            ++(seqan::hasFlagUnmapped(rec) ? skipped.counts.unmappedFlag
+                    : skipped.counts.notAnnotated);
+            continue;
+        }
+        batch->push_back(rec);
+        if (batch->size() == STREAM_BATCH_SIZE) {
+            records->push(batch);
+            batch = new vector<seqan::BamAlignmentRecord>;
+        }
+    }
+    flushOutput(fileNum, skipped);
+    if (records != nullptr) {
+        records->push(batch);
+        records->close();
+    } else {
+        delete batch;
+    }
+    for (int i = 0; i < nThreads; ++i) {
+        if (threads[i].valid() && !threads[i].get()) {
+            cerr << "  WARNING: thread failed." << endl;
+        }
+    }
     return true;
 }
 
 bool Mapper::mapToChrom(FileMetaInfo &gffInf, FileMetaInfo samInf,
         bool genomebam, bool rapmap, bool sameQName,
         int thread, condition_variable &cv, mutex &m, queue<int> &completed) {
+    TraceSpan span(rapmap ? "map range" : "map chromosome", "task",
+            samInf.fileNum, &gffInf.name);
+    Stats::Clock clock = Stats::start(true);
     deque<Transcript> *chrom = new deque<Transcript>;
 #if DEBUG
     debugOutSem.dec();
@@ -285,6 +1200,9 @@ bool Mapper::mapToChrom(FileMetaInfo &gffInf, FileMetaInfo samInf,
         return false;
     }
     delete chrom;
+    if (stats != nullptr && !rapmap) {
+        stats->endChrom(gffInf.name, clock);
+    }
 
     m.lock();
     completed.push(thread);
@@ -338,151 +1256,155 @@ bool Mapper::getChromsGFF(int filenumber, int &transcriptCount) {
 bool Mapper::getChromsSAM(int filenumber,
         unordered_map<string, FileMetaInfo> &inf) {
     if (hasSAMExt(sams[filenumber])) {
-        ifstream in(sams[filenumber]);
-        if (!in.is_open()) { return false; }
+        SamReader in;
+        if (!in.open(sams[filenumber])) { return false; }
 
-        string inp, currChrom;
+        SamField inp;
+        string currChrom;
         int line = 0, start;
-        while(getline(in, inp)) {
-            if (inp.size() == 0 || inp[0] == '@') { continue; }
+        size_t startByte = 0;
+        while (in.nextLine(inp)) {
             ++line;
-            string chrom = parseString(inp, "\t", 3)[2];
-            if (chrom.compare("*") == 0) { continue; }
-            currChrom = chrom;
+            SamField chrom = SamReader::getField(inp, 2);
+            if (chrom.equals("*")) { continue; }
+            currChrom = chrom.str();
             start = line;
+            startByte = in.offsetOf(inp);
             break;
         }
-        while(getline(in, inp)) {
-            if (inp.size() == 0 || inp[0] == '@') { continue; }
+        while (in.nextLine(inp)) {
             ++line;
-            string chrom = parseString(inp, "\t", 3)[2];
-            if (chrom.compare(currChrom) != 0) {
-                inf.emplace(currChrom,
-                        FileMetaInfo(filenumber, start, line, -1));
+            SamField chrom = SamReader::getField(inp, 2);
+            if (!chrom.equals(currChrom)) {
+                size_t offset = in.offsetOf(inp);
+                inf.emplace(currChrom, FileMetaInfo(filenumber, start, line,
+                            -1, startByte, offset));
                 start = line;
-                currChrom = chrom;
+                startByte = offset;
+                currChrom = chrom.str();
             }
         }
-        inf.emplace(currChrom, FileMetaInfo(filenumber, start, line + 1, -1));
-        in.close();
+        inf.emplace(currChrom, FileMetaInfo(filenumber, start, line + 1, -1,
+                    startByte, in.getSize()));
     } else {
-        seqan::BamFileIn bam;
-        if (!seqan::open(bam, sams[filenumber].c_str())) { return false; }
-        seqan::BamHeader head;
-        seqan::readHeader(head, bam);
-        seqan::BamAlignmentRecord rec;
+        BamReader in;
+        if (!in.open(sams[filenumber])) { return false; }
+        BamRecordView rec;
+        int currRID = 0, line = 0, start = 1;
+        long long offset = in.tell(), startOffset = offset;
         string currChrom = "";
-        int line = 0, start;
-        while (!seqan::atEnd(bam)) {
-            seqan::readRecord(rec, bam);
+        while (in.nextRecord(rec)) {
             ++line;
-            string chrom;
-            if (rec.rID == seqan::BamAlignmentRecord::INVALID_REFID) {
-                chrom = "*";
-            } else {
-                chrom = seqan::toCString(seqan::getContigName(rec, bam));
-            }
-            if (currChrom.size() == 0) {
-                start = line;
-                currChrom = chrom;
-            } else if (currChrom.compare(chrom) != 0) {
-                inf.emplace(currChrom,
-                        FileMetaInfo(filenumber, start, line, -1));
+            if (currChrom.size() == 0 || rec.rID() != currRID) {
+                string chrom =
+                    rec.rID() == seqan::BamAlignmentRecord::INVALID_REFID
+                    ? "*" : in.getContigName(rec.rID());
+                if (currChrom.size() != 0) {
+                    inf.emplace(currChrom, FileMetaInfo(filenumber, start,
+                                line, -1, startOffset, offset));
+                }
                 start = line;
+                startOffset = offset;
                 currChrom = chrom;
+                currRID = rec.rID();
             }
+            offset = in.tell();
         }
-        inf.emplace(currChrom, FileMetaInfo(filenumber, start, line + 1, -1));
+        inf.emplace(currChrom, FileMetaInfo(filenumber, start, line + 1, -1,
+                    startOffset, LLONG_MAX));
     }
-    return true; 
+    for (auto it = inf.begin(); it != inf.end(); ++it) {
+        it->second.name = it->first;
+    }
+    return true;
 }
 
-bool Mapper::getChromsGFFs() {
-    int transcript_count = 0;
+/**
+ * Indexes the chromosomes of all GFFs.
+ *
+ * @param transcriptCount   set to a bound on the IDs given to transcripts.
+ */
+bool Mapper::getChromsGFFs(int &transcriptCount) {
+    transcriptCount = 0;
     for (int i = 0; i < gffs.size(); ++i) {
-        if (!getChromsGFF(i, transcript_count)) {
+        if (!getChromsGFF(i, transcriptCount)) {
             cerr << "WARNING: error while reading " << gffs[i] << endl;
         }
     }
+    for (auto it = chroms.begin(); it != chroms.end(); ++it) {
+        it->second.name = it->first;
+    }
+    return true;
+}
+
+/**
+ * Looks at one more qName to decide whether both segments of a read are named
+ * the same (as opposed to e.g. read/1 and read/2).
+ *
+ * @return      true if more qNames are needed, false once same is decided.
+ */
+bool checkQName(const string &qName, bool &one_seen, bool &two_seen,
+        bool &same) {
+    if (qName.size() < 2 || isdigit(qName[qName.size() - 2])) {
+        return false;
+    }
+    if (qName[qName.size() - 1] == '1') {
+        if (one_seen && two_seen) {
+            same = false;
+            return false;
+        }
+        one_seen = true;
+    } else if (qName[qName.size() - 1] == '2') {
+        if (one_seen && two_seen) {
+            same = false;
+            return false;
+        }
+        two_seen = true;
+    } else {
+        return false;
+    }
     return true;
 }
 
 bool Mapper::getSameQName(int filenumber, bool &same) {
+    same = true;
+    bool one_seen = false, two_seen = false;
     if (hasSAMExt(sams[filenumber])) {
-        ifstream in(sams[filenumber]);
-        if (!in.is_open()) { return false; }
-        same = true;
-        bool one_seen = false, two_seen = false;
-        string inp;
-        while (getline(in, inp)) {
-            if (inp.size() == 0 || inp[0] == '@') { continue; }
-            string qName = parseString(inp, "\t", 1)[0];
-            if (qName.size() < 2) {
-                return true;;
-            }
-            if (!isdigit(qName[qName.size() - 2])) {
-                if (qName[qName.size() - 1] == '1') {
-                if (one_seen && two_seen) {
-                        same = false;
-                        break;
-                    } else {
-                        one_seen = true;
-                    }
-                } else if (qName[qName.size() - 1] == '2') {
-                    if (one_seen && two_seen) {
-                        same = false;
-                        break;
-                    } else {
-                        two_seen = true;
-                    }
-                } else {
-                    break;
-                }
-            } else {
-                break;
-            }
+        SamReader in;
+        if (!in.open(sams[filenumber])) { return false; }
+        SamField inp;
+        while (in.nextLine(inp)) {
+            string qName = SamReader::getField(inp, 0).str();
+            if (!checkQName(qName, one_seen, two_seen, same)) { break; }
         }
-        in.close();
     } else {
-        seqan::BamFileIn bam;
-        if (!seqan::open(bam, sams[filenumber].c_str())) { return false; }
-        same = true;
-        bool one_seen = false, two_seen = false;
-        seqan::BamHeader head;
-        seqan::readHeader(head, bam);
-        seqan::BamAlignmentRecord rec;
-        while (!seqan::atEnd(bam)) {
-            seqan::readRecord(rec, bam);
-            string qName = seqan::toCString(rec.qName);
-            if (qName.size() < 2) {
-                return true;;
-            }
-            if (!isdigit(qName[qName.size() - 2])) {
-                if (qName[qName.size() - 1] == '1') {
-                    if (one_seen && two_seen) {
-                        same = false;
-                        break;
-                    } else {
-                        one_seen = true;
-                    }
-                } else if (qName[qName.size() - 1] == '2') {
-                    if (one_seen && two_seen) {
-                        same = false;
-                        break;
-                    } else {
-                        two_seen = true;
-                    }
-                } else {
-                    break;
-                }
-            } else {
-                break;
-            }
+        BamReader in;
+        if (!in.open(sams[filenumber])) { return false; }
+        BamRecordView rec;
+        while (in.nextRecord(rec)) {
+            string qName(rec.qName(), rec.qNameSize());
+            if (!checkQName(qName, one_seen, two_seen, same)) { break; }
         }
     }
     return true;
 }
 
+/**
+ * Same as above, for an input that can only be read once: only the records
+ * buffered by SamInput::peek are looked at.
+ */
+bool Mapper::getSameQName(SamInput &in, bool &same) {
+    same = true;
+    bool one_seen = false, two_seen = false;
+    in.peek(QNAME_LOOKAHEAD);
+    auto &lookahead = in.getLookahead();
+    for (auto rec = lookahead.begin(); rec != lookahead.end(); ++rec) {
+        string qName = seqan::toCString(rec->qName);
+        if (!checkQName(qName, one_seen, two_seen, same)) { break; }
+    }
+    return true;
+}
+
 string Mapper::getSamPGName(int filenumber) {
     ifstream in(sams[filenumber]);
     if (!in.is_open()) {
@@ -507,7 +1429,10 @@ string Mapper::getSamPGName(int filenumber) {
 }
 
 bool Mapper::getPG(int filenumber, bool &genomebam, bool &rapmap) {
-    string pg = getSamPGName(filenumber);
+    return getPG(getSamPGName(filenumber), genomebam, rapmap);
+}
+
+bool Mapper::getPG(const string &pg, bool &genomebam, bool &rapmap) {
     if (pg.size() == 0) { return false; }
     genomebam = false, rapmap = false;
     if (pg.compare("kallisto") == 0) { genomebam = true; }
@@ -516,192 +1441,501 @@ bool Mapper::getPG(int filenumber, bool &genomebam, bool &rapmap) {
 }
 
 bool Mapper::mapUnmapped(int fileNum, int start, int end, bool genomebam) {
+    TraceSpan span("count held reads", "task", fileNum);
     auto it = reads[fileNum]->begin();
     advance(it, start);
+    OutputBuffers buffers;
     for (int i = start; i < end; ++i) {
-        string stringEC = it->second->getEC(genomebam);
-        if (stringEC.size() == 0) {
-            if (recordUnmapped) {
-                unmappedQNamesSems[fileNum]->dec();
-                unmappedQNames[fileNum]->emplace(it->first);
-                unmappedQNamesSems[fileNum]->inc();
+        if (mateCigar) {
+            it->second->pairWaiting();
+        }
+        if (!it->second->isComplete()) { ++buffers.counts.incomplete; }
+        countRead(fileNum, it->first, it->second, genomebam, buffers);
+        ++it;
+    }
+    flushOutput(fileNum, buffers);
+    return true;
+}
+
+/**
+ * Attaches the records of the ranges of a file that were not mapped (see
+ * skipped), ranges[next], ranges[next + 1]... until none are left, to the
+ * reads held for them, so that an unmapped read is written with all of its
+ * alignments. Every chromosome must be mapped by then:
+ * a record whose read isn't held belongs to one already counted, or to none
+ * that is mapped. Records past the transcripts of a chromosome are counted as
+ * such.
+ */
+bool Mapper::attachSkipped(const vector<FileMetaInfo> *ranges,
+        atomic<size_t> &next, bool sameQName) {
+    for (size_t i = next++; i < ranges->size(); i = next++) {
+        const FileMetaInfo &inf = (*ranges)[i];
+        TraceSpan span("attach skipped", "task", inf.fileNum, &inf.name);
+        SamInput in;
+        if (!in.open(sams[inf.fileNum])
+                || !in.setRange(inf.startByte, inf.endByte)) {
+            return false;
+        }
+        bool tail = chroms.find(inf.name) != chroms.end();
+        seqan::BamAlignmentRecord rec;
+        string raw;
+        OutputBuffers buffers;
+        buffers.chrom = inf.name;
+        while (!in.atEnd()) {
+            in.readRecord(rec, &raw, BAM_FIELD_QNAME);
+            if (tail) {
+                ++buffers.counts.records;
+                ++buffers.counts.pastAnnotation;
             }
-        } else {
-            matrix->inc_TCC(stringEC, fileNum);
-#if READ_DIST
-            mappedQNamesSems[fileNum]->dec();
-#if DEBUG
-            if (mappedQNames[fileNum]->find(it->first)
-                    != mappedQNames[fileNum]->end()) {
-                cerr << "Read " << it->first << " twice!" << endl;
+            string qName = seqan::toCString(rec.qName);
+            if (!sameQName) {
+                qName = qName.substr(0, qName.size() - 2);
             }
-#endif
-            mappedQNames[fileNum]->emplace(it->first);
-            mappedQNamesSems[fileNum]->inc();
-#endif
+            readsSems[inf.fileNum]->dec();
+            auto read = reads[inf.fileNum]->find(qName);
+            if (read != reads[inf.fileNum]->end()) {
+                read->second->addRecord(raw);
+            }
+            readsSems[inf.fileNum]->inc();
         }
-        ++it;
+        flushOutput(inf.fileNum, buffers);
     }
     return true;
 }
 
-bool Mapper::mapReads(int nThreads) {
-    if (nThreads <= 0) {
-        cerr << "  ERROR: cannot run with nonpositive number of threads."
-            << endl;
+/**
+ * Opens the unmapped output of a file, to which unmapped reads are written
+ * while mapping by copying their records from the input as they are. The
+ * output must be in the format of the input, and the input read by our own
+ * SAM or BAM reader.
+ */
+bool Mapper::openUnmapped(int fileNum) {
+    SamInput in;
+    if (!in.open(sams[fileNum])) { return false; }
+    if (!in.hasRaw() || in.isText() != hasSAMExt(unmappedOut[fileNum])) {
+        cerr << "  WARNING: cannot copy the records of " << sams[fileNum]
+            << " to " << unmappedOut[fileNum] << "; unmapped output must be "
+            << "in the format (SAM or BAM) of its input" << endl;
+        return false;
+    }
+    RecordWriter *writer = new RecordWriter;
+    if (!writer->open(unmappedOut[fileNum], in.isText(), in.getRawHeader(),
+                compressionLevel, outThreads)) {
+        delete writer;
         return false;
     }
+    unmappedWriters[fileNum] = writer;
+    return true;
+}
 
-    bool sameQName = false;
-    if (!pgProvided) {
-        genomebam = false;
-        rapmap = false;
+/**
+ * Splits a SAM/BAM file into parts ranges for threads to map, by offset if the
+ * file allows it, else by counting its records.
+ */
+bool Mapper::getFileRanges(int fileNum, int parts,
+        vector<FileMetaInfo> &samInfs) {
+    vector<pair<long long, long long>> ranges;
+    SamInput in;
+    if (in.open(sams[fileNum]) && in.getRanges(parts, ranges)) {
+        /* SAM and BAM on disk are split by offset without counting records
+         * first. */
+        for (auto r = ranges.begin(); r != ranges.end(); ++r) {
+            samInfs.push_back(FileMetaInfo(fileNum, -1, -1, -1, r->first,
+                        r->second));
+        }
+        return true;
+    }
+    int lines = getLineCountSAM(sams[fileNum]);
+    if (lines == -1) { return false; }
+#if DEBUG
+    debugOutSem.dec();
+    cout << lines << " lines in " << sams[fileNum] << endl;
+    debugOutSem.inc();
+#endif
+    int perthread = lines / parts;
+    for (int j = 0; j < parts - 1; ++j) {
+        samInfs.push_back(FileMetaInfo(fileNum, j * perthread + 1,
+                    (j + 1) * perthread + 1, -1));
     }
+    samInfs.push_back(FileMetaInfo(fileNum, (parts - 1) * perthread + 1,
+                lines + 1, -1));
+    return true;
+}
 
-    condition_variable cv;
-    mutex m;
-    queue<int> completed;
-    future<bool> threads[nThreads];
+/**
+ * Maps the alignments of a file to one chromosome, name, in the calling
+ * thread. The chromosome's transcripts are read from the GFF the first time
+ * and kept for the next files, as with many small files rereading the GFF
+ * would take longer than mapping. The cache is only locked to look them up,
+ * so threads reading other chromosomes' transcripts don't wait; those
+ * needing the same ones wait for the first thread to read them.
+ */
+bool Mapper::mapChromCached(const string &name, FileMetaInfo &gffInf,
+        FileMetaInfo samInf, bool genomebam, bool sameQName) {
+    TraceSpan span("map chromosome", "task", samInf.fileNum, &name);
+    Stats::Clock clock = Stats::start(true);
+    promise<deque<Transcript>*> loaded;
+    Trace::lock(chromCacheSem, "lock chromosome cache");
+    auto it = chromCache.find(name);
+    bool load = it == chromCache.end();
+    if (load) {
+        it = chromCache.emplace(name, loaded.get_future().share()).first;
+    }
+    shared_future<deque<Transcript>*> cached = it->second;
+    chromCacheSem.inc();
+    if (load) {
+        deque<Transcript> *transcripts = new deque<Transcript>;
+        if (!readGFF(gffInf, *transcripts)) {
+            delete transcripts;
+            transcripts = nullptr;
+        }
+        loaded.set_value(transcripts);
+    }
+    uint64_t wait = Trace::beginWait();
+    deque<Transcript> *transcripts = cached.get();
+    Trace::endWait("wait transcripts", wait);
+    if (transcripts == nullptr) { return false; }
+    deque<Transcript> chrom(*transcripts);
+    bool success = readSAM(samInf, chrom, genomebam, false, sameQName);
+    if (stats != nullptr) {
+        stats->endChrom(name, clock);
+    }
+    return success;
+}
 
-    for (int i = 0; i < nThreads; ++i) {
-        completed.push(i);
+/**
+ * Frees the state of a file once all of its reads are counted, and finishes
+ * its unmapped output.
+ */
+void Mapper::closeFile(int fileNum) {
+    if (reads[fileNum] != nullptr) {
+        for (auto it = reads[fileNum]->begin(); it != reads[fileNum]->end();
+                ++it) {
+            delete it->second;
+        }
+        delete reads[fileNum];
+        reads[fileNum] = nullptr;
+    }
+    delete readsSems[fileNum];
+    readsSems[fileNum] = nullptr;
+    delete skipped[fileNum];
+    skipped[fileNum] = nullptr;
+    if (unmappedWriters[fileNum] != nullptr) {
+        if (!unmappedWriters[fileNum]->close()) {
+            cerr << "  WARNING: error while writing " << unmappedOut[fileNum]
+                << endl;
+        }
+        delete unmappedWriters[fileNum];
+        unmappedWriters[fileNum] = nullptr;
     }
+}
 
-    for (int i = 0; i < sams.size(); ++i) {
+/**
+ * Maps the reads of one file and counts them. A small file (small) is mapped
+ * in the calling thread, so that several can be mapped at once; otherwise the
+ * file is split by chromosome, or by range for RapMap, over nThreads threads.
+ */
+bool Mapper::mapFile(int i, int nThreads, bool small) {
+    TraceSpan span("map file", "task", i);
 #if DEBUG
-        debugOutSem.dec();
-        cout << "  Mapping " << sams[i] << endl;
-        debugOutSem.inc();
+    debugOutSem.dec();
+    cout << "  Mapping " << sams[i] << endl;
+    debugOutSem.inc();
 #endif
-        unordered_map<string, FileMetaInfo> samsInf;
-        if ((!pgProvided && hasSAMExt(sams[i]) && !getPG(i, genomebam, rapmap))
-            || !getSameQName(i, sameQName)
-            || (!rapmap && !getChromsSAM(i, samsInf))) {
-            cerr << "  WARNING: error while reading " << sams[i] << endl;
-            continue;
-        }
+    /* Per-file state is only allocated while the file is mapped. */
+    reads[i] = new unordered_map<string, Read*>();
+    readsSems[i] = new Semaphore;
+
+    bool genomebam = this->genomebam, rapmap = this->rapmap,
+         sameQName = false;
+    unordered_map<string, FileMetaInfo> samsInf;
+    bool stream = isStreamInput(sams[i]);
+    Stats::Clock clock = Stats::start(true);
+    bool scanned = stream || ((pgProvided || !hasSAMExt(sams[i])
+                || getPG(i, genomebam, rapmap))
+            && getSameQName(i, sameQName)
+            && (collated || rapmap || getChromsSAM(i, samsInf)));
+    if (stats != nullptr && !stream) {
+        stats->endStage("prescan", clock);
+    }
+    if (!scanned) {
+        cerr << "  WARNING: error while reading " << sams[i] << endl;
+        closeFile(i);
+        return false;
+    }
 
 #if DEBUG
+    if (!stream) {
         debugOutSem.dec();
         cout << sams[i] << ": sameQName:" << sameQName << " genomebam:"
             << genomebam << " rapmap:" << rapmap << endl;
         debugOutSem.inc();
+    }
 #endif
- 
-       if (rapmap) {
-            int lines = getLineCountSAM(sams[i]);
-            if (lines == -1) {
-                cerr << "  WARNING: error while reading " << sams[i] << endl;
-                continue;
-            }
-#if DEBUG
-            debugOutSem.dec();
-            cout << lines << " lines in " << sams[i] << endl;
-            debugOutSem.inc();
-#endif
-            int perthread = lines / nThreads;
+
+    /* main rejects unmapped output for streams, which can't be opened
+     * twice. */
+    if (recordUnmapped && !stream) {
+        if (!openUnmapped(i)) {
+            closeFile(i);
+            return false;
+        }
+        if (!collated && !rapmap) {
+            skipped[i] = new vector<FileMetaInfo>;
+        }
+    }
+
+    condition_variable cv;
+    mutex m;
+    queue<int> completed;
+    future<bool> threads[nThreads];
+    for (int j = 0; j < nThreads; ++j) {
+        completed.push(j);
+    }
+
+    bool success = true;
+    if (stream) {
+        success = mapStream(i, nThreads, genomebam, rapmap);
+    } else if (collated) {
+        success = readSAMCollated(i, nThreads, genomebam, rapmap, sameQName);
+    } else if (rapmap) {
+        vector<FileMetaInfo> samInfs;
+        success = getFileRanges(i, small ? 1 : nThreads, samInfs);
+        FileMetaInfo gffInf = FileMetaInfo(-1, -1, -1, -1);
+        if (success && small) {
+            deque<Transcript> chrom;
+            success = readSAM(samInfs[0], chrom, genomebam, rapmap,
+                    sameQName);
+        } else if (success) {
             while (!completed.empty()) { completed.pop(); }
-            FileMetaInfo gffInf = FileMetaInfo(-1, -1, -1, -1);
-            for (int j = 0; j < nThreads - 1; ++j) {
-                FileMetaInfo samInf
-                    = FileMetaInfo(i, j * perthread + 1,
-                            (j + 1) * perthread + 1, -1);
+            for (int j = 0; j < nThreads; ++j) {
                 threads[j] = async(launch::async, &Mapper::mapToChrom, this,
-                        ref(gffInf), samInf,
+                        ref(gffInf), samInfs[j],
                         genomebam, rapmap, sameQName,
                         j, ref(cv), ref(m), ref(completed));
             }
-            FileMetaInfo samInf = FileMetaInfo(i,
-                    (nThreads - 1) * perthread + 1, lines + 1, -1);
-            threads[nThreads - 1] = async(launch::async, &Mapper::mapToChrom,
-                    this, ref(gffInf), samInf,
+        }
+        for (int j = 0; j < nThreads; ++j) {
+            if (threads[j].valid() && !threads[j].get()) {
+                cerr << "  WARNING: thread failed." << endl;
+            }
+        }
+    } else {
+        for (auto chrom = chroms.begin(); chrom != chroms.end(); ++chrom) {
+            auto sam = samsInf.find(chrom->first);
+            if (sam == samsInf.end()) { continue; }
+            if (small) {
+                if (!mapChromCached(chrom->first, chrom->second, sam->second,
+                            genomebam, sameQName)) {
+                    cerr << "  WARNING: thread failed." << endl;
+                }
+                continue;
+            }
+            unique_lock<mutex> lk(m);
+            if (completed.empty()) {
+                uint64_t wait = Trace::beginWait();
+                cv.wait(lk, [&completed] {
+                        return !completed.empty();
+                    });
+                Trace::endWait("wait thread", wait);
+            }
+            int done = completed.front();
+            completed.pop();
+            lk.unlock();
+            if (threads[done].valid()) {
+                if (!threads[done].get()) {
+                    cerr << "  WARNING: thread failed." << endl;
+                }
+            }
+            threads[done] = async(launch::async, &Mapper::mapToChrom,
+                    this, ref(chrom->second), sam->second,
                     genomebam, rapmap, sameQName,
-                    nThreads - 1, ref(cv), ref(m), ref(completed));
-        } else {
-            for (auto chrom = chroms.begin(); chrom != chroms.end(); ++chrom) {
-                auto sam = samsInf.find(chrom->first);
-                if (sam != samsInf.end()) {
-                    unique_lock<mutex> lk(m);
-                    if (completed.empty()) {
-                        cv.wait(lk, [&completed] {
-                                return !completed.empty();
-                            });
-                    }
-                    int done = completed.front();
-                    completed.pop();
-                    lk.unlock();
-                    if (threads[done].valid()) {
-                        if (!threads[done].get()) {
-                            cerr << "  WARNING: thread failed." << endl;
-                        }
-                    }
-                    threads[done] = async(launch::async, &Mapper::mapToChrom,
-                            this, ref(chrom->second), sam->second,
-                            genomebam, rapmap, sameQName,
-                            done, ref(cv), ref(m), ref(completed));
+                    done, ref(cv), ref(m), ref(completed));
 #if DEBUG
-                    debugOutSem.dec();
-                    cout << "    Thread " << done << " launched on "
-                       <<  chrom->first << endl;
-                  debugOutSem.inc();
+            debugOutSem.dec();
+            cout << "    Thread " << done << " launched on "
+               <<  chrom->first << endl;
+            debugOutSem.inc();
 #endif
-                }
-            }
         }
-
         for (int j = 0; j < nThreads; ++j) {
-            if (threads[j].valid()) {
-                threads[j].wait();
-                if (!threads[j].get()) {
-                        cerr << "  WARNING: thread failed." << endl;
+            if (threads[j].valid() && !threads[j].get()) {
+                cerr << "  WARNING: thread failed." << endl;
+            }
+        }
+        if (skipped[i] != nullptr) {
+            /* Chromosomes without annotation are only read for the
+             * alignments of unmapped reads. */
+            for (auto sam = samsInf.begin(); sam != samsInf.end(); ++sam) {
+                if (chroms.find(sam->first) == chroms.end()) {
+                    skipped[i]->push_back(sam->second);
                 }
-                completed.push(j);
             }
+            atomic<size_t> next(0);
+            for (int j = 0; j < nThreads - 1; ++j) {
+                threads[j] = async(launch::async, &Mapper::attachSkipped,
+                        this, skipped[i], ref(next), sameQName);
+            }
+            success = attachSkipped(skipped[i], next, sameQName) && success;
+            for (int j = 0; j < nThreads - 1; ++j) {
+                success = threads[j].get() && success;
+            }
+        }
+        /* Chromosomes without annotation are otherwise never read. */
+        for (auto sam = samsInf.begin(); stats != nullptr
+                && sam != samsInf.end(); ++sam) {
+            if (chroms.find(sam->first) != chroms.end()) { continue; }
+            MapCounts skipped;
+            skipped.records = sam->second.end - sam->second.start;
+            if (sam->first.compare("*") == 0) {
+                skipped.unmappedFlag = skipped.records;
+            } else {
+                skipped.notAnnotated = skipped.records;
+            }
+            stats->addCounts(i, sam->first, skipped);
         }
-        if (!reads[i]->empty()) {
+    }
+    if (!success) {
+        cerr << "  WARNING: error while reading " << sams[i] << endl;
+    }
+
+    /* Reads still held (e.g. with a mate in no chromosome, or all of them
+     * with genomebam) are counted now. */
+    if (!reads[i]->empty()) {
 #if DEBUG
-            cout << reads[i]->size() << " unfinished. Placing in matrix now."
-                << endl;
+        cout << reads[i]->size() << " unfinished. Placing in matrix now."
+            << endl;
 #endif
-            int perThread = reads[i]->size() / nThreads;
-            if (perThread < 20) {
-                int done = completed.front();
-                completed.pop();
-                threads[done] = async(launch::async, &Mapper::mapUnmapped, this,
-                        i, 0, reads[i]->size(), genomebam);
-            } else {
-                for (int j = 0; j < nThreads - 1; ++j) {
-                    int done = completed.front();
-                    completed.pop();
-                    threads[done] = async(launch::async, &Mapper::mapUnmapped,
-                            this,
-                            i, j * perThread, (j + 1) * perThread, genomebam);
-                }
-                int done = completed.front();
-                completed.pop();
-                threads[done] = async(launch::async, &Mapper::mapUnmapped, this,
-                        i, (nThreads - 1) * perThread, reads[i]->size(),
-                        genomebam);
+        int perThread = reads[i]->size() / nThreads;
+        if (perThread < 20) {
+            mapUnmapped(i, 0, reads[i]->size(), genomebam);
+        } else {
+            for (int j = 0; j < nThreads - 1; ++j) {
+                threads[j] = async(launch::async, &Mapper::mapUnmapped,
+                        this,
+                        i, j * perThread, (j + 1) * perThread, genomebam);
+            }
+            mapUnmapped(i, (nThreads - 1) * perThread, reads[i]->size(),
+                    genomebam);
+            for (int j = 0; j < nThreads - 1; ++j) {
+                threads[j].get();
             }
         }
     }
+    closeFile(i);
+    return success;
+}
 
-    for (int i = 0; i < nThreads; ++i) {
-        if (threads[i].valid()) {
-            threads[i].wait();
-            if (!threads[i].get()) {
+/**
+ * Maps the small files files[next], files[next + 1]... one at a time, each in
+ * this thread, until none are left.
+ */
+bool Mapper::mapSmallFiles(const vector<int> &files, atomic<size_t> &next) {
+    for (size_t i = next++; i < files.size(); i = next++) {
+        mapFile(files[i], 1, true);
+    }
+    return true;
+}
+
+bool Mapper::mapReads(int nThreads) {
+    if (nThreads <= 0) {
+        cerr << "  ERROR: cannot run with nonpositive number of threads."
+            << endl;
+        return false;
+    }
+
+    if (!pgProvided) {
+        genomebam = false;
+        rapmap = false;
+    }
+    outThreads = nThreads;
+    if (busOut.size() != 0) {
+        busWriter = new BusWriter;
+        if (!busWriter->open(busOut)) {
+            cerr << "  ERROR: failed to open " << busOut << endl;
+            delete busWriter;
+            busWriter = nullptr;
+            return false;
+        }
+    }
+
+    /* Files under SMALL_FILE_SIZE (e.g. one per cell of a plate) are mapped
+     * nThreads at a time, each by one thread; the others one after the other,
+     * each split over all threads. */
+    Stats::Clock clock = Stats::start();
+    vector<int> small, large;
+    for (int i = 0; i < sams.size(); ++i) {
+        long long size = isStreamInput(sams[i]) ? -1 : getFileSize(sams[i]);
+        if (nThreads > 1 && size >= 0 && size < SMALL_FILE_SIZE) {
+            small.push_back(i);
+        } else {
+            large.push_back(i);
+        }
+    }
+    if (small.size() != 0) {
+        atomic<size_t> next(0);
+        int workers = min((size_t)nThreads, small.size());
+        future<bool> threads[workers];
+        for (int j = 0; j < workers; ++j) {
+            threads[j] = async(launch::async, &Mapper::mapSmallFiles, this,
+                    cref(small), ref(next));
+        }
+        for (int j = 0; j < workers; ++j) {
+            if (!threads[j].get()) {
                 cerr << "  WARNING: thread failed." << endl;
             }
         }
+        for (auto it = chromCache.begin(); it != chromCache.end(); ++it) {
+            delete it->second.get();
+        }
+        chromCache.clear();
+    }
+    for (auto i = large.begin(); i != large.end(); ++i) {
+        mapFile(*i, nThreads, false);
+    }
+    if (stats != nullptr) {
+        stats->endStage("map", clock);
+        clock = Stats::start();
+    }
+    TraceSpan span("finalize", "finalize");
+
+    if (busWriter != nullptr && !busWriter->close()) {
+        cerr << "  WARNING: error while writing " << busOut << endl;
+    }
+    if (collapseUMIs) {
+        countMolecules();
+    }
+    if (stats != nullptr) {
+        stats->endStage("finalize", clock);
     }
 
     return true;
 }
 
+int Mapper::getNumECs() {
+    return matrix->get_num_ECs();
+}
+
 bool Mapper::writeCellsFiles(string outprefix) {
     ofstream out(outprefix + ".cells");
     if (!out.is_open()) { return false; }
+    if (byCell) {
+        vector<const string*> barcodes(cellColumns.size());
+        for (auto it = cellColumns.begin(); it != cellColumns.end(); ++it) {
+            barcodes[it->second] = &it->first;
+        }
+        for (auto it = barcodes.begin(); it != barcodes.end(); ++it) {
+            out << **it << '\n';
+        }
+        out.close();
+        return !out.fail();
+    }
     for (auto file = sams.begin(); file != sams.end(); ++file) {
+        const string &label = labels[file - sams.begin()];
+        if (label.size() != 0) {
+            out << label << endl;
+            continue;
+        }
         int start = file->find_last_of('/');
         if (start == string::npos) { start = -1; }
         ++start;
@@ -721,65 +1955,6 @@ bool Mapper::writeCellsFiles(string outprefix) {
     return true;
 }
 
-bool Mapper::writeUnmapped(vector<string> &unmappedOut) {
-    bool sameQName;
-    for (int i = 0; i < unmappedOut.size(); ++i) {
-        if (hasSAMExt(sams[i])) {
-            ifstream in(sams[i]);
-            if (!in.is_open()) { return false; }
-            ofstream out(unmappedOut[i]);
-            if (!out.is_open()) { return false; }
-            if (!getSameQName(i, sameQName)) { return false; }
-    
-            string inp;
-            while (getline(in, inp)) {
-                if (inp.size() == 0 || inp[0] == '@') {
-                    out << inp << endl;
-                } else {
-                    vector<string> alignment = parseString(inp, "\t", 3);
-                    string qName = alignment[0];
-                    if (!sameQName) {
-                        qName = qName.substr(0, qName.size() - 2);
-                    }
-                    if (unmappedQNames[i]->find(qName)
-                                != unmappedQNames[i]->end()) {
-                        out << inp << endl;
-                    }
-                }
-            }
-    
-            in.close();
-            out.close();
-        } else {
-            seqan::BamFileIn in;
-            if (!seqan::open(in, sams[i].c_str())) { return false; }
-            seqan::BamFileOut out(seqan::context(in), unmappedOut[i].c_str());
-            if (!getSameQName(i, sameQName)) { return false; }
-
-            seqan::BamHeader head;
-            seqan::readHeader(head, in);
-            seqan::writeHeader(out, head);
-
-            seqan::BamAlignmentRecord rec;
-            while(!seqan::atEnd(in)) {
-                seqan::readRecord(rec, in);
-                string qName = seqan::toCString(rec.qName);
-                if (!sameQName) {
-                    qName = qName.substr(0, qName.size() - 2);
-                }
-                if (unmappedQNames[i]->find(qName)
-                            != unmappedQNames[i]->end()) {
-                    seqan::writeRecord(out, rec);
-                }
-            }
-
-            seqan::close(in);
-            seqan::close(out);
-        }
-    }
-    return true;
-}
-
 #if READ_DIST
 bool Mapper::writeMapped(vector<string> &mappedOut) {
     for (int i = 0; i < mappedOut.size(); ++i) {
@@ -796,25 +1971,42 @@ bool Mapper::writeMapped(vector<string> &mappedOut) {
 #endif
 
 bool Mapper::writeToFile(string outprefix,
-        vector<string> &unmappedOut,
 #if READ_DIST
         vector<string> &mappedOut,
 #endif
-        bool full, string ec) {
+        bool full, string ec, bool mtx, bool columnMajor, bool binary) {
+    TraceSpan span("write", "io");
+    /* BUS records refer to ECs by ID (see TCC_Matrix::inc_TCC), so the rows
+     * are written in that order. */
+    int transcripts = busOut.size() != 0 ? matrix->get_num_singletons() : 0;
     if (ec.size() == 0) {
-        if (full) { matrix->write_to_file(outprefix); }
-        else { matrix->write_to_file_sparse(outprefix); }
+        if (binary) {
+            matrix->write_to_file_binary(outprefix, transcripts, outThreads);
+        } else if (mtx) {
+            matrix->write_to_file_mtx(outprefix, transcripts, columnMajor,
+                    outThreads);
+        } else if (full) {
+            matrix->write_to_file(outprefix, transcripts, outThreads);
+        } else {
+            matrix->write_to_file_sparse(outprefix, transcripts, outThreads);
+        }
     } else {
         vector<string> order;
-        unordered_set<string> ecSet;
-        getECOrder(ec, order, ecSet);
-        if (full) { matrix->write_to_file_in_order(outprefix, order, ecSet); }
-        else { matrix->write_to_file_in_order_sparse(outprefix, order, ecSet); }
+        getECOrder(ec, order);
+        if (binary) {
+            matrix->write_to_file_in_order_binary(outprefix, order,
+                    outThreads);
+        } else if (mtx) {
+            matrix->write_to_file_in_order_mtx(outprefix, order, columnMajor,
+                    outThreads);
+        } else if (full) {
+            matrix->write_to_file_in_order(outprefix, order, outThreads);
+        } else {
+            matrix->write_to_file_in_order_sparse(outprefix, order,
+                    outThreads);
+        }
     }
     writeCellsFiles(outprefix);
-    if (recordUnmapped && unmappedOut.size() != 0) {
-        writeUnmapped(unmappedOut);
-    }
 #if READ_DIST
     if (mappedOut.size() != 0) {
         writeMapped(mappedOut);
@@ -1,34 +1,118 @@
 #ifndef __MAPPER_HPP__
 #define __MAPPER_HPP__
 
+#include <atomic>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <deque>
 #include <set>
 #include <mutex>
 #include <condition_variable>
+#include <future>
+#include "Annotation.hpp"
+#include "BlockingQueue.hpp"
+#include "BusWriter.hpp"
 #include "TCC_Matrix.hpp"
 #include "FileMetaInfo.hpp"
 #include "Read.hpp"
+#include "RecordWriter.hpp"
+#include "SamInput.hpp"
 #include "Transcript.hpp"
+#include "Whitelist.hpp"
 #include "Semaphore.hpp"
+#include "Stats.hpp"
 
 #define DEBUG 0
 #define READ_DIST 0
 #define TRANSCRIPT_ID_TAG "transcript_id"
+/* Minimum number of alignments handed to a thread at once in collated mode. */
+#define COLLATED_BATCH_SIZE 4096
+/* Records read ahead from a streamed input to guess its qName convention. */
+#define QNAME_LOOKAHEAD 1000
+/* Alignments per batch, and batches queued per thread, for streamed input. */
+#define STREAM_BATCH_SIZE 4096
+#define STREAM_QUEUE_SIZE 4
+/* Bytes of unmapped records, and of BUS records, a thread buffers before
+ * writing them out. */
+#define UNMAPPED_BUFFER_SIZE (1 << 20)
+#define BUS_BUFFER_SIZE (1 << 20)
+/* Molecules a thread gathers, beyond its distinct ones, before deduplicating
+ * them. */
+#define MOLECULE_BUFFER_SIZE (1 << 16)
+/* Input files smaller than this (bytes) are each mapped by a single thread,
+ * several at once, instead of one after the other split by chromosome. */
+#define SMALL_FILE_SIZE (64LL << 20)
+
+typedef BlockingQueue<std::vector<seqan::BamAlignmentRecord>*> RecordQueue;
 
 class Mapper {
 private:
     std::vector<std::string> gffs;
     std::vector<std::string> sams;
+    /* Names of the input files in the .cells file, if not derived from their
+     * paths (empty). */
+    std::vector<std::string> labels;
+    std::vector<std::string> unmappedOut;
+    /* Compression level of BAM outputs, and threads writing outputs. */
+    int compressionLevel, outThreads;
     std::unordered_map<std::string, int> *indexMap;
     std::unordered_map<std::string, FileMetaInfo> chroms;
+    Annotation *annotation;
+    Semaphore annotationSem;
+    /* Transcripts of each chromosome, kept while small files are mapped:
+     * ready once the thread that first needed them has read them, nullptr if
+     * it failed to. */
+    std::unordered_map<std::string,
+        std::shared_future<std::deque<Transcript>*>> chromCache;
+    Semaphore chromCacheSem;
+    /* Per-file state, allocated only while the file is mapped (see
+     * mapFile). */
     std::vector<std::unordered_map<std::string, Read*>*> reads;
     std::vector<Semaphore*> readsSems;
-    std::vector<std::unordered_set<std::string>*> unmappedQNames;
-    std::vector<Semaphore*> unmappedQNamesSems;
+    std::vector<RecordWriter*> unmappedWriters;
+    /* With an unmappedWriter, the ranges of the file not mapped (the rest of
+     * a chromosome past its last transcript) whose records are attached to
+     * their held reads once every chromosome is mapped. */
+    std::vector<std::vector<FileMetaInfo>*> skipped;
+    /* BUS output of every read counted, if busOut is given. */
+    std::string busOut;
+    BusWriter *busWriter;
+    /* Tag holding reads' cell barcodes. If byCell, the matrix has a column
+     * per barcode (in order of appearance, see getCellColumn) rather than per
+     * input file. */
+    std::string cellTag;
+    bool byCell;
+    std::unordered_map<std::string, int> cellColumns;
+    Semaphore cellColumnsSem;
+    /* If given, alignments whose barcode is not listed, even after
+     * correction, are dropped before they are mapped. */
+    Whitelist *whitelist;
+    /* A read's molecule: its column and EC ID (column high), and its UMI,
+     * 2-bit packed or hashed. */
+    struct Molecule {
+        uint64_t columnEC;
+        uint64_t UMI;
+        bool operator<(const Molecule &m) const {
+            return columnEC < m.columnEC
+                || (columnEC == m.columnEC && UMI < m.UMI);
+        }
+        bool operator==(const Molecule &m) const {
+            return columnEC == m.columnEC && UMI == m.UMI;
+        }
+    };
+    /* If collapseUMIs, reads are counted once per molecule: the molecules
+     * handed over by each thread, each run sorted and unique, are merged by
+     * countMolecules. */
+    bool collapseUMIs;
+    std::vector<std::vector<Molecule>> moleculeRuns;
+    Semaphore moleculesSem;
     TCC_Matrix *matrix;
-    bool paired, recordUnmapped, pgProvided, genomebam, rapmap;
+    /* Timing and counts of the run, only if --stats-json is given: counting
+     * also reads past each chromosome's last annotated record. */
+    Stats *stats;
+    bool paired, recordUnmapped, pgProvided, genomebam, rapmap, mateCigar,
+         collated;
 #if READ_DIST
     std::vector<std::unordered_set<std::string>*> mappedQNames;
     std::vector<Semaphore*> mappedQNamesSems;
@@ -38,8 +122,71 @@ private:
 #endif
     
     bool readGFF(FileMetaInfo &inf, std::deque<Transcript> &chrom);
+    void readGFFRange(seqan::GffFileIn &gff, seqan::GffRecord &rec,
+            int &line, FileMetaInfo &inf, std::deque<Transcript> &chrom);
+    bool loadAnnotation();
+    bool isCountable(const seqan::BamAlignmentRecord &rec, bool genomebam);
+    void countRejected(const seqan::BamAlignmentRecord &rec, bool genomebam,
+            MapCounts &counts);
+    /* A mapping thread's output for one input file, buffered so that it is
+     * written in large pieces. */
+    struct OutputBuffers {
+        std::string unmapped;
+        std::string bus;
+        /* Longest barcode and UMI in bus. */
+        uint32_t barcodeLength = 0, UMILength = 0;
+        /* Molecules, sorted and unique up to uniqueMolecules. */
+        std::vector<Molecule> molecules;
+        size_t uniqueMolecules = 0;
+        /* Counts, and the chromosome they are of if any. */
+        MapCounts counts;
+        std::string chrom;
+        /* Columns of the cell barcodes this thread has met (see
+         * getCellColumn). */
+        std::unordered_map<std::string, int> cellColumns;
+    };
+    void countRead(int fileNum, const std::string &qName, Read *read,
+            bool genomebam, OutputBuffers &buffers);
+    int getCellColumn(const std::string &barcode, OutputBuffers &buffers);
+    bool getWhitelisted(const seqan::BamAlignmentRecord &rec,
+            std::string &barcode);
+    void sortMolecules(OutputBuffers &buffers);
+    void addMolecules(OutputBuffers &buffers);
+    void countMolecules();
+    bool appendBus(int fileNum, const Read *read, int ecID,
+            OutputBuffers &buffers);
+    void flushOutput(int fileNum, OutputBuffers &buffers);
+    bool mapRecord(int fileNum, seqan::BamAlignmentRecord &rec,
+            SamInput *in, const std::string *raw,
+            std::deque<Transcript> &chrom, int id, bool genomebam,
+            bool rapmap, bool sameQName, OutputBuffers &buffers);
     bool readSAM(FileMetaInfo &inf, std::deque<Transcript> &chrom,
             bool genomebam, bool rapmap, bool sameQName);
+    bool mapCollated(int fileNum,
+            std::vector<seqan::BamAlignmentRecord> *batch,
+            std::vector<std::string> *raw, const std::vector<int> &refs,
+            bool genomebam, bool rapmap, bool sameQName);
+    void getRefs(SamInput &in, bool rapmap, std::vector<int> &refs);
+    bool readSAMCollated(int fileNum, int nThreads, bool genomebam,
+            bool rapmap, bool sameQName);
+    bool readSAMCollated(int fileNum, SamInput &in, int nThreads,
+            bool genomebam, bool rapmap, bool sameQName);
+    bool mapStreamChrom(FileMetaInfo &gffInf, int fileNum,
+            RecordQueue *records, bool genomebam, bool sameQName,
+            int thread, std::condition_variable &cv, std::mutex &m,
+            std::queue<int> &completed);
+    bool mapStreamBatches(int fileNum, RecordQueue *records,
+            const std::vector<int> &refs, bool genomebam, bool sameQName);
+    bool mapStream(int fileNum, int nThreads, bool &genomebam,
+            bool &rapmap);
+    bool getFileRanges(int fileNum, int parts,
+            std::vector<FileMetaInfo> &samInfs);
+    bool mapChromCached(const std::string &name, FileMetaInfo &gffInf,
+            FileMetaInfo samInf, bool genomebam, bool sameQName);
+    void closeFile(int fileNum);
+    bool mapFile(int fileNum, int nThreads, bool small);
+    bool mapSmallFiles(const std::vector<int> &files,
+            std::atomic<size_t> &next);
     bool mapToChrom(FileMetaInfo &gffInf, FileMetaInfo samInf,
             bool genomebam, bool rapmap, bool sameQName,
             int thread, std::condition_variable &cv, std::mutex &m,
@@ -47,28 +194,43 @@ private:
     bool getChromsGFF(int filenumber, int &transcriptCount);
     bool getChromsSAM(int filenumber,
             std::unordered_map<std::string, FileMetaInfo> &inf);
-    bool getChromsGFFs();
+    bool getChromsGFFs(int &transcriptCount);
     bool getSameQName(int filenumber, bool &same);
+    bool getSameQName(SamInput &in, bool &same);
     std::string getSamPGName(int filenumber);
     bool getPG(int filenumber, bool &genomebam, bool &rapmap);
+    bool getPG(const std::string &pg, bool &genomebam, bool &rapmap);
     bool mapUnmapped(int samNum, int start, int end, bool genomebam);
+    bool attachSkipped(const std::vector<FileMetaInfo> *ranges,
+            std::atomic<size_t> &next, bool sameQName);
     bool writeCellsFiles(std::string outprefix);
-    bool writeUnmapped(std::vector<std::string> &unmappedOut);
+    bool openUnmapped(int fileNum);
 #if READ_DIST
     bool writeMapped(std::vector<std::string> &mappedOut);
 #endif
 public:
     Mapper(std::vector<std::string> gffs, std::vector<std::string> sams,
-            std::vector<std::string> fas, bool paired, bool recordUnmapped,
-            bool pgProvided, bool genomebam, bool rapmap);
+            std::vector<std::string> fas, bool paired,
+            std::vector<std::string> unmappedOut,
+            bool pgProvided, bool genomebam, bool rapmap, bool mateCigar,
+            bool collated, int compressionLevel=Z_DEFAULT_COMPRESSION,
+            std::string busOut="", std::string cellTag="",
+            bool collapseUMIs=false, Whitelist *whitelist=nullptr,
+            std::vector<std::string> labels=std::vector<std::string>(),
+            Stats *stats=nullptr);
     ~Mapper();
     bool mapReads(int nThreads);
+    int getNumECs();
     bool writeToFile(std::string outprefix,
-            std::vector<std::string> &unmappedOut,
 #if READ_DIST
             std::vector<std::string> &mappedOut,
 #endif
-            bool full, std::string ec);
+            bool full, std::string ec, bool mtx=false,
+            bool columnMajor=false, bool binary=false);
 };
+
+/* Blocks of an alignment on the reference, split at its N (intron) ops. */
+std::vector<Exon> getAlignmentExons(const seqan::BamAlignmentRecord &alignment);
+std::vector<Exon> getAlignmentExons(int beginPos, const std::string &cigar);
 #endif
 
@@ -1,5 +1,6 @@
-#include <algorithm> /* sort, set_intersection, unique */
+#include <algorithm> /* find, sort, set_intersection, unique */
 #include "Read.hpp"
+#include "BamTags.hpp"
 using namespace std;
 
 Read::Alignment::Alignment(int rName, int rNext, int pos, int nextPos,
@@ -9,17 +10,20 @@ Read::Alignment::Alignment(int rName, int rNext, int pos, int nextPos,
 
 Read::Alignment::~Alignment() {}
 
-Read::Pair::Pair(const vector<int> &EC) : EC1(EC) {}
+Read::Pair::Pair(const vector<int> &EC, bool intersected) : EC1(EC),
+    intersected(intersected) {}
 
 Read::Pair::Pair(const vector<int> &EC1, const vector<int> &EC2) :
-    EC1(EC1), EC2(EC2) {}
+    EC1(EC1), EC2(EC2), intersected(false) {}
 
 Read::Pair::~Pair() {}
 
-Read::Read() {}
+Read::Read() : mapped(false) {}
 
-Read::Read(const seqan::BamAlignmentRecord &alignment, const vector<int> &EC) {
+Read::Read(const seqan::BamAlignmentRecord &alignment, const vector<int> &EC,
+        bool mateResolved, bool countMate, const char *barcodeTag) {
     paired = true;
+    mapped = false;
     seen[0] = 0;
     seen[1] = 0;
     NH[0] = -1;
@@ -29,20 +33,49 @@ Read::Read(const seqan::BamAlignmentRecord &alignment, const vector<int> &EC) {
         paired = false;
         NH[1] = 0;
     }
-    addAlignment(alignment, EC, false); // Value of genomebam doesn't matter.
+    size_t size = seqan::length(alignment.tags);
+    if (size != 0) {
+        getStringTag(&alignment.tags[0], size, barcodeTag, barcode);
+        if (!getStringTag(&alignment.tags[0], size, "UB", UMI)) {
+            getStringTag(&alignment.tags[0], size, "UR", UMI);
+        }
+    }
+    if (mateResolved) {
+        addPair(alignment, EC, countMate);
+    } else {
+        addAlignment(alignment, EC, false); // Value of genomebam doesn't matter.
+    }
 }
 
 Read::~Read() {}
 
 int Read::getNH(const seqan::BamAlignmentRecord &alignment) {
-    seqan::BamTagsDict tags(alignment.tags);
-    int nh = 0, id;
-    if (seqan::findTagKey(id, tags, "NH")) {
-        seqan::extractTagValue(nh, tags, id);
+    size_t size = seqan::length(alignment.tags);
+    int nh = 0;
+    if (size != 0) {
+        getIntTag(&alignment.tags[0], size, "NH", nh);
     }
     return nh;
 }
 
+/**
+ * Finds the alignment in list that is the mate of alignment, if any.
+ */
+vector<Read::Alignment>::iterator Read::findMate(vector<Alignment> &list,
+        const seqan::BamAlignmentRecord &alignment) {
+    auto a2 = list.begin();
+    while (a2 != list.end()) {
+        if (alignment.rID == a2->rName && alignment.rNextId == a2->rNext
+                && alignment.beginPos == a2->nextPos
+                && alignment.pNext == a2->pos
+                && seqan::hasFlagFirst(alignment) != a2->first) {
+            break;
+        }
+        ++a2;
+    }
+    return a2;
+}
+
 void Read::addAlignment(const seqan::BamAlignmentRecord &alignment,
            const vector<int> &EC, bool genomebam) {
     int i = (!paired || seqan::hasFlagFirst(alignment)) ? 0 : 1;
@@ -53,19 +86,11 @@ void Read::addAlignment(const seqan::BamAlignmentRecord &alignment,
    
     if (!paired) {
         pairs.emplace_back(EC);
+        noteMapped(pairs.back());
         return;
     }
 
-    auto a2 = alignments.begin();
-    while (a2 != alignments.end()) {
-        if (alignment.rID == a2->rName && alignment.rNextId == a2->rNext
-                && alignment.beginPos == a2->nextPos
-                && alignment.pNext == a2->pos
-                && seqan::hasFlagFirst(alignment) != a2->first) {
-            break;
-        }
-        ++a2;
-    }
+    auto a2 = findMate(alignments, alignment);
 
     if (a2 == alignments.end()) {
         alignments.emplace_back(Alignment(alignment.rID, alignment.rNextId,
@@ -75,19 +100,151 @@ void Read::addAlignment(const seqan::BamAlignmentRecord &alignment,
     } else {
         if (genomebam || seqan::hasFlagRC(alignment) != a2->reverse) {
             pairs.emplace_back(a2->EC, EC);
+            noteMapped(pairs.back());
         }
         alignments.erase(a2);
     }
 }
 
+/**
+ * Adds both alignments of a properly paired template at once. Used when the
+ * leftmost mate carries the MC (mate CIGAR) tag, so that EC is already the
+ * intersection of both mates' ECs and the other mate's record need not be
+ * seen. Assumes both mates report the same NH.
+ *
+ * @param countMate     whether to count the other mate as seen now; if not,
+ *                      the read waits for it (see addResolvedMate).
+ */
+void Read::addPair(const seqan::BamAlignmentRecord &alignment,
+        const vector<int> &EC, bool countMate) {
+    if (countMate) {
+        ++seen[0];
+        ++seen[1];
+    } else {
+        ++seen[seqan::hasFlagFirst(alignment) ? 0 : 1];
+    }
+    if (NH[0] == -1) {
+        NH[0] = getNH(alignment);
+    }
+    if (NH[1] == -1) {
+        NH[1] = NH[0];
+    }
+    if (seqan::hasFlagRC(alignment) != seqan::hasFlagNextRC(alignment)) {
+        pairs.emplace_back(EC, true);
+        noteMapped(pairs.back());
+    }
+    resolved.emplace_back(Alignment(alignment.rID, alignment.rNextId,
+                alignment.beginPos, alignment.pNext,
+                seqan::hasFlagFirst(alignment), seqan::hasFlagRC(alignment),
+                EC));
+}
+
+/**
+ * Drops the records kept for unmapped output once pair p, just added, gives
+ * the read a transcript, as its EC can then no longer be empty.
+ */
+void Read::noteMapped(const Pair &p) {
+    bool maps = false;
+    if (!paired || p.intersected) {
+        maps = !p.EC1.empty();
+    } else {
+        for (auto t = p.EC1.begin(); t != p.EC1.end() && !maps; ++t) {
+            maps = find(p.EC2.begin(), p.EC2.end(), *t) != p.EC2.end();
+        }
+    }
+    if (maps && !mapped) {
+        mapped = true;
+        string().swap(records);
+    }
+}
+
+/**
+ * Consumes the right mate of a pair that addPair already resolved from the
+ * left mate's MC tag.
+ *
+ * @param counted   whether addPair counted the mate as seen.
+ * @return          true if alignment was such a mate, else false.
+ */
+bool Read::addResolvedMate(const seqan::BamAlignmentRecord &alignment,
+        bool counted) {
+    auto a2 = findMate(resolved, alignment);
+    if (a2 == resolved.end()) { return false; }
+    resolved.erase(a2);
+    if (!counted) {
+        ++seen[seqan::hasFlagFirst(alignment) ? 0 : 1];
+    }
+    return true;
+}
+
+/**
+ * Counts the right mate of a pair, whose EC wasn't computed as it carries the
+ * MC tag. If its left mate didn't resolve the pair, that mate waits for it,
+ * and is paired from its own EC as pairWaiting would.
+ */
+void Read::addSkippedMate(const seqan::BamAlignmentRecord &alignment) {
+    if (addResolvedMate(alignment, false)) { return; }
+    int i = seqan::hasFlagFirst(alignment) ? 0 : 1;
+    ++seen[i];
+    if (NH[i] == -1) {
+        NH[i] = getNH(alignment);
+    }
+    auto a2 = findMate(alignments, alignment);
+    if (a2 != alignments.end()) {
+        pairs.emplace_back(a2->EC, true);
+        noteMapped(pairs.back());
+        alignments.erase(a2);
+    }
+}
+
+/**
+ * Counts left mates still waiting for their right mate from their own EC.
+ * Used at the end of a file with -M, where a right mate that carried the MC
+ * tag was skipped although its left mate had no tag to resolve the pair.
+ */
+void Read::pairWaiting() {
+    for (auto a = alignments.begin(); a != alignments.end(); ++a) {
+        if (a->rName == a->rNext && a->pos < a->nextPos) {
+            pairs.emplace_back(a->EC, true);
+            noteMapped(pairs.back());
+        }
+    }
+    alignments.clear();
+}
+
+void Read::addRecord(const string &raw) {
+    if (!mapped) {
+        records += raw;
+    }
+}
+
+const string &Read::getRecords() const {
+    return records;
+}
+
+const string &Read::getBarcode() const {
+    return barcode;
+}
+
+void Read::setBarcode(const string &barcode) {
+    this->barcode = barcode;
+}
+
+const string &Read::getUMI() const {
+    return UMI;
+}
+
 bool Read::isComplete() {
     return NH[0] == seen[0] && NH[1] == seen[1];
 }
 
-string Read::getEC(bool genomebam) {
-    vector<int> EC;
+/**
+ * The read's equivalence class: the transcripts of all its alignments (pairs
+ * intersected), sorted and without duplicates, in EC.
+ */
+void Read::getEC(vector<int> &EC, bool genomebam) {
+    EC.clear();
     for (auto p = pairs.begin(); p != pairs.end(); ++p) {
-        if (paired && (!genomebam
+        if (paired && !p->intersected && (!genomebam
                         || p->EC1.size() + p->EC2.size() != 0)) {
             sort(p->EC1.begin(), p->EC1.end());
             sort(p->EC2.begin(), p->EC2.end());
@@ -103,6 +260,11 @@ string Read::getEC(bool genomebam) {
     }
     sort(EC.begin(), EC.end());
     EC.erase(unique(EC.begin(), EC.end()), EC.end());
+}
+
+string Read::getEC(bool genomebam) {
+    vector<int> EC;
+    getEC(EC, genomebam);
     if (EC.size() == 0) { return ""; }
     string stringEC = to_string(EC[0]);
     for (int i = 1; i < EC.size(); ++i) {
@@ -1,6 +1,7 @@
 #ifndef __READ_HPP__
 #define __READ_HPP__
 
+#include <string>
 #include <vector>
 #include <seqan/bam_io.h>
 
@@ -21,7 +22,8 @@ private:
     struct Pair {
         std::vector<int> EC1;
         std::vector<int> EC2;
-        Pair(const std::vector<int> &EC);
+        bool intersected;
+        Pair(const std::vector<int> &EC, bool intersected=false);
         Pair(const std::vector<int> &EC1, const std::vector<int> &EC2);
         ~Pair();
     };
@@ -29,16 +31,41 @@ private:
     int NH[2];
     int seen[2];
     std::vector<Alignment> alignments;
+    std::vector<Alignment> resolved;
     std::vector<Pair> pairs;
+    /* Alignments as stored in the input, kept only for unmapped output, and
+     * dropped once the read is sure to map (mapped). */
+    std::string records;
+    bool mapped;
+    /* Cell barcode (CB tag, or barcodeTag) and UMI (UB tag, else UR) of the
+     * first alignment. */
+    std::string barcode, UMI;
     int getNH(const seqan::BamAlignmentRecord &alignment);
+    static std::vector<Alignment>::iterator findMate(
+            std::vector<Alignment> &list,
+            const seqan::BamAlignmentRecord &alignment);
+    void noteMapped(const Pair &p);
 public:
     Read();
     Read(const seqan::BamAlignmentRecord &alignment,
-            const std::vector<int> &EC);
+            const std::vector<int> &EC, bool mateResolved=false,
+            bool countMate=true, const char *barcodeTag="CB");
     ~Read();
     void addAlignment(const seqan::BamAlignmentRecord &alignment,
             const std::vector<int> &EC, bool genomebam);
+    void addPair(const seqan::BamAlignmentRecord &alignment,
+            const std::vector<int> &EC, bool countMate=true);
+    bool addResolvedMate(const seqan::BamAlignmentRecord &alignment,
+            bool counted=true);
+    void addSkippedMate(const seqan::BamAlignmentRecord &alignment);
+    void pairWaiting();
+    void addRecord(const std::string &raw);
+    const std::string &getRecords() const;
+    const std::string &getBarcode() const;
+    void setBarcode(const std::string &barcode);
+    const std::string &getUMI() const;
     bool isComplete();
+    void getEC(std::vector<int> &EC, bool genomebam=false);
     std::string getEC(bool genomebam=false);
 };
 
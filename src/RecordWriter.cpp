@@ -0,0 +1,56 @@
+#include "RecordWriter.hpp"
+using namespace std;
+
+RecordWriter::RecordWriter() : binary(nullptr) {}
+
+RecordWriter::~RecordWriter() {
+    close();
+}
+
+/**
+ * Opens filename and writes header, which must be as stored in the input.
+ *
+ * @param isText    whether records are SAM lines (else BAM records).
+ * @param level     (BAM only) compression level, see BgzfWriter::open.
+ * @param nThreads  (BAM only) number of threads compressing.
+ */
+bool RecordWriter::open(const string &filename, bool isText,
+        const string &header, int level, int nThreads) {
+    if (isText) {
+        text.open(filename);
+        if (!text.is_open()) { return false; }
+        text.write(header.data(), header.size());
+        return true;
+    }
+    binary = new BgzfWriter;
+    if (!binary->open(filename, level, nThreads)) {
+        delete binary;
+        binary = nullptr;
+        return false;
+    }
+    return binary->write(header.data(), header.size());
+}
+
+void RecordWriter::write(const string &records) {
+    sem.dec();
+    if (binary != nullptr) {
+        binary->write(records.data(), records.size());
+    } else {
+        text.write(records.data(), records.size());
+    }
+    sem.inc();
+}
+
+bool RecordWriter::close() {
+    bool success = true;
+    if (binary != nullptr) {
+        success = binary->close();
+        delete binary;
+        binary = nullptr;
+    }
+    if (text.is_open()) {
+        text.close();
+        success = success && !text.fail();
+    }
+    return success;
+}
@@ -0,0 +1,30 @@
+#ifndef __RECORD_WRITER_HPP__
+#define __RECORD_WRITER_HPP__
+
+#include <fstream>
+#include <string>
+#include "BgzfWriter.hpp"
+#include "Semaphore.hpp"
+
+/**
+ * Output of whole reads' records, written while mapping. Records are copied
+ * as stored in the input (see SamInput::readRecord), so the output has the
+ * input's format. Any number of threads may write; each write is kept
+ * together, but writes from different threads are in no particular order.
+ */
+class RecordWriter {
+private:
+    std::ofstream text;
+    BgzfWriter *binary;
+    Semaphore sem;
+public:
+    RecordWriter();
+    ~RecordWriter();
+    bool open(const std::string &filename, bool isText,
+            const std::string &header, int level=Z_DEFAULT_COMPRESSION,
+            int nThreads=1);
+    void write(const std::string &records);
+    bool close();
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include <iostream>
+#include "SamInput.hpp"
+#include "FileUtil.hpp"
+using namespace std;
+
+SamInput::SamInput() : text(nullptr), binary(nullptr),
+        decoded(BAM_FIELDS_ALL) {}
+
+SamInput::~SamInput() {
+    delete text;
+    delete binary;
+}
+
+/**
+ * Opens filename (`-` for stdin) and reads its header.
+ *
+ * @return      true if the file was opened, else false.
+ */
+bool SamInput::open(const string &filename) {
+    bool opened;
+    if (filename.compare("-") == 0) {
+        opened = seqan::open(bam, cin);
+    } else if (isStreamInput(filename)) {
+        pipe.open(filename, ios::binary);
+        opened = pipe.is_open() && seqan::open(bam, pipe);
+    } else if (hasSAMExt(filename)) {
+        text = new SamReader;
+        return text->open(filename);
+    } else {
+        binary = new BamReader;
+        if (binary->open(filename)) { return true; }
+        /* Not BGZF-compressed BAM; let SeqAn try. */
+        delete binary;
+        binary = nullptr;
+        opened = seqan::open(bam, filename.c_str());
+    }
+    if (!opened) { return false; }
+    seqan::readHeader(header, bam);
+    return true;
+}
+
+/**
+ * Restricts reading to the records that start in the range [start, end) of
+ * the file: byte offsets for SAM, BGZF virtual offsets for BAM. Only
+ * supported for files on disk.
+ *
+ * @return      false if the range can't be applied (nothing is changed).
+ */
+bool SamInput::setRange(long long start, long long end) {
+    if (start < 0 || end < 0) { return false; }
+    if (text != nullptr) {
+        text->setRange(start, end);
+    } else if (binary != nullptr) {
+        binary->setRange(start, end);
+    } else {
+        return false;
+    }
+    lookahead.clear();
+    return true;
+}
+
+/**
+ * @return      offset of the next record for setRange, or -1 if the input
+ *              can't be read by range or records were peeked.
+ */
+long long SamInput::tell() {
+    if (!lookahead.empty()) { return -1; }
+    if (text != nullptr) { return text->tell(); }
+    if (binary != nullptr) { return binary->tell(); }
+    return -1;
+}
+
+/**
+ * Splits the records of the file into count ranges for setRange. SAM is split
+ * without reading through the file, and BAM too if it has an index.
+ *
+ * @return      false if the input can't be read by range.
+ */
+bool SamInput::getRanges(int count, vector<pair<long long, long long>> &ranges)
+{
+    if (binary != nullptr) {
+        binary->getRanges(count, ranges);
+        return true;
+    }
+    if (text == nullptr) { return false; }
+    vector<pair<size_t, size_t>> textRanges;
+    text->getRanges(count, textRanges);
+    for (auto it = textRanges.begin(); it != textRanges.end(); ++it) {
+        ranges.push_back(make_pair(it->first, it->second));
+    }
+    return true;
+}
+
+bool SamInput::atEnd() {
+    if (!lookahead.empty()) { return false; }
+    if (text != nullptr) { return text->atEnd(); }
+    if (binary != nullptr) { return binary->atEnd(); }
+    return seqan::atEnd(bam);
+}
+
+/**
+ * Reads the next record from whichever reader the file was opened with.
+ *
+ * @param raw   if not nullptr, set to the record as stored in the file (see
+ *              readRecord).
+ * @param fields    parts of a BAM record to decode (see readRecord).
+ * @return      false if there are no more records.
+ */
+bool SamInput::readNext(seqan::BamAlignmentRecord &rec, string *raw,
+        int fields) {
+    decoded = BAM_FIELDS_ALL;
+    if (text != nullptr) {
+        SamField line;
+        if (!text->nextLine(line)) { return false; }
+        text->parseRecord(line, rec);
+        if (raw != nullptr) {
+            raw->assign(line.data, line.size);
+            raw->push_back('\n');
+        }
+        return true;
+    }
+    if (binary != nullptr) {
+        BamRecordView view;
+        if (!binary->nextRecord(view)) { return false; }
+        BamReader::toRecord(view, rec, fields);
+        last = view;
+        decoded = fields;
+        if (raw != nullptr) {
+            raw->assign(view.data - 4, view.size + 4);
+        }
+        return true;
+    }
+    if (seqan::atEnd(bam)) { return false; }
+    seqan::readRecord(rec, bam);
+    if (raw != nullptr) {
+        raw->clear();
+    }
+    return true;
+}
+
+/**
+ * Reads the next record.
+ *
+ * @param raw   if not nullptr, set to the record as stored in the file: the
+ *              line with its newline for SAM, or the record with its
+ *              block_size for BAM. Left empty if hasRaw is false or the
+ *              record was read ahead by peek.
+ * @param fields    BAM_FIELD_* of a BAM record to decode (see
+ *                  BamReader::toRecord); any others can be had with decode
+ *                  until the next read. Records in SAM, or read by SeqAn or
+ *                  ahead by peek, are always decoded in full.
+ */
+void SamInput::readRecord(seqan::BamAlignmentRecord &rec, string *raw,
+        int fields) {
+    if (lookahead.empty()) {
+        readNext(rec, raw, fields);
+    } else {
+        rec = lookahead.front();
+        lookahead.pop_front();
+        decoded = BAM_FIELDS_ALL;
+        if (raw != nullptr) {
+            raw->clear();
+        }
+    }
+}
+
+/**
+ * Decodes the BAM_FIELD_* in fields that readRecord left out of rec, the
+ * record it last read.
+ */
+void SamInput::decode(seqan::BamAlignmentRecord &rec, int fields) {
+    fields &= ~decoded;
+    if (fields == 0) { return; }
+    BamReader::decodeFields(last, rec, fields);
+    decoded |= fields;
+}
+
+/**
+ * @return      whether records can be had as stored in the file.
+ */
+bool SamInput::hasRaw() const {
+    return text != nullptr || binary != nullptr;
+}
+
+/**
+ * @return      whether raw records and the raw header are SAM text (else BAM).
+ */
+bool SamInput::isText() const {
+    return text != nullptr;
+}
+
+/**
+ * @return      the header as stored in the file (see BamReader::getHeader for
+ *              BAM), or "" if hasRaw is false.
+ */
+string SamInput::getRawHeader() const {
+    if (text != nullptr) { return text->getHeader().str(); }
+    if (binary != nullptr) { return binary->getHeader(); }
+    return "";
+}
+
+/**
+ * Reads ahead until `count` records are buffered or the input ends.
+ *
+ * @return      number of records buffered.
+ */
+int SamInput::peek(int count) {
+    while (lookahead.size() < count) {
+        lookahead.push_back(seqan::BamAlignmentRecord());
+        if (!readNext(lookahead.back(), nullptr)) {
+            lookahead.pop_back();
+            break;
+        }
+    }
+    return lookahead.size();
+}
+
+const deque<seqan::BamAlignmentRecord> &SamInput::getLookahead() const {
+    return lookahead;
+}
+
+/**
+ * @return      ID of the first @PG header line, or "N/A" if there is none.
+ */
+string SamInput::getPGName() {
+    if (text != nullptr) { return text->getPGName(); }
+    if (binary != nullptr) { return binary->getPGName(); }
+    for (int i = 0; i < seqan::length(header); ++i) {
+        if (header[i].type != seqan::BAM_HEADER_PROGRAM) { continue; }
+        unsigned id;
+        seqan::CharString pg;
+        if (seqan::findTagKey(id, "ID", header[i])
+                && seqan::getTagValue(pg, id, header[i])) {
+            return seqan::toCString(pg);
+        }
+        break;
+    }
+    return "N/A";
+}
+
+int SamInput::getContigCount() {
+    if (text != nullptr) { return text->getContigCount(); }
+    if (binary != nullptr) { return binary->getContigCount(); }
+    return seqan::length(seqan::contigNames(seqan::context(bam)));
+}
+
+string SamInput::getContigName(int rID) {
+    if (text != nullptr) { return text->getContigName(rID); }
+    if (binary != nullptr) { return binary->getContigName(rID); }
+    return seqan::toCString(seqan::contigNames(seqan::context(bam))[rID]);
+}
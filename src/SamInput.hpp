@@ -0,0 +1,57 @@
+#ifndef __SAM_INPUT_HPP__
+#define __SAM_INPUT_HPP__
+
+#include <deque>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <seqan/bam_io.h>
+#include "BamReader.hpp"
+#include "SamReader.hpp"
+
+/**
+ * A SAM/BAM input opened for a single, in-order pass. Unlike opening a
+ * seqan::BamFileIn by name, the input may be stdin (`-`) or a named pipe,
+ * since nothing is ever reread: the header is read once on open, and records
+ * read ahead with peek are handed out again by readRecord. SAM files on disk
+ * are read with SamReader instead of SeqAn and BAM files on disk with
+ * BamReader; both may be read by range.
+ */
+class SamInput {
+private:
+    SamReader *text;
+    BamReader *binary;
+    seqan::BamFileIn bam;
+    std::ifstream pipe;
+    seqan::BamHeader header;
+    std::deque<seqan::BamAlignmentRecord> lookahead;
+    /* The BAM record last read by readRecord, and which of its BAM_FIELD_*
+     * have been decoded. */
+    BamRecordView last;
+    int decoded;
+    bool readNext(seqan::BamAlignmentRecord &rec, std::string *raw,
+            int fields=BAM_FIELDS_ALL);
+public:
+    SamInput();
+    ~SamInput();
+    bool open(const std::string &filename);
+    bool setRange(long long start, long long end);
+    long long tell();
+    bool getRanges(int count,
+            std::vector<std::pair<long long, long long>> &ranges);
+    bool atEnd();
+    void readRecord(seqan::BamAlignmentRecord &rec, std::string *raw=nullptr,
+            int fields=BAM_FIELDS_ALL);
+    void decode(seqan::BamAlignmentRecord &rec, int fields);
+    bool hasRaw() const;
+    bool isText() const;
+    std::string getRawHeader() const;
+    int peek(int count);
+    const std::deque<seqan::BamAlignmentRecord> &getLookahead() const;
+    std::string getPGName();
+    int getContigCount();
+    std::string getContigName(int rID);
+};
+
+#endif
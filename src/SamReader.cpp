@@ -0,0 +1,345 @@
+#include <cstring> /* memchr, memcmp, memcpy */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "SamReader.hpp"
+using namespace std;
+
+/* Tags copied into records by parseRecord. Everything else is skipped. */
+static const char *KEPT_TAGS[] = {"NH", "MC", "CB", "CR", "UB", "UR"};
+
+bool SamField::equals(const char *s) const {
+    return strlen(s) == size && memcmp(data, s, size) == 0;
+}
+
+bool SamField::equals(const string &s) const {
+    return s.size() == size && memcmp(data, s.data(), size) == 0;
+}
+
+/**
+ * Parses an unsigned decimal at the start of field, ignoring what follows.
+ */
+static long parseNumber(SamField field) {
+    long n = 0;
+    for (size_t i = 0; i < field.size && isdigit(field.data[i]); ++i) {
+        n = n * 10 + (field.data[i] - '0');
+    }
+    return n;
+}
+
+/**
+ * Splits off the next tab-separated column of line, advancing line past it.
+ */
+static SamField nextField(SamField &line) {
+    const char *tab = (const char *)memchr(line.data, '\t', line.size);
+    SamField field(line.data, tab == nullptr ? line.size : tab - line.data);
+    size_t skip = tab == nullptr ? line.size : field.size + 1;
+    line.data += skip;
+    line.size -= skip;
+    return field;
+}
+
+SamReader::SamReader() : fd(-1), data(nullptr), size(0), body(0), pos(0),
+    limit(0), lastContigID(-1) {}
+
+SamReader::~SamReader() {
+    close();
+}
+
+/**
+ * Maps filename into memory and reads its header.
+ *
+ * @return      true if the file was opened, else false.
+ */
+bool SamReader::open(const string &filename) {
+    close();
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) { return false; }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close();
+        return false;
+    }
+    size = info.st_size;
+    if (size != 0) {
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close();
+            return false;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = (const char *)map;
+    }
+    readHeader();
+    setRange(body, size);
+    return true;
+}
+
+void SamReader::close() {
+    if (data != nullptr) {
+        munmap((void *)data, size);
+    }
+    if (fd != -1) {
+        ::close(fd);
+    }
+    fd = -1;
+    data = nullptr;
+    size = body = pos = limit = 0;
+    pg.clear();
+    contigs.clear();
+    contigIDs.clear();
+    lastContig.clear();
+    lastContigID = -1;
+}
+
+/**
+ * Reads the names of the references (@SQ SN:) and the ID of the first program
+ * (@PG ID:), and finds the first alignment line.
+ */
+void SamReader::readHeader() {
+    pg = "N/A";
+    bool pgSeen = false;
+    body = 0;
+    while (body < size && data[body] == '@') {
+        const char *nl = (const char *)memchr(data + body, '\n', size - body);
+        size_t end = nl == nullptr ? size : nl - data;
+        SamField line(data + body, end - body);
+        SamField type = nextField(line);
+        if (type.equals("@SQ") || (type.equals("@PG") && !pgSeen)) {
+            while (line.size != 0) {
+                SamField tag = nextField(line);
+                if (tag.size < 3 || tag.data[2] != ':') { continue; }
+                SamField value(tag.data + 3, tag.size - 3);
+                if (type.equals("@SQ") && memcmp(tag.data, "SN", 2) == 0) {
+                    contigIDs.emplace(value.str(), contigs.size());
+                    contigs.push_back(value.str());
+                } else if (type.equals("@PG") && memcmp(tag.data, "ID", 2) == 0)
+                {
+                    pg = value.str();
+                }
+            }
+            pgSeen = pgSeen || type.equals("@PG");
+        }
+        body = end == size ? size : end + 1;
+    }
+}
+
+size_t SamReader::getSize() const {
+    return size;
+}
+
+size_t SamReader::getBodyOffset() const {
+    return body;
+}
+
+/**
+ * @return      the header lines, including the final newline.
+ */
+SamField SamReader::getHeader() const {
+    return SamField(data, body);
+}
+
+string SamReader::getPGName() const {
+    return pg;
+}
+
+int SamReader::getContigCount() const {
+    return contigs.size();
+}
+
+const string &SamReader::getContigName(int rID) const {
+    return contigs[rID];
+}
+
+/**
+ * Looks up the ID of a reference name. Names missing from the header get new
+ * IDs in the order they are seen, like SeqAn does.
+ */
+int SamReader::getContigID(SamField name) {
+    if (name.size == 1 && name.data[0] == '*') {
+        return seqan::BamAlignmentRecord::INVALID_REFID;
+    }
+    if (lastContigID != -1 && lastContig.size() == name.size
+            && memcmp(lastContig.data(), name.data, name.size) == 0) {
+        return lastContigID;
+    }
+    lastContig.assign(name.data, name.size);
+    auto it = contigIDs.find(lastContig);
+    if (it == contigIDs.end()) {
+        it = contigIDs.emplace(lastContig, contigs.size()).first;
+        contigs.push_back(lastContig);
+    }
+    lastContigID = it->second;
+    return lastContigID;
+}
+
+/**
+ * Restricts reading to the lines that start in [start, end). A line belongs to
+ * the range its first character is in, so ranges that tile the file split its
+ * lines without overlap.
+ */
+void SamReader::setRange(size_t start, size_t end) {
+    start = max(start, body);
+    limit = min(end, size);
+    pos = start;
+    if (pos > body && pos < size && data[pos - 1] != '\n') {
+        const char *nl = (const char *)memchr(data + pos, '\n', size - pos);
+        pos = nl == nullptr ? size : nl - data + 1;
+    }
+}
+
+/**
+ * Splits the alignment lines into count byte ranges of about equal size, to be
+ * given to setRange.
+ */
+void SamReader::getRanges(int count, vector<pair<size_t, size_t>> &ranges)
+        const {
+    size_t length = (size - body) / count;
+    for (int i = 0; i < count; ++i) {
+        size_t start = body + i * length;
+        size_t end = i == count - 1 ? size : start + length;
+        ranges.push_back(make_pair(start, end));
+    }
+}
+
+/**
+ * @return      offset of the next line to be read.
+ */
+size_t SamReader::tell() const {
+    return pos;
+}
+
+/**
+ * @return      offset in the file of a line returned by nextLine.
+ */
+size_t SamReader::offsetOf(SamField line) const {
+    return line.data - data;
+}
+
+/**
+ * Whether no alignment lines are left in the range. Empty and header lines
+ * are skipped first, as nextLine would, so that a line is left whenever
+ * nextLine would return one.
+ */
+bool SamReader::atEnd() {
+    while (pos < limit && (data[pos] == '\n' || data[pos] == '@'
+                || (data[pos] == '\r'
+                    && (pos + 1 == size || data[pos + 1] == '\n')))) {
+        const char *nl = (const char *)memchr(data + pos, '\n', size - pos);
+        pos = nl == nullptr ? size : nl - data + 1;
+    }
+    return pos >= limit;
+}
+
+/**
+ * Gets the next alignment line (without its newline), skipping empty lines
+ * and any header lines.
+ *
+ * @return      false if there are no lines left in the range.
+ */
+bool SamReader::nextLine(SamField &line) {
+    while (pos < limit) {
+        const char *nl = (const char *)memchr(data + pos, '\n', size - pos);
+        size_t end = nl == nullptr ? size : nl - data;
+        line = SamField(data + pos, end - pos);
+        pos = end == size ? size : end + 1;
+        if (line.size != 0 && line.data[line.size - 1] == '\r') { --line.size; }
+        if (line.size != 0 && line.data[0] != '@') { return true; }
+    }
+    return false;
+}
+
+bool SamReader::readRecord(seqan::BamAlignmentRecord &rec) {
+    SamField line;
+    if (!nextLine(line)) { return false; }
+    parseRecord(line, rec);
+    return true;
+}
+
+/**
+ * Fills in the fields of rec that bam2tcc uses: qName, flag, rID, beginPos,
+ * cigar, rNextId, pNext, and the tags in KEPT_TAGS. SEQ, QUAL and all other
+ * tags are skipped.
+ */
+void SamReader::parseRecord(SamField line, seqan::BamAlignmentRecord &rec) {
+    SamField qName = nextField(line);
+    seqan::resize(rec.qName, qName.size);
+    if (qName.size != 0) {
+        memcpy(&rec.qName[0], qName.data, qName.size);
+    }
+    rec.flag = parseNumber(nextField(line));
+    rec.rID = getContigID(nextField(line));
+    rec.beginPos = parseNumber(nextField(line)) - 1;
+    nextField(line); /* MAPQ */
+
+    seqan::clear(rec.cigar);
+    SamField cigar = nextField(line);
+    unsigned count = 0;
+    for (size_t i = 0; i < cigar.size; ++i) {
+        if (isdigit(cigar.data[i])) {
+            count = count * 10 + (cigar.data[i] - '0');
+        } else if (cigar.data[i] != '*') {
+            seqan::appendValue(rec.cigar,
+                    seqan::CigarElement<>(cigar.data[i], count));
+            count = 0;
+        }
+    }
+
+    SamField rNext = nextField(line);
+    if (rNext.equals("=")) {
+        rec.rNextId = rec.rID;
+    } else {
+        rec.rNextId = getContigID(rNext);
+    }
+    rec.pNext = parseNumber(nextField(line)) - 1;
+    nextField(line); /* TLEN */
+    nextField(line); /* SEQ */
+    nextField(line); /* QUAL */
+
+    /* Tags are converted to their BAM encoding, which is what
+     * seqan::BamTagsDict reads. */
+    seqan::clear(rec.tags);
+    while (line.size != 0) {
+        SamField tag = nextField(line);
+        if (tag.size < 5 || tag.data[2] != ':' || tag.data[4] != ':') {
+            continue;
+        }
+        bool kept = false;
+        for (auto key : KEPT_TAGS) {
+            kept = kept || memcmp(tag.data, key, 2) == 0;
+        }
+        if (!kept) { continue; }
+        char type = tag.data[3];
+        if (type != 'i' && type != 'Z' && type != 'A') { continue; }
+        SamField value(tag.data + 5, tag.size - 5);
+        seqan::appendValue(rec.tags, tag.data[0]);
+        seqan::appendValue(rec.tags, tag.data[1]);
+        seqan::appendValue(rec.tags, type);
+        if (type == 'i') {
+            int n = value.size != 0 && value.data[0] == '-'
+                ? -parseNumber(SamField(value.data + 1, value.size - 1))
+                : parseNumber(value);
+            for (int b = 0; b < 4; ++b) {
+                seqan::appendValue(rec.tags, (char)((n >> (8 * b)) & 0xff));
+            }
+        } else if (type == 'A') {
+            seqan::appendValue(rec.tags, value.size != 0 ? value.data[0] : ' ');
+        } else {
+            for (size_t i = 0; i < value.size; ++i) {
+                seqan::appendValue(rec.tags, value.data[i]);
+            }
+            seqan::appendValue(rec.tags, '\0');
+        }
+    }
+}
+
+/**
+ * @return      column `column` (0-indexed) of line, empty if there is none.
+ */
+SamField SamReader::getField(SamField line, int column) {
+    for (int i = 0; i < column && line.size != 0; ++i) {
+        nextField(line);
+    }
+    return line.size == 0 ? SamField(line.data, 0) : nextField(line);
+}
@@ -0,0 +1,69 @@
+#ifndef __SAM_READER_HPP__
+#define __SAM_READER_HPP__
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <seqan/bam_io.h>
+
+/**
+ * Non-owning reference to a run of characters in a memory-mapped file.
+ */
+struct SamField {
+    const char *data;
+    size_t size;
+    SamField() : data(nullptr), size(0) {}
+    SamField(const char *data, size_t size) : data(data), size(size) {}
+    std::string str() const { return std::string(data, size); }
+    bool equals(const char *s) const;
+    bool equals(const std::string &s) const;
+};
+
+/**
+ * Reader for uncompressed SAM text files. The file is memory-mapped, lines are
+ * found with memchr, and only the columns bam2tcc uses are tokenized, without
+ * copying the line. A reader may be restricted to a byte range of the file;
+ * ranges that tile the file give each line to exactly one reader, so a file
+ * can be split among threads without counting its lines first.
+ */
+class SamReader {
+private:
+    int fd;
+    const char *data;
+    size_t size;
+    /* Start of the first alignment line, i.e. end of the header. */
+    size_t body;
+    /* Next line to read, and offset at which no new line may start. */
+    size_t pos, limit;
+    std::string pg;
+    std::vector<std::string> contigs;
+    std::unordered_map<std::string, int> contigIDs;
+    /* Last RNAME looked up. Inputs are usually sorted, so it repeats. */
+    std::string lastContig;
+    int lastContigID;
+    int getContigID(SamField name);
+    void readHeader();
+public:
+    SamReader();
+    ~SamReader();
+    bool open(const std::string &filename);
+    void close();
+    size_t getSize() const;
+    size_t getBodyOffset() const;
+    SamField getHeader() const;
+    std::string getPGName() const;
+    int getContigCount() const;
+    const std::string &getContigName(int rID) const;
+    void setRange(size_t start, size_t end);
+    void getRanges(int count, std::vector<std::pair<size_t, size_t>> &ranges)
+        const;
+    size_t tell() const;
+    size_t offsetOf(SamField line) const;
+    bool atEnd();
+    bool nextLine(SamField &line);
+    bool readRecord(seqan::BamAlignmentRecord &rec);
+    void parseRecord(SamField line, seqan::BamAlignmentRecord &rec);
+    static SamField getField(SamField line, int column);
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sys/resource.h>
+#include "Stats.hpp"
+#include "common.hpp"
+using namespace std;
+
+void MapCounts::add(const MapCounts &counts) {
+    records += counts.records;
+    tested += counts.tested;
+    unmappedFlag += counts.unmappedFlag;
+    improperPair += counts.improperPair;
+    mateOtherRef += counts.mateOtherRef;
+    notAnnotated += counts.notAnnotated;
+    pastAnnotation += counts.pastAnnotation;
+    mateSkipped += counts.mateSkipped;
+    barcodeDropped += counts.barcodeDropped;
+    noTranscript += counts.noTranscript;
+    matched += counts.matched;
+    mapped += counts.mapped;
+    unmapped += counts.unmapped;
+    incomplete += counts.incomplete;
+    noBarcode += counts.noBarcode;
+    noUMI += counts.noUMI;
+    busDropped += counts.busDropped;
+}
+
+void MapCounts::writeJSON(ostream &out) const {
+    out << "{\"records\": " << records
+        << ", \"unmapped_flag\": " << unmappedFlag
+        << ", \"improper_pair\": " << improperPair
+        << ", \"mate_other_ref\": " << mateOtherRef
+        << ", \"not_annotated\": " << notAnnotated
+        << ", \"past_annotation\": " << pastAnnotation
+        << ", \"mate_skipped\": " << mateSkipped
+        << ", \"barcode_dropped\": " << barcodeDropped
+        << ", \"no_transcript\": " << noTranscript
+        << ", \"matched\": " << matched
+        << ", \"alignments_tested\": " << tested
+        << ", \"templates_mapped\": " << mapped
+        << ", \"templates_unmapped\": " << unmapped
+        << ", \"templates_incomplete\": " << incomplete
+        << ", \"no_barcode\": " << noBarcode
+        << ", \"no_umi\": " << noUMI
+        << ", \"bus_dropped\": " << busDropped << "}";
+}
+
+static double seconds(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+Stats::Clock Stats::start(bool thread) {
+    return Clock{chrono::duration<double>(
+            chrono::steady_clock::now().time_since_epoch()).count(),
+        seconds(thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID),
+        thread};
+}
+
+void Stats::add(vector<Stage> &list, const string &name, const Clock &start) {
+    Clock end = Stats::start(start.thread);
+    for (auto it = list.begin(); it != list.end(); ++it) {
+        if (it->name.compare(name) == 0) {
+            ++it->tasks;
+            it->wall += end.wall - start.wall;
+            it->cpu += end.cpu - start.cpu;
+            return;
+        }
+    }
+    list.push_back(Stage{name, 1, end.wall - start.wall, end.cpu - start.cpu});
+}
+
+/**
+ * Adds the time since start to stage name, e.g. "map".
+ */
+void Stats::endStage(const string &name, const Clock &start) {
+    sem.dec();
+    add(stages, name, start);
+    sem.inc();
+}
+
+/**
+ * Adds the time since start to the mapping of chromosome name. Several
+ * threads (for different files) may map the same chromosome at once, so its
+ * wall time may exceed that of the whole run.
+ */
+void Stats::endChrom(const string &name, const Clock &start) {
+    sem.dec();
+    add(chroms, name, start);
+    sem.inc();
+}
+
+/**
+ * Adds a thread's counts for a file, and chromosome if not empty.
+ */
+void Stats::addCounts(int file, const string &chrom,
+        const MapCounts &counts) {
+    sem.dec();
+    if ((size_t)file >= this->counts.size()) {
+        this->counts.resize(file + 1);
+    }
+    this->counts[file][chrom].add(counts);
+    sem.inc();
+}
+
+void Stats::writeStages(ostream &out, const vector<Stage> &list,
+        const string &indent) {
+    out << "[";
+    for (auto it = list.begin(); it != list.end(); ++it) {
+        out << (it == list.begin() ? "\n" : ",\n") << indent << "  {\"name\": ";
+        writeString(out, it->name);
+        out << ", \"tasks\": " << it->tasks << ", \"wall_s\": " << it->wall
+            << ", \"cpu_s\": " << it->cpu << "}";
+    }
+    out << (list.empty() ? "]" : "\n" + indent + "]");
+}
+
+/**
+ * Writes the stages, chromosomes and counts as a JSON object to filename.
+ * records_per_s is over the wall time of the "map" stage. "fates" are the
+ * counts of the whole run, and "files" those of each input file, and of each
+ * of its chromosomes when mapped by chromosome.
+ *
+ * @param ecs   number of equivalence classes in the matrix.
+ * @param files names of the input files.
+ */
+bool Stats::writeJSON(const string &filename, int ecs,
+        const vector<string> &files) {
+    ofstream out(filename);
+    if (!out.is_open()) { return false; }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    sem.dec();
+    MapCounts total;
+    vector<MapCounts> fileTotals(counts.size());
+    for (size_t i = 0; i < counts.size(); ++i) {
+        for (auto it = counts[i].begin(); it != counts[i].end(); ++it) {
+            fileTotals[i].add(it->second);
+        }
+        total.add(fileTotals[i]);
+    }
+    double mapWall = 0;
+    for (auto it = stages.begin(); it != stages.end(); ++it) {
+        if (it->name.compare("map") == 0) { mapWall = it->wall; }
+    }
+    out << fixed << setprecision(3) << "{\n  \"stages\": ";
+    writeStages(out, stages, "  ");
+    out << ",\n  \"chromosomes\": ";
+    writeStages(out, chroms, "  ");
+    out << ",\n  \"records\": " << total.records
+        << ",\n  \"records_per_s\": "
+        << (mapWall > 0 ? total.records / mapWall : 0)
+        << ",\n  \"alignments_tested\": " << total.tested
+        << ",\n  \"templates_mapped\": " << total.mapped
+        << ",\n  \"templates_unmapped\": " << total.unmapped
+        << ",\n  \"ecs\": " << ecs
+        << ",\n  \"peak_rss_kb\": " << usage.ru_maxrss
+        << ",\n  \"fates\": ";
+    total.writeJSON(out);
+    out << ",\n  \"files\": [";
+    for (size_t i = 0; i < counts.size(); ++i) {
+        out << (i == 0 ? "\n" : ",\n") << "    {\"file\": ";
+        writeString(out, i < files.size() ? files[i] : to_string(i));
+        out << ", \"fates\": ";
+        fileTotals[i].writeJSON(out);
+        out << ", \"chromosomes\": {";
+        bool first = true;
+        for (auto it = counts[i].begin(); it != counts[i].end(); ++it) {
+            if (it->first.size() == 0) { continue; }
+            out << (first ? "\n" : ",\n") << "      ";
+            writeString(out, it->first);
+            out << ": ";
+            it->second.writeJSON(out);
+            first = false;
+        }
+        out << (first ? "}}" : "\n    }}");
+    }
+    out << (counts.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    sem.inc();
+    out.close();
+    return !out.fail();
+}
@@ -0,0 +1,75 @@
+#ifndef __STATS_HPP__
+#define __STATS_HPP__
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Semaphore.hpp"
+
+/**
+ * Counts a mapping thread keeps with its output buffers and hands to Stats
+ * when it flushes them, so that nothing is shared while counting.
+ */
+struct MapCounts {
+    /* Alignment records read, and alignment-transcript pairs compared. */
+    uint64_t records = 0, tested = 0;
+    /* What became of each record: rejected for the unmapped flag, for not
+     * being properly paired or for a mate on another reference; on a
+     * reference without annotation, or past its last transcript; skipped as
+     * the right mate of a pair resolved from its MC tag; dropped for its
+     * barcode (--whitelist); or compared with transcripts, and matching none
+     * or some. These add up to records. */
+    uint64_t unmappedFlag = 0, improperPair = 0, mateOtherRef = 0,
+             notAnnotated = 0, pastAnnotation = 0, mateSkipped = 0,
+             barcodeDropped = 0, noTranscript = 0, matched = 0;
+    /* Templates (reads, or pairs of mates) counted with and without an EC;
+     * of these, those missing some of their alignments (NH), and of the
+     * mapped, those not counted for having no cell barcode or no UMI, and
+     * those left out of --bus output for a barcode it can't encode. */
+    uint64_t mapped = 0, unmapped = 0, incomplete = 0, noBarcode = 0,
+             noUMI = 0, busDropped = 0;
+    void add(const MapCounts &counts);
+    void writeJSON(std::ostream &out) const;
+};
+
+/**
+ * Timing and throughput of a run, for --stats-json: wall and CPU time of each
+ * stage and of mapping each chromosome, and the mapping threads' MapCounts
+ * by file and chromosome. Thread-safe.
+ */
+class Stats {
+public:
+    /* Wall and CPU time (seconds) at the start of a stage. CPU time is the
+     * process's, or only the calling thread's if thread. */
+    struct Clock {
+        double wall, cpu;
+        bool thread;
+    };
+private:
+    /* Stages of the same name are added up; tasks counts them. */
+    struct Stage {
+        std::string name;
+        int tasks;
+        double wall, cpu;
+    };
+    std::vector<Stage> stages, chroms;
+    /* Counts by input file, then chromosome ("" if not known). */
+    std::vector<std::map<std::string, MapCounts>> counts;
+    Semaphore sem;
+    static void add(std::vector<Stage> &list, const std::string &name,
+            const Clock &start);
+    static void writeStages(std::ostream &out, const std::vector<Stage> &list,
+            const std::string &indent);
+public:
+    static Clock start(bool thread=false);
+    void endStage(const std::string &name, const Clock &start);
+    void endChrom(const std::string &name, const Clock &start);
+    void addCounts(int file, const std::string &chrom,
+            const MapCounts &counts);
+    bool writeJSON(const std::string &filename, int ecs,
+            const std::vector<std::string> &files);
+};
+
+#endif
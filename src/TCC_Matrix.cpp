@@ -1,16 +1,46 @@
 #include "TCC_Matrix.hpp"
+#include "Trace.hpp"
+#include "TccBinary.hpp"
+#include <algorithm>
+#include <climits>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 using namespace std;
 
+/* Matrix entries formatted per chunk of output, one chunk per task. */
+#define WRITE_CHUNK_CELLS (1 << 20)
+/* Most counters allocated up front for singleton ECs (64 MB). Transcripts
+ * beyond it are counted in the hash map like any other EC. */
+#define DENSE_SINGLETON_MAX_CELLS (1 << 24)
+/* Locks over the singleton ECs of a growable matrix. */
+#define SINGLETON_SEMS 64
+
+static_assert(sizeof(atomic<int>) == sizeof(int),
+        "dense counters are read back as plain ints");
+
 /**
  * Constructer for new TCC_Matrix holding information for `file_count` number of
  * SAM files.
  * 
- * @param num_files    number of SAM files
+ * @param num_files        number of SAM files, or 0 for a matrix whose
+ *                         columns are added by add_file
+ * @param num_transcripts  bound on transcript IDs; the ECs made of a single
+ *                         one of these are counted in an array rather than in
+ *                         the hash map.
  */
-TCC_Matrix::TCC_Matrix(int file_count) {
+TCC_Matrix::TCC_Matrix(int file_count, int num_transcripts) {
     num_files = file_count;
-    matrix = new unordered_map<string, int*>;
+    growable = file_count == 0;
+    num_singletons = min(max(num_transcripts, 0), growable
+            ? (int)(DENSE_SINGLETON_MAX_CELLS * sizeof(int) / sizeof(Cells))
+            : DENSE_SINGLETON_MAX_CELLS / max(file_count, 1));
+    dense = growable || num_singletons == 0 ? nullptr
+        : new atomic<int>[(size_t)num_singletons * num_files]();
+    singleton_cells = growable ? new Cells[num_singletons]() : nullptr;
+    singleton_sems = growable ? new Semaphore[SINGLETON_SEMS] : nullptr;
+    matrix = new unordered_map<string, int>;
     sem = new Semaphore;
 }
 
@@ -18,31 +48,197 @@ TCC_Matrix::TCC_Matrix(int file_count) {
  * Deconstructor for TCC_Matrix.
  */
 TCC_Matrix::~TCC_Matrix() {
-    for (auto it = matrix->begin(); it != matrix->end(); ++it) {
-        delete[] it->second;
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+        delete[] it->full;
     }
+    delete[] dense;
+    delete[] singleton_cells;
+    delete[] singleton_sems;
     delete matrix;
     delete sem;
 }
 
+/**
+ * The transcript TCC consists of, if it is a single one counted in dense,
+ * otherwise -1.
+ */
+int TCC_Matrix::singleton(const string &TCC) {
+    if (TCC.size() == 0 || TCC.size() > 9 || (TCC[0] == '0' && TCC.size() > 1)
+            || TCC.find_first_not_of("0123456789") != string::npos) {
+        return -1;
+    }
+    int id = stoi(TCC);
+    return id < num_singletons ? id : -1;
+}
+
+/**
+ * Whether counts, one per file, has a nonzero entry.
+ */
+static bool isNonzero(const int *counts, int num_files) {
+    for (int j = 0; j < num_files; ++j) {
+        if (counts[j] != 0) { return true; }
+    }
+    return false;
+}
+
+/**
+ * Adds count to the count of singleton EC id in file number file_num.
+ */
+void TCC_Matrix::add_singleton(int id, int file_num, int count) {
+    if (dense != nullptr) {
+        dense[(size_t)id * num_files + file_num].fetch_add(count,
+                memory_order_relaxed);
+        return;
+    }
+    Semaphore &s = singleton_sems[id % SINGLETON_SEMS];
+    Trace::lock(s, "lock singleton");
+    cell(singleton_cells[id], file_num) += count;
+    s.inc();
+}
+
+/**
+ * Counts of singleton EC id, one per file. Only to be read once counting is
+ * done.
+ */
+const int *TCC_Matrix::dense_row(int id) {
+    return reinterpret_cast<const int*>(dense + (size_t)id * num_files);
+}
+
+/**
+ * The output row of singleton EC id. Only to be read once counting is done.
+ */
+TCC_Matrix::Row TCC_Matrix::singleton_row(const string *ec, int id) {
+    if (dense != nullptr) { return Row{ec, id, dense_row(id), nullptr}; }
+    Row row = cells_row(ec, singleton_cells[id]);
+    row.id = id;
+    return row;
+}
+
+/**
+ * Whether singleton EC id has a nonzero count.
+ */
+bool TCC_Matrix::is_singleton_nonzero(int id) {
+    if (dense != nullptr) { return isNonzero(dense_row(id), num_files); }
+    const vector<pair<int, int>> &nonzero = singleton_cells[id].nonzero;
+    for (auto c = nonzero.begin(); c != nonzero.end(); ++c) {
+        if (c->second != 0) { return true; }
+    }
+    return false;
+}
+
+/**
+ * Increments count for EC in file number `file_num`. Single transcripts below
+ * num_transcripts take one atomic increment.
+ *
+ * @param EC          Sorted transcript IDs of the equivalence class.
+ * @param file_num    Index of SAM file (should be less than num_files).
+ * @return            ID of the equivalence class (see inc_TCC(string, int)).
+ */
+int TCC_Matrix::inc_TCC(const vector<int> &EC, int file_num) {
+    if (EC.size() == 1 && EC[0] >= 0 && EC[0] < num_singletons) {
+        add_singleton(EC[0], file_num, 1);
+        return EC[0];
+    }
+    return inc_TCC(formatEC(EC), file_num);
+}
+
+/**
+ * Gives EC a row, if it has none, without counting anything.
+ *
+ * @return      ID of the equivalence class, as returned by inc_TCC.
+ */
+int TCC_Matrix::add_TCC(const vector<int> &EC) {
+    if (EC.size() == 1 && EC[0] >= 0 && EC[0] < num_singletons) {
+        return EC[0];
+    }
+    string TCC = formatEC(EC);
+    Trace::lock(*sem, "lock matrix");
+    int id = num_singletons + index_of(TCC);
+    sem->inc();
+    return id;
+}
+
+/**
+ * Adds count to the count of the equivalence class with ID ec_id (as returned
+ * by inc_TCC or add_TCC) in file number `file_num`.
+ */
+void TCC_Matrix::add_count(int ec_id, int file_num, int count) {
+    if (ec_id < num_singletons) {
+        add_singleton(ec_id, file_num, count);
+        return;
+    }
+    Trace::lock(*sem, "lock matrix");
+    cell(counts[ec_id - num_singletons], file_num) += count;
+    sem->inc();
+}
+
+/**
+ * The string representation of EC, e.g. "1,4,5".
+ */
+string TCC_Matrix::formatEC(const vector<int> &EC) {
+    string TCC;
+    for (size_t i = 0; i < EC.size(); ++i) {
+        if (i != 0) { TCC += ','; }
+        TCC += to_string(EC[i]);
+    }
+    return TCC;
+}
+
+/**
+ * Index in counts of TCC, which is added if new. sem must be held.
+ */
+int TCC_Matrix::index_of(const string &TCC) {
+    auto it = matrix->emplace(TCC, counts.size());
+    if (it.second) {
+        counts.push_back(Cells{nullptr, {}});
+    }
+    return it.first->second;
+}
+
 /**
  * Increments count for TCC in file number `file_num`.
  *
  * @param TCC         String representation of equivalence class of read.
  * @param file_num    Index of SAM file (should be less than num_files).
+ * @return            ID of the equivalence class, its row when written with
+ *                    num_transcripts = get_num_singletons(): the transcript
+ *                    for singletons counted in dense, otherwise
+ *                    get_num_singletons() plus its order of appearance.
  */
-void TCC_Matrix::inc_TCC(string TCC, int file_num) {
-    sem->dec();
-    auto it = matrix->find(TCC);
-    if (it == matrix->end()) {
-        int *arr = new int[num_files];
-        for (int i = 0; i < num_files; ++i) {
-            arr[i] = 0;
-        }
-        matrix->emplace(TCC, arr);
+int TCC_Matrix::inc_TCC(string TCC, int file_num) {
+    int id = singleton(TCC);
+    if (id != -1) {
+        add_singleton(id, file_num, 1);
+        return id;
     }
-    ++(*matrix)[TCC][file_num];
+    Trace::lock(*sem, "lock matrix");
+    int index = index_of(TCC);
+    ++cell(counts[index], file_num);
+    sem->inc();
+    return num_singletons + index;
+}
+
+/**
+ * Adds a column to a matrix constructed with no files, e.g. for a cell first
+ * seen while counting. The rows of such a matrix, singletons included, stay
+ * (file, count) pairs, so nothing needs to be resized.
+ *
+ * @return      index of the new column.
+ */
+int TCC_Matrix::add_file() {
+    sem->dec();
+    int file_num = num_files++;
     sem->inc();
+    return file_num;
+}
+
+/**
+ * Number of transcripts whose singleton ECs are counted apart from the hash
+ * map (in dense, or singleton_cells), i.e. the first ID given to any other
+ * EC.
+ */
+int TCC_Matrix::get_num_singletons() {
+    return num_singletons;
 }
 
 /**
@@ -57,99 +253,401 @@ void TCC_Matrix::inc_TCC(string TCC, int file_num) {
  * @param file_num    Index of SAM file (should be less than num_files).
  */
 void TCC_Matrix::dec_TCC(string TCC, int file_num) {
+    int id = singleton(TCC);
+    if (id != -1) {
+        add_singleton(id, file_num, -1);
+        return;
+    }
     sem->dec();
-    --(*matrix)[TCC][file_num];
+    --cell(counts[matrix->at(TCC)], file_num);
     sem->inc();
 }
 
 /**
- * Writes information in TCC_Matrix to files of names <outname>.ec and
- * <outname>.tsv. Returns 1 if error occurs in opening files, otherwise 0.
+ * The count of cells for file file_num, added (as 0) if it had none. Once
+ * half the files have a count, cells switches to an array of them all, which
+ * then takes no more memory than the (file, count) pairs.
+ */
+int &TCC_Matrix::cell(Cells &cells, int file_num) {
+    if (cells.full != nullptr) { return cells.full[file_num]; }
+    vector<pair<int, int>> &nonzero = cells.nonzero;
+    auto it = lower_bound(nonzero.begin(), nonzero.end(),
+            make_pair(file_num, INT_MIN));
+    if (it != nonzero.end() && it->first == file_num) { return it->second; }
+    if (growable || 2 * (nonzero.size() + 1) < (size_t)num_files) {
+        return nonzero.insert(it, make_pair(file_num, 0))->second;
+    }
+    cells.full = new int[num_files]();
+    for (auto c = nonzero.begin(); c != nonzero.end(); ++c) {
+        cells.full[c->first] = c->second;
+    }
+    vector<pair<int, int>>().swap(nonzero);
+    return cells.full[file_num];
+}
+
+/**
+ * The output row of an equivalence class with counts cells.
+ */
+TCC_Matrix::Row TCC_Matrix::cells_row(const string *ec, const Cells &cells) {
+    return Row{ec, 0, cells.full, cells.full ? nullptr : &cells.nonzero};
+}
+
+/**
+ * Calls f(file, count) for each nonzero count of the row for a file in
+ * [begin, end), by file.
+ */
+template<typename F>
+void TCC_Matrix::Row::for_each(int begin, int end, F f) const {
+    if (counts != nullptr) {
+        for (int j = begin; j < end; ++j) {
+            if (counts[j] != 0) { f(j, counts[j]); }
+        }
+    } else if (nonzero != nullptr) {
+        auto it = lower_bound(nonzero->begin(), nonzero->end(),
+                make_pair(begin, INT_MIN));
+        for (; it != nonzero->end() && it->first < end; ++it) {
+            if (it->second != 0) { f(it->first, it->second); }
+        }
+    }
+}
+
+/**
+ * Appends the decimal representation of n to out. Faster than `<<` on a
+ * stream, which goes through the locale for every number.
+ */
+static void appendInt(string &out, long long n) {
+    char buf[24], *p = buf + sizeof(buf);
+    bool negative = n < 0;
+    unsigned long long u = negative ? -(unsigned long long)n : n;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    if (negative) { *--p = '-'; }
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+/**
+ * Formats a row of the .ec file: its index, then its EC (or id if ec is
+ * nullptr, for singleton ECs).
+ */
+static void appendECRow(string &out, long long index, const string *ec,
+        int id) {
+    appendInt(out, index);
+    out += '\t';
+    if (ec == nullptr) { appendInt(out, id); }
+    else { out += *ec; }
+    out += '\n';
+}
+
+/**
+ * Writes the output of format, n items cut into chunks of chunkSize, to out.
+ * Chunks are formatted by up to nThreads threads at once and written in
+ * order, each with a single write.
  *
- * @param outname    Name of output files (without file extension).
- * @return           1 if error occurs in opening files, otherwise 0.
+ * @param format    appends the output of items [begin, end) to a string.
  */
-int TCC_Matrix::write_to_file(string outname, int num_transcripts) {
+static bool writeChunks(ofstream &out, size_t n, size_t chunkSize,
+        int nThreads, const function<void(size_t, size_t, string&)> &format) {
+    deque<future<string>> pending;
+    bool success = true;
+    auto writeFront = [&out, &pending, &success]() {
+        string chunk = pending.front().get();
+        pending.pop_front();
+        out.write(chunk.data(), chunk.size());
+        success = success && !out.fail();
+    };
+    chunkSize = max(chunkSize, (size_t)1);
+    for (size_t begin = 0; begin < n; begin += chunkSize) {
+        size_t end = min(n, begin + chunkSize);
+        pending.push_back(async(nThreads > 1 ? launch::async : launch::deferred,
+                    [&format, begin, end]() {
+                        string chunk;
+                        format(begin, end, chunk);
+                        return chunk;
+                    }));
+        while (pending.size() >= (size_t)max(nThreads, 1)) { writeFront(); }
+    }
+    while (!pending.empty()) { writeFront(); }
+    return success;
+}
+
+/**
+ * Cuts [first, last) into a block per thread, as the bounds of each block
+ * followed by last.
+ */
+static vector<size_t> getBlocks(size_t first, size_t last, int nThreads) {
+    vector<size_t> blocks;
+    size_t step = max((last - first) / max(nThreads, 1), (size_t)1);
+    for (size_t begin = first; begin < last; begin += step) {
+        blocks.push_back(begin);
+    }
+    blocks.push_back(last);
+    return blocks;
+}
+
+/**
+ * Counts the nonzero entries of each file in each block of rows, a thread per
+ * block. Rows are visited in the order visit gives (rows[visit[k]] for each k
+ * of the blocks), or in their own order if visit is nullptr.
+ *
+ * @param fileCounts    set to the counts of each block and file.
+ * @return              the number of nonzero entries.
+ */
+size_t TCC_Matrix::count_by_file(const vector<Row> &rows, const size_t *visit,
+        const vector<size_t> &blocks, int nThreads,
+        vector<vector<size_t>> &fileCounts) {
+    int files = num_files;
+    size_t num_blocks = blocks.size() - 1;
+    fileCounts.assign(num_blocks, vector<size_t>(files));
+    vector<future<size_t>> nnzs;
+    for (size_t b = 0; b < num_blocks; ++b) {
+        size_t begin = blocks[b], end = blocks[b + 1];
+        size_t *counts = fileCounts[b].data();
+        nnzs.push_back(async(nThreads > 1 ? launch::async : launch::deferred,
+                    [&rows, visit, files, counts, begin, end]() {
+                        size_t nnz = 0;
+                        for (size_t k = begin; k < end; ++k) {
+                            size_t i = visit != nullptr ? visit[k] : k;
+                            rows[i].for_each(0, files,
+                                    [&nnz, counts](int j, int) {
+                                        ++nnz;
+                                        ++counts[j];
+                                    });
+                        }
+                        return nnz;
+                    }));
+    }
+    size_t nnz = 0;
+    for (auto it = nnzs.begin(); it != nnzs.end(); ++it) { nnz += it->get(); }
+    return nnz;
+}
+
+/**
+ * Sorts the nonzero entries of rows by file with a counting sort, from the
+ * counts of each block and file that count_by_file (or the like) gathered for
+ * the same rows, visit and blocks. A file's entries stay in visiting order.
+ *
+ * @param fileCounts    the counts, overwritten.
+ * @param entries       set to the (row, count) of each entry, file by file.
+ * @param fileStarts    set to where each file's entries start in entries,
+ *                      followed by their number.
+ */
+void TCC_Matrix::sort_by_file(const vector<Row> &rows, const size_t *visit,
+        const vector<size_t> &blocks, vector<vector<size_t>> &fileCounts,
+        int nThreads, vector<pair<int, int>> &entries,
+        vector<size_t> &fileStarts) {
+    int files = num_files;
+    size_t num_blocks = blocks.size() - 1;
+    /* Each block puts its entries of each file after those of the blocks
+     * before it. */
+    fileStarts.assign(files + 1, 0);
+    size_t offset = 0;
+    for (int j = 0; j < files; ++j) {
+        fileStarts[j] = offset;
+        for (size_t b = 0; b < num_blocks; ++b) {
+            size_t count = fileCounts[b][j];
+            fileCounts[b][j] = offset;
+            offset += count;
+        }
+    }
+    fileStarts[files] = offset;
+    entries.resize(offset);
+    vector<future<void>> fills;
+    for (size_t b = 0; b < num_blocks; ++b) {
+        size_t begin = blocks[b], end = blocks[b + 1];
+        size_t *next = fileCounts[b].data();
+        fills.push_back(async(nThreads > 1 ? launch::async : launch::deferred,
+                    [&rows, &entries, visit, files, next, begin, end]() {
+                        for (size_t k = begin; k < end; ++k) {
+                            size_t i = visit != nullptr ? visit[k] : k;
+                            rows[i].for_each(0, files,
+                                    [&entries, next, i](int j, int c) {
+                                        entries[next[j]++] =
+                                            make_pair((int)i, c);
+                                    });
+                        }
+                    }));
+    }
+    for (auto it = fills.begin(); it != fills.end(); ++it) { it->get(); }
+}
+
+/**
+ * Writes rows to <outname>.ec and <outname>.tsv, the .tsv as a full matrix or
+ * in sparse (row, file, count) form, row by row.
+ *
+ * @return           1 if error occurs in opening or writing files, otherwise 0.
+ */
+int TCC_Matrix::write_rows(const string &outname, const vector<Row> &rows,
+        bool sparse, int nThreads) {
     ofstream ec(outname + ".ec");
     ofstream tsv(outname + ".tsv");
     if (!ec.is_open() || !tsv.is_open()) { return 1; }
 
-    int count = 0;
-    while (count < num_transcripts) {
-        ec << count << '\t' << count << endl;
-        tsv << count;
-        auto it = matrix->find(to_string(count));
-        if (it == matrix->end()) {
-            for (int i = 0; i < num_files; ++i) {
-                tsv << '\t' << 0;
-            }
-        } else {
-            for (int i = 0; i < num_files; ++i) {
-                tsv << '\t' << it->second[i];
-            }
+    int files = num_files;
+    bool success = writeChunks(ec, rows.size(), WRITE_CHUNK_CELLS, nThreads,
+            [&rows](size_t begin, size_t end, string &out) {
+                for (size_t i = begin; i < end; ++i) {
+                    appendECRow(out, i, rows[i].ec, rows[i].id);
+                }
+            });
+    success = writeChunks(tsv, rows.size(), WRITE_CHUNK_CELLS / max(files, 1),
+            nThreads, [&rows, files, sparse](size_t begin, size_t end,
+                string &out) {
+                for (size_t i = begin; i < end; ++i) {
+                    if (sparse) {
+                        rows[i].for_each(0, files, [&out, i](int j, int c) {
+                                    appendInt(out, i);
+                                    out += '\t';
+                                    appendInt(out, j);
+                                    out += '\t';
+                                    appendInt(out, c);
+                                    out += '\n';
+                                });
+                        continue;
+                    }
+                    appendInt(out, i);
+                    int next = 0;
+                    rows[i].for_each(0, files, [&out, &next](int j, int c) {
+                                for (; next < j; ++next) { out += "\t0"; }
+                                out += '\t';
+                                appendInt(out, c);
+                                next = j + 1;
+                            });
+                    for (; next < files; ++next) { out += "\t0"; }
+                    out += '\n';
+                }
+            }) && success;
+    ec.close();
+    tsv.close();
+    return success ? 0 : 1;
+}
+
+/**
+ * Number of equivalence classes seen: the singletons counted in the dense
+ * array so far, and all others.
+ */
+int TCC_Matrix::get_num_ECs() {
+    int ecs = 0;
+    for (int id = 0; id < num_singletons; ++id) {
+        if (is_singleton_nonzero(id)) { ++ecs; }
+    }
+    sem->dec();
+    ecs += counts.size();
+    sem->inc();
+    return ecs;
+}
+
+/**
+ * Lists the rows of write_to_file and write_to_file_sparse: the transcripts
+ * below num_transcripts, then every other EC, those not counted in dense in
+ * order of appearance.
+ */
+void TCC_Matrix::get_rows(vector<Row> &rows, int num_transcripts) {
+    rows.clear();
+    rows.reserve(max(num_transcripts, num_singletons) + counts.size());
+    for (int id = 0; id < num_transcripts; ++id) {
+        rows.push_back(id < num_singletons ? singleton_row(nullptr, id)
+                : Row{nullptr, id, nullptr, nullptr});
+    }
+    for (int id = max(num_transcripts, 0); id < num_singletons; ++id) {
+        if (is_singleton_nonzero(id)) {
+            rows.push_back(singleton_row(nullptr, id));
         }
-        tsv << endl;
-        ++count;
     }
+    vector<const string*> ecs(counts.size());
     for (auto it = matrix->begin(); it != matrix->end(); ++it) {
-        if (it->first.find(',') == string::npos
-                && stoi(it->first) < num_transcripts) { continue; }
-        ec << count << '\t' << it->first << endl;
-        tsv << count;
-        for (int i = 0; i < num_files; ++i) {
-            tsv << '\t' << it->second[i];
+        ecs[it->second] = &it->first;
+    }
+    for (size_t i = 0; i < ecs.size(); ++i) {
+        if (ecs[i]->find(',') == string::npos) {
+            int id = stoi(*ecs[i]);
+            if (id >= 0 && id < num_transcripts) {
+                rows[id] = cells_row(nullptr, counts[i]);
+                rows[id].id = id;
+                continue;
+            }
         }
-        tsv << endl;
-        ++count;
+        rows.push_back(cells_row(ecs[i], counts[i]));
     }
-    ec.close();
-    tsv.close();
-    return 0;
 }
 
 /**
  * Writes information in TCC_Matrix to files of names <outname>.ec and
  * <outname>.tsv. Returns 1 if error occurs in opening files, otherwise 0.
- * Specifically, writes everything in kallisto sparse format.
  *
- * TODO: Is there a more cache-friendly way of doing this, or even implementing
- * this class in light of the fact that I have to output things this way?
+ * @param outname    Name of output files (without file extension).
+ * @param nThreads   Number of threads formatting output.
+ * @return           1 if error occurs in opening files, otherwise 0.
+ */
+int TCC_Matrix::write_to_file(string outname, int num_transcripts,
+        int nThreads) {
+    vector<Row> rows;
+    get_rows(rows, num_transcripts);
+    return write_rows(outname, rows, false, nThreads);
+}
+
+/**
+ * Writes information in TCC_Matrix to files of names <outname>.ec and
+ * <outname>.tsv. Returns 1 if error occurs in opening files, otherwise 0.
+ * Specifically, writes everything in kallisto sparse format.
  *
  * @param outname    Name of output files (without file extension).
+ * @param nThreads   Number of threads formatting output.
  * @return           1 if error occurs in opening files, otherwise 0.
  */
-int TCC_Matrix::write_to_file_sparse(string outname, int num_transcripts) {
-    ofstream ec(outname + ".ec");
-    ofstream tsv(outname + ".tsv");
-    if (!ec.is_open() || !tsv.is_open()) { return 1; }
+int TCC_Matrix::write_to_file_sparse(string outname, int num_transcripts,
+        int nThreads) {
+    vector<Row> rows;
+    get_rows(rows, num_transcripts);
+    return write_rows(outname, rows, true, nThreads);
+}
 
-    int count = 0;
-    while (count < num_transcripts) {
-        ec << count << '\t' << count << endl;
-        auto it = matrix->find(to_string(count));
-        if (it != matrix->end()) {
-            for (int j = 0; j < num_files; ++j) {
-                if (it->second[j] != 0) {
-                    tsv << count << '\t' << j << '\t' << it->second[j] << endl;
-                }
-            }
+/**
+ * Lists the rows for the equivalence classes in order, each looked up in the
+ * matrix once, and marks which of our classes they cover.
+ *
+ * @param listed    set to whether each class is in order: the singletons
+ *                  counted in dense by id, then the others by their index in
+ *                  counts, after num_singletons.
+ */
+void TCC_Matrix::get_order_rows(const vector<string> &order,
+                                vector<Row> &rows, vector<bool> &listed) {
+    listed.assign(num_singletons + counts.size(), false);
+    rows.reserve(order.size() + num_singletons + counts.size());
+    for (uint i = 0; i < order.size(); ++i) {
+        int id = singleton(order[i]);
+        if (id != -1) {
+            rows.push_back(singleton_row(&order[i], id));
+            listed[id] = true;
+            continue;
+        }
+        auto elt = matrix->find(order[i]);
+        if (elt == matrix->end()) {
+            rows.push_back(Row{&order[i], 0, nullptr, nullptr});
+        } else {
+            rows.push_back(cells_row(&order[i], counts[elt->second]));
+            listed[num_singletons + elt->second] = true;
+        }
+    }
+}
+
+/**
+ * Appends the rows of our classes not listed (see get_order_rows): nonzero
+ * singletons by id, then the rest in matrix order.
+ */
+void TCC_Matrix::get_unlisted_rows(const vector<bool> &listed,
+                                   vector<Row> &rows) {
+    for (int id = 0; id < num_singletons; ++id) {
+        if (!listed[id] && is_singleton_nonzero(id)) {
+            rows.push_back(singleton_row(nullptr, id));
         }
-        ++count;
     }
     for (auto it = matrix->begin(); it != matrix->end(); ++it) {
-        if (it->first.find(',') == string::npos
-                && stoi(it->first) < num_transcripts) { continue; }
-        ec << count << '\t' << it->first << endl;
-        for (int i = 0; i < num_files; ++i) {
-            if (it->second[i] != 0) {
-                tsv << count << '\t' << i << '\t' << it->second[i] << endl;
-            }
+        if (!listed[num_singletons + it->second]) {
+            rows.push_back(cells_row(&it->first, counts[it->second]));
         }
-        ++count;
     }
-    ec.close();
-    tsv.close();
-    return 0;
 }
 
 /**
@@ -162,88 +660,41 @@ int TCC_Matrix::write_to_file_sparse(string outname, int num_transcripts) {
  * @param order         Vector of strings describing the order in which to
  * output equivalence classes.
  *
- * @param ecs           Set of the strings in order. Used to speed up runtime.
+ * @param nThreads      Number of threads formatting output.
  *
  * @return              1 if error occurs in opening files, otherwise 0.
  */
 int TCC_Matrix::write_to_file_in_order(string outname,
                                        const vector<string> &order,
-                                       const unordered_set<string> &ecs) {
-    
-    /* Open the file and die if something goes wrong */
-    ofstream ec(outname + ".ec");
-    ofstream tsv(outname + ".tsv");
-    if (!ec.is_open() || !tsv.is_open()) {
-        return 1;
-    }
-    
-    /* Go through each equivalence class in vector order, use our map to locate
-     the TCC, and output it */
-    for (uint i = 0; i < order.size(); ++i) {
-        ec << i << '\t' << order[i] << endl;
-        
-        // Try to find equivalence class in TCC matrix.
-        auto elt = matrix->find(order[i]);
-        tsv << i;
-        // Equivalence class found. Add it to the vector of unfound classes.
-        if (elt != matrix->end()) {
-            for (int j = 0; j < num_files; ++j) {
-                tsv << '\t' << elt->second[j];
-            }
-        }
-        // Otherwise, just output 0s.
-        else {
-            for (int j = 0; j < num_files; ++j) {
-                tsv << '\t' << 0;
-            }
-        }
-        tsv << endl;
-    }
-    
-    /* Write to file those classes that did not show up in kallisto */
-    
-    uint64_t index = order.size();
-    // Go through our matrix and see if any of our classes wasn't in kallisto's
-    // ec.
-    for (auto it = matrix->begin(); it != matrix->end(); ++it) {
-        auto elt = ecs.find(it->first);
-        // It wasn't in kallisto's file, so it's not currently in our output.
-        if (elt == ecs.end()) {
-            ec << index << '\t' << it->first << endl;
-            
-            tsv << index;
-            for (int j = 0; j < num_files; ++j) {
-                tsv << '\t' << it->second[j];
-            }
-            tsv << endl;
-            
-            ++index;
-        }
-    }
-    
-    ec.close();
-    tsv.close();
-    return 0;
+                                       int nThreads) {
+    /* Each equivalence class in vector order, with its counts if we have it,
+     * then those classes that did not show up in kallisto. */
+    vector<Row> rows;
+    vector<bool> listed;
+    get_order_rows(order, rows, listed);
+    get_unlisted_rows(listed, rows);
+    return write_rows(outname, rows, false, nThreads);
 }
 
 
 /**
  * Writes information in TCC_Matrix to files of names <outname>.ec and
  * <outname>.tsv in the order specified by vector <order>. Returns 1 if error
- * occurs in opening files, otherwise 0.
+ * occurs in opening files, otherwise 0. Unlike the other sparse output, the
+ * .tsv goes file by file.
  *
  * @param outname       Name of output files (without file extension).
  *
  * @param order         Vector of strings describing the order in which to
  * output equivalence classes.
  *
- * @param ecs           Set of the strings in order. Used to speed up runtime.
+ * @param nThreads      Number of threads formatting output.
  *
  * @return              1 if error occurs in opening files, otherwise 0.
  */
 int TCC_Matrix::write_to_file_in_order_sparse(string outname,
                                        const vector<string> &order,
-                                       const unordered_set<string> &ecs) {
+                                       int nThreads) {
     
     /* Open the file and die if something goes wrong */
     ofstream ec(outname + ".ec");
@@ -252,53 +703,392 @@ int TCC_Matrix::write_to_file_in_order_sparse(string outname,
         return 1;
     }
 
-    /* Output all kallisto TCCs to ec file. */
-    for (uint i = 0; i < order.size(); ++i) {
-        ec << i << '\t' << order[i] << endl;
-    }
-
-    /* Go through each equivalence class in vector order, use our map to locate
-     the TCC, and output it */
-    for (int i = 0; i < num_files; ++i) {
-        for (uint j = 0; j < order.size(); ++j) {
-            // Try to find equivalence class in TCC matrix.
-            auto elt = matrix->find(order[j]);
-            // Equivalence class found and the count is not zero.
-            if (elt != matrix->end() && elt->second[i] != 0) {
-                tsv << j << '\t' << i << '\t' << elt->second[i];
-                tsv << endl; 
-            }
+    /* Kallisto's classes first, then ours that weren't in kallisto's ec,
+     * numbered in order of the first file they show up in. */
+    vector<Row> rows, unlisted, extra;
+    vector<bool> listed;
+    vector<int> firstFile;
+    get_order_rows(order, rows, listed);
+    get_unlisted_rows(listed, unlisted);
+    for (auto it = unlisted.begin(); it != unlisted.end(); ++it) {
+        int first = num_files;
+        it->for_each(0, num_files, [&first](int j, int) {
+                    first = min(first, j);
+                });
+        if (first < num_files) {
+            extra.push_back(*it);
+            firstFile.push_back(first);
         }
     }
-    
-    /* Write to file those classes that did not show up in kallisto */
-    uint64_t index = order.size();
-    unordered_map<string, int> *output_index_map
-                                            = new unordered_map<string, int>;
-    // Go through our matrix and see if any of our classes weren't in kallisto's
-    // ec.
-    for (int i = 0; i < num_files; ++i) {
-        for (auto it = matrix->begin(); it != matrix->end(); ++it) {
-            auto elt = ecs.find(it->first);
-            // It wasn't in kallisto's file so it's not currently in our output.
-            if (elt == ecs.end() && it->second[i] != 0) {
-                auto output_index =
-                                    output_index_map->find(it->first);
-                // If this TCC hasn't already been seen once, add it to our map
-                // of TCC -> output index.
-                if (output_index == output_index_map->end()) {
-                    ec << index << '\t' << it->first << endl;
-                    output_index_map->emplace(it->first, index);
-                    ++index;
+    vector<size_t> rank(extra.size());
+    for (size_t i = 0; i < rank.size(); ++i) { rank[i] = i; }
+    stable_sort(rank.begin(), rank.end(), [&firstFile](size_t a, size_t b) {
+                return firstFile[a] < firstFile[b];
+            });
+    /* Rows of the .tsv in the order they're gone through for each file:
+     * ours in matrix order, as when they were numbered on the fly. */
+    vector<size_t> tsvRows(order.size() + extra.size());
+    for (size_t i = 0; i < order.size(); ++i) { tsvRows[i] = i; }
+    for (size_t i = 0; i < rank.size(); ++i) {
+        rows.push_back(extra[rank[i]]);
+        tsvRows[order.size() + rank[i]] = order.size() + i;
+    }
+
+    bool success = writeChunks(ec, rows.size(), WRITE_CHUNK_CELLS, nThreads,
+            [&rows](size_t begin, size_t end, string &out) {
+                for (size_t i = begin; i < end; ++i) {
+                    appendECRow(out, i, rows[i].ec, rows[i].id);
                 }
-                tsv << output_index_map->at(it->first) << '\t' << i << '\t';
-                tsv << it->second[i] << endl;
-            }
-        }
+            });
+    /* Kallisto's classes file by file, then ours file by file, each part
+     * sorted by file once. */
+    size_t split[] = {0, order.size(), rows.size()};
+    for (int part = 0; part < 2; ++part) {
+        vector<size_t> blocks = getBlocks(split[part], split[part + 1],
+                nThreads);
+        vector<vector<size_t>> fileCounts;
+        vector<pair<int, int>> entries;
+        vector<size_t> fileStarts;
+        size_t nnz = count_by_file(rows, tsvRows.data(), blocks, nThreads,
+                fileCounts);
+        sort_by_file(rows, tsvRows.data(), blocks, fileCounts, nThreads,
+                entries, fileStarts);
+        success = writeChunks(tsv, num_files,
+                (size_t)WRITE_CHUNK_CELLS * num_files / max(nnz, (size_t)1),
+                nThreads,
+                [&entries, &fileStarts](size_t begin, size_t end,
+                    string &out) {
+                    for (size_t j = begin; j < end; ++j) {
+                        for (size_t k = fileStarts[j]; k < fileStarts[j + 1];
+                                ++k) {
+                            appendInt(out, entries[k].first);
+                            out += '\t';
+                            appendInt(out, j);
+                            out += '\t';
+                            appendInt(out, entries[k].second);
+                            out += '\n';
+                        }
+                    }
+                }) && success;
     }
-   
-    delete output_index_map;
     ec.close(); 
     tsv.close();
-    return 0;
+    return success ? 0 : 1;
+}
+
+/**
+ * Writes rows to <outname>.ec and, as a MatrixMarket coordinate matrix of ECs
+ * by files, <outname>.mtx. The nonzero entries are counted first, so the size
+ * line is right, then formatted by up to nThreads threads. File by file, the
+ * entries are first sorted by file with a counting sort, in a single pass over
+ * the rows.
+ *
+ * @param column_major  whether entries go file by file rather than row by row.
+ * @return              1 if error occurs in opening or writing files,
+ *                      otherwise 0.
+ */
+int TCC_Matrix::write_mtx(const string &outname, const vector<Row> &rows,
+        bool column_major, int nThreads) {
+    ofstream ec(outname + ".ec");
+    ofstream mtx(outname + ".mtx");
+    if (!ec.is_open() || !mtx.is_open()) { return 1; }
+
+    int files = num_files;
+    bool success = writeChunks(ec, rows.size(), WRITE_CHUNK_CELLS, nThreads,
+            [&rows](size_t begin, size_t end, string &out) {
+                for (size_t i = begin; i < end; ++i) {
+                    appendECRow(out, i, rows[i].ec, rows[i].id);
+                }
+            });
+
+    /* Rows are gone through in a block per thread, each block counting its
+     * entries of each file. */
+    vector<size_t> blocks = getBlocks(0, rows.size(), nThreads);
+    vector<vector<size_t>> fileCounts;
+    size_t nnz = count_by_file(rows, nullptr, blocks, nThreads, fileCounts);
+    string header = "%%MatrixMarket matrix coordinate integer general\n";
+    appendInt(header, rows.size());
+    header += ' ';
+    appendInt(header, files);
+    header += ' ';
+    appendInt(header, nnz);
+    header += '\n';
+    mtx.write(header.data(), header.size());
+
+    /* Entries are 1-indexed. */
+    auto appendEntry = [](string &out, size_t i, int j, int c) {
+        appendInt(out, i + 1);
+        out += ' ';
+        appendInt(out, j + 1);
+        out += ' ';
+        appendInt(out, c);
+        out += '\n';
+    };
+    if (column_major) {
+        vector<pair<int, int>> entries;
+        vector<size_t> fileStarts;
+        sort_by_file(rows, nullptr, blocks, fileCounts, nThreads, entries,
+                fileStarts);
+        vector<vector<size_t>>().swap(fileCounts);
+
+        success = writeChunks(mtx, files,
+                (size_t)WRITE_CHUNK_CELLS * files / max(nnz, (size_t)1),
+                nThreads,
+                [&entries, &fileStarts, &appendEntry](size_t begin,
+                    size_t end, string &out) {
+                    for (size_t j = begin; j < end; ++j) {
+                        for (size_t k = fileStarts[j]; k < fileStarts[j + 1];
+                                ++k) {
+                            appendEntry(out, entries[k].first, j,
+                                    entries[k].second);
+                        }
+                    }
+                }) && success;
+    } else {
+        success = writeChunks(mtx, rows.size(),
+                WRITE_CHUNK_CELLS / max(files, 1), nThreads,
+                [&rows, &appendEntry, files](size_t begin, size_t end,
+                    string &out) {
+                    for (size_t i = begin; i < end; ++i) {
+                        rows[i].for_each(0, files,
+                                [&out, &appendEntry, i](int j, int c) {
+                                    appendEntry(out, i, j, c);
+                                });
+                    }
+                }) && success;
+    }
+    success = success && !mtx.fail();
+    ec.close();
+    mtx.close();
+    return success ? 0 : 1;
+}
+
+/**
+ * Writes information in TCC_Matrix to files of names <outname>.ec and
+ * <outname>.mtx, the rows as in write_to_file.
+ *
+ * @param outname       Name of output files (without file extension).
+ * @param column_major  Whether the entries of the .mtx go file by file.
+ * @param nThreads      Number of threads formatting output.
+ * @return              1 if error occurs in opening files, otherwise 0.
+ */
+int TCC_Matrix::write_to_file_mtx(string outname, int num_transcripts,
+        bool column_major, int nThreads) {
+    vector<Row> rows;
+    get_rows(rows, num_transcripts);
+    return write_mtx(outname, rows, column_major, nThreads);
+}
+
+/**
+ * Writes information in TCC_Matrix to files of names <outname>.ec and
+ * <outname>.mtx, the equivalence classes of order first, then any others.
+ *
+ * @param outname       Name of output files (without file extension).
+ * @param order         Vector of strings describing the order in which to
+ * output equivalence classes.
+ * @param column_major  Whether the entries of the .mtx go file by file.
+ * @param nThreads      Number of threads formatting output.
+ * @return              1 if error occurs in opening files, otherwise 0.
+ */
+int TCC_Matrix::write_to_file_in_order_mtx(string outname,
+                                           const vector<string> &order,
+                                           bool column_major, int nThreads) {
+    vector<Row> rows;
+    vector<bool> listed;
+    get_order_rows(order, rows, listed);
+    get_unlisted_rows(listed, rows);
+    return write_mtx(outname, rows, column_major, nThreads);
+}
+
+/**
+ * Appends the bytes of value to out, in host (little-endian) order.
+ */
+template<typename T>
+static void appendRaw(string &out, const T &value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * Appends n as a LEB128 varint: 7 bits per byte, low bits first.
+ */
+static void appendVarint(string &out, uint64_t n) {
+    while (n >= 0x80) {
+        out += (char)((n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    out += (char)n;
+}
+
+/**
+ * Appends an EC in the varint-delta form of TccBinary.hpp: its transcripts
+ * (ec, or id if ec is nullptr) in increasing order, the first zigzag-encoded
+ * and each other as its difference from the one before.
+ */
+static void appendECVarints(string &out, const string *ec, int id,
+        vector<int> &ids) {
+    ids.clear();
+    if (ec == nullptr) {
+        ids.push_back(id);
+    } else {
+        const char *p = ec->c_str();
+        while (*p != '\0') {
+            char *end;
+            long n = strtol(p, &end, 10);
+            if (end == p) { ++p; continue; }
+            ids.push_back((int)n);
+            p = end;
+        }
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (i == 0) {
+            appendVarint(out, ((uint64_t)(int64_t)ids[0] << 1)
+                    ^ (uint64_t)((int64_t)ids[0] >> 63));
+        } else {
+            appendVarint(out, (uint64_t)ids[i] - ids[i - 1]);
+        }
+    }
+}
+
+/**
+ * Writes rows to <outname>.tcc in the binary format of TccBinary.hpp. The
+ * nonzero counts of each row and file, and the encoded ECs, are gathered
+ * first, so that the header and index sections are known, then the entries
+ * are formatted by up to nThreads threads and written in one pass.
+ *
+ * @return           1 if error occurs in opening or writing the file,
+ *                   otherwise 0.
+ */
+int TCC_Matrix::write_binary(const string &outname, const vector<Row> &rows,
+        int nThreads) {
+    ofstream out(outname + ".tcc", ios::binary);
+    if (!out.is_open()) { return 1; }
+
+    /* Nonzero counts of each row and file, and each row's encoded EC. */
+    int files = num_files;
+    vector<uint64_t> rowPtr(rows.size() + 1, 0), colPtr(files + 1, 0),
+        ecIndex(rows.size() + 1, 0);
+    vector<size_t> blocks = getBlocks(0, rows.size(), nThreads);
+    size_t num_blocks = blocks.size() - 1;
+    /* Nonzero counts of each block and file, for sort_by_file. */
+    vector<vector<size_t>> colNnz(num_blocks, vector<size_t>(files, 0));
+    vector<string> ecData(num_blocks);
+    vector<future<void>> scans;
+    for (size_t b = 0; b < num_blocks; ++b) {
+        size_t begin = blocks[b], end = blocks[b + 1];
+        string *ecs = &ecData[b];
+        size_t *counts = colNnz[b].data();
+        scans.push_back(async(nThreads > 1 ? launch::async
+                    : launch::deferred, [&rows, &rowPtr, &ecIndex, ecs,
+                    counts, files, begin, end]() {
+                    vector<int> ids;
+                    for (size_t i = begin; i < end; ++i) {
+                        rows[i].for_each(0, files,
+                                [&rowPtr, counts, i](int j, int) {
+                                    ++rowPtr[i + 1];
+                                    ++counts[j];
+                                });
+                        size_t before = ecs->size();
+                        appendECVarints(*ecs, rows[i].ec, rows[i].id, ids);
+                        ecIndex[i + 1] = ecs->size() - before;
+                    }
+                }));
+    }
+    for (auto it = scans.begin(); it != scans.end(); ++it) { it->get(); }
+    for (size_t b = 0; b < num_blocks; ++b) {
+        for (int j = 0; j < files; ++j) { colPtr[j + 1] += colNnz[b][j]; }
+    }
+    for (size_t i = 0; i < rows.size(); ++i) {
+        rowPtr[i + 1] += rowPtr[i];
+        ecIndex[i + 1] += ecIndex[i];
+    }
+    for (int j = 0; j < files; ++j) { colPtr[j + 1] += colPtr[j]; }
+
+    TccHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TCC_BINARY_MAGIC, 4);
+    header.version = TCC_BINARY_VERSION;
+    header.num_rows = rows.size();
+    header.num_files = files;
+    header.nnz = rowPtr.back();
+    header.row_ptr = sizeof(TccHeader);
+    header.row_entries = header.row_ptr + rowPtr.size() * sizeof(uint64_t);
+    header.col_ptr = header.row_entries + header.nnz * sizeof(TccEntry);
+    header.col_entries = header.col_ptr + colPtr.size() * sizeof(uint64_t);
+    header.ec_index = header.col_entries + header.nnz * sizeof(TccEntry);
+    header.ec_data = header.ec_index + ecIndex.size() * sizeof(uint64_t);
+    header.ec_data_size = ecIndex.back();
+
+    auto writeVector = [&out](const vector<uint64_t> &v) {
+        out.write(reinterpret_cast<const char*>(v.data()),
+                v.size() * sizeof(uint64_t));
+    };
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writeVector(rowPtr);
+    bool success = writeChunks(out, rows.size(),
+            WRITE_CHUNK_CELLS / max(files, 1), nThreads,
+            [&rows, files](size_t begin, size_t end, string &chunk) {
+                for (size_t i = begin; i < end; ++i) {
+                    rows[i].for_each(0, files, [&chunk](int j, int c) {
+                                appendRaw(chunk, TccEntry{(uint32_t)j, c});
+                            });
+                }
+            });
+    writeVector(colPtr);
+    /* The column entries, from the entries sorted by file once. */
+    vector<pair<int, int>> entries;
+    vector<size_t> fileStarts;
+    sort_by_file(rows, nullptr, blocks, colNnz, nThreads, entries,
+            fileStarts);
+    vector<vector<size_t>>().swap(colNnz);
+    success = writeChunks(out, entries.size(), WRITE_CHUNK_CELLS, nThreads,
+            [&entries](size_t begin, size_t end, string &chunk) {
+                for (size_t k = begin; k < end; ++k) {
+                    appendRaw(chunk, TccEntry{(uint32_t)entries[k].first,
+                                entries[k].second});
+                }
+            }) && success;
+    writeVector(ecIndex);
+    for (auto it = ecData.begin(); it != ecData.end(); ++it) {
+        out.write(it->data(), it->size());
+    }
+    success = success && !out.fail();
+    out.close();
+    return success ? 0 : 1;
+}
+
+/**
+ * Writes information in TCC_Matrix to <outname>.tcc in binary form (see
+ * TccBinary.hpp), the rows as in write_to_file.
+ *
+ * @param outname    Name of output file (without file extension).
+ * @param nThreads   Number of threads formatting output.
+ * @return           1 if error occurs in opening files, otherwise 0.
+ */
+int TCC_Matrix::write_to_file_binary(string outname, int num_transcripts,
+        int nThreads) {
+    vector<Row> rows;
+    get_rows(rows, num_transcripts);
+    return write_binary(outname, rows, nThreads);
+}
+
+/**
+ * Writes information in TCC_Matrix to <outname>.tcc in binary form (see
+ * TccBinary.hpp), the equivalence classes of order first, then any others.
+ *
+ * @param outname       Name of output file (without file extension).
+ * @param order         Vector of strings describing the order in which to
+ * output equivalence classes.
+ * @param nThreads      Number of threads formatting output.
+ * @return              1 if error occurs in opening files, otherwise 0.
+ */
+int TCC_Matrix::write_to_file_in_order_binary(string outname,
+                                              const vector<string> &order,
+                                              int nThreads) {
+    vector<Row> rows;
+    vector<bool> listed;
+    get_order_rows(order, rows, listed);
+    get_unlisted_rows(listed, rows);
+    return write_binary(outname, rows, nThreads);
 }
@@ -1,8 +1,10 @@
 #ifndef __TCC_MATRIX_HPP__
 #define __TCC_MATRIX_HPP__
 
+#include <atomic>
+#include <string>
 #include <unordered_map>
-#include <unordered_set>
+#include <utility>
 #include <vector>
 #include "Semaphore.hpp"
 
@@ -14,23 +16,100 @@ class TCC_Matrix {
 private:
     /* Number of SAM files data int this matrix represents */
     int num_files;
-    /* Matrix holding data. Each int* is an array of size num_files */
-    std::unordered_map<std::string, int*> *matrix;
+    /* Whether columns are added by add_file, rather than fixed. */
+    bool growable;
+    /* Index in counts of each equivalence class. */
+    std::unordered_map<std::string, int> *matrix;
+    /* Counts of an equivalence class: the nonzero ones as (file, count)
+     * sorted by file, until enough files have some that an array of num_files
+     * counts is smaller. */
+    struct Cells {
+        int *full;
+        std::vector<std::pair<int, int>> nonzero;
+    };
+    /* Matrix holding data, one Cells per equivalence class. */
+    std::vector<Cells> counts;
+    /* Number of transcripts whose singleton ECs are counted in dense. */
+    int num_singletons;
+    /* Counts of the singleton ECs 0 .. num_singletons - 1, num_files per
+     * transcript. Updated without taking sem. */
+    std::atomic<int> *dense;
+    /* Instead of dense if growable, whose columns aren't known up front: the
+     * counts of each singleton EC, guarded by singleton_sems[id %
+     * SINGLETON_SEMS] rather than sem. */
+    Cells *singleton_cells;
+    Semaphore *singleton_sems;
     /* Semaphore to control access to this matrix. */
     Semaphore *sem;
+    /* A row of output: its EC (nullptr if it is the singleton id) and its
+     * counts, either num_files of them or only the nonzero ones (both nullptr
+     * if all zero). */
+    struct Row {
+        const std::string *ec;
+        int id;
+        const int *counts;
+        const std::vector<std::pair<int, int>> *nonzero;
+        template<typename F> void for_each(int begin, int end, F f) const;
+    };
+    static std::string formatEC(const std::vector<int> &EC);
+    int index_of(const std::string &TCC);
+    int &cell(Cells &cells, int file_num);
+    Row cells_row(const std::string *ec, const Cells &cells);
+    int singleton(const std::string &TCC);
+    void add_singleton(int id, int file_num, int count);
+    const int *dense_row(int id);
+    Row singleton_row(const std::string *ec, int id);
+    bool is_singleton_nonzero(int id);
+    void get_rows(std::vector<Row> &rows, int num_transcripts);
+    void get_order_rows(const std::vector<std::string> &order,
+                        std::vector<Row> &rows, std::vector<bool> &listed);
+    void get_unlisted_rows(const std::vector<bool> &listed,
+                           std::vector<Row> &rows);
+    size_t count_by_file(const std::vector<Row> &rows, const size_t *visit,
+                         const std::vector<size_t> &blocks, int nThreads,
+                         std::vector<std::vector<size_t>> &fileCounts);
+    void sort_by_file(const std::vector<Row> &rows, const size_t *visit,
+                      const std::vector<size_t> &blocks,
+                      std::vector<std::vector<size_t>> &fileCounts,
+                      int nThreads, std::vector<std::pair<int, int>> &entries,
+                      std::vector<size_t> &fileStarts);
+    int write_rows(const std::string &outname, const std::vector<Row> &rows,
+                   bool sparse, int nThreads);
+    int write_mtx(const std::string &outname, const std::vector<Row> &rows,
+                  bool column_major, int nThreads);
+    int write_binary(const std::string &outname, const std::vector<Row> &rows,
+                     int nThreads);
 public:
-    TCC_Matrix(int num_files);
+    TCC_Matrix(int num_files, int num_transcripts=0);
     ~TCC_Matrix();
-    void inc_TCC(std::string TCC, int file_num);
+    int inc_TCC(const std::vector<int> &EC, int file_num);
+    int inc_TCC(std::string TCC, int file_num);
+    int add_TCC(const std::vector<int> &EC);
+    void add_count(int ec_id, int file_num, int count);
     void dec_TCC(std::string TCC, int file_num);
-    int write_to_file(std::string outname, int num_transcripts=0);
-    int write_to_file_sparse(std::string outname, int num_transcripts=0);
+    int add_file();
+    int get_num_singletons();
+    int get_num_ECs();
+    int write_to_file(std::string outname, int num_transcripts=0,
+                      int nThreads=1);
+    int write_to_file_sparse(std::string outname, int num_transcripts=0,
+                             int nThreads=1);
     int write_to_file_in_order(std::string outname,
                                const std::vector<std::string> &order,
-                               const std::unordered_set<std::string> &ecs);
+                               int nThreads=1);
     int write_to_file_in_order_sparse(std::string outname,
                                const std::vector<std::string> &order,
-                               const std::unordered_set<std::string> &ecs);
+                               int nThreads=1);
+    int write_to_file_mtx(std::string outname, int num_transcripts=0,
+                          bool column_major=false, int nThreads=1);
+    int write_to_file_in_order_mtx(std::string outname,
+                                   const std::vector<std::string> &order,
+                                   bool column_major=false, int nThreads=1);
+    int write_to_file_binary(std::string outname, int num_transcripts=0,
+                             int nThreads=1);
+    int write_to_file_in_order_binary(std::string outname,
+                                      const std::vector<std::string> &order,
+                                      int nThreads=1);
 };
 
 #endif
@@ -0,0 +1,199 @@
+#ifndef __TCC_BINARY_HPP__
+#define __TCC_BINARY_HPP__
+
+/**
+ * The binary TCC format written by TCC_Matrix::write_to_file_binary, and a
+ * reader for it that needs nothing but this header. All numbers are
+ * little-endian; the file is a TccHeader followed by the sections it points
+ * to, each 8-byte aligned:
+ *
+ *   row_ptr      num_rows + 1 uint64: row r's entries are row_entries
+ *                [row_ptr[r], row_ptr[r + 1]).
+ *   row_entries  nnz TccEntry, (file, count) by row, then by file (CSR).
+ *   col_ptr      num_files + 1 uint64, likewise for col_entries.
+ *   col_entries  nnz TccEntry, (row, count) by file, then by row (CSC).
+ *   ec_index     num_rows + 1 uint64: row r's EC is ec_data
+ *                [ec_index[r], ec_index[r + 1]).
+ *   ec_data      each EC's transcript IDs in increasing order as varints
+ *                (LEB128): the first zigzag-encoded, as it may be -1, then the
+ *                difference from the previous one.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TCC_BINARY_MAGIC "TCCB"
+#define TCC_BINARY_VERSION 1
+
+struct TccHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t num_rows;
+    uint32_t num_files;
+    uint32_t reserved;
+    uint64_t nnz;
+    uint64_t row_ptr;
+    uint64_t row_entries;
+    uint64_t col_ptr;
+    uint64_t col_entries;
+    uint64_t ec_index;
+    uint64_t ec_data;
+    uint64_t ec_data_size;
+};
+
+/* A nonzero count and its file (in a row) or row (in a column). */
+struct TccEntry {
+    uint32_t index;
+    int32_t count;
+};
+
+/* The entries of one row or column, pointing into the mapped file. */
+struct TccSlice {
+    const TccEntry *entries;
+    size_t size;
+};
+
+/**
+ * Read-only view of a binary TCC file, mapped into memory. Rows and columns
+ * are read in place; only ECs are decoded.
+ */
+class TccReader {
+private:
+    const char *data;
+    size_t size;
+    const TccHeader *header;
+
+    template<typename T> const T *at(uint64_t offset) const {
+        return reinterpret_cast<const T*>(data + offset);
+    }
+    /* Whether count Ts from offset lie within the file. */
+    bool fits(uint64_t offset, uint64_t count, size_t width) const {
+        return offset % 8 == 0 && offset <= size
+            && count <= (size - offset) / width;
+    }
+    /* Whether the count offsets from offset start at 0, never decrease and
+     * end at last. */
+    bool monotonic(uint64_t offset, uint64_t count, uint64_t last) const {
+        const uint64_t *ptr = at<uint64_t>(offset);
+        if (ptr[0] != 0 || ptr[count - 1] != last) { return false; }
+        for (uint64_t i = 1; i < count; ++i) {
+            if (ptr[i] < ptr[i - 1]) { return false; }
+        }
+        return true;
+    }
+    /* Whether the header's sections lie within the file, and their offsets
+     * within their sections, so that no lookup reads outside the file. */
+    bool check() const {
+        const TccHeader &h = *header;
+        if (memcmp(h.magic, TCC_BINARY_MAGIC, 4) != 0
+                || h.version != TCC_BINARY_VERSION
+                || !fits(h.row_ptr, h.num_rows + 1, 8)
+                || !fits(h.row_entries, h.nnz, sizeof(TccEntry))
+                || !fits(h.col_ptr, (uint64_t)h.num_files + 1, 8)
+                || !fits(h.col_entries, h.nnz, sizeof(TccEntry))
+                || !fits(h.ec_index, h.num_rows + 1, 8)
+                || !fits(h.ec_data, h.ec_data_size, 1)) {
+            return false;
+        }
+        return monotonic(h.row_ptr, h.num_rows + 1, h.nnz)
+            && monotonic(h.col_ptr, (uint64_t)h.num_files + 1, h.nnz)
+            && monotonic(h.ec_index, h.num_rows + 1, h.ec_data_size);
+    }
+
+public:
+    TccReader() : data(nullptr), size(0), header(nullptr) {}
+    ~TccReader() { close(); }
+    TccReader(const TccReader&) = delete;
+    TccReader &operator=(const TccReader&) = delete;
+
+    /**
+     * Maps filename. Returns false if it can't be read or is not a binary TCC
+     * file of this version.
+     */
+    bool open(const std::string &filename) {
+        close();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd == -1) { return false; }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(TccHeader)) {
+            ::close(fd);
+            return false;
+        }
+        void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) { return false; }
+        data = static_cast<const char*>(map);
+        size = info.st_size;
+        header = at<TccHeader>(0);
+        if (!check()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (data != nullptr) { munmap(const_cast<char*>(data), size); }
+        data = nullptr;
+        size = 0;
+        header = nullptr;
+    }
+
+    uint64_t rowCount() const { return header->num_rows; }
+    uint32_t fileCount() const { return header->num_files; }
+    uint64_t nnz() const { return header->nnz; }
+
+    /**
+     * The nonzero counts of row r (an EC), by file. Empty if there is no row
+     * r.
+     */
+    TccSlice row(uint64_t r) const {
+        if (r >= header->num_rows) { return TccSlice{nullptr, 0}; }
+        const uint64_t *ptr = at<uint64_t>(header->row_ptr);
+        return TccSlice{at<TccEntry>(header->row_entries) + ptr[r],
+            ptr[r + 1] - ptr[r]};
+    }
+
+    /**
+     * The nonzero counts of input file f, by row. Empty if there is no file f.
+     */
+    TccSlice column(uint32_t f) const {
+        if (f >= header->num_files) { return TccSlice{nullptr, 0}; }
+        const uint64_t *ptr = at<uint64_t>(header->col_ptr);
+        return TccSlice{at<TccEntry>(header->col_entries) + ptr[f],
+            ptr[f + 1] - ptr[f]};
+    }
+
+    /**
+     * Decodes the EC of row r into ids, in increasing order. Returns false,
+     * with ids empty, if there is no row r.
+     */
+    bool getEC(uint64_t r, std::vector<int> &ids) const {
+        ids.clear();
+        if (r >= header->num_rows) { return false; }
+        const uint64_t *index = at<uint64_t>(header->ec_index);
+        const unsigned char *p = at<unsigned char>(header->ec_data + index[r]);
+        const unsigned char *end = at<unsigned char>(header->ec_data
+                + index[r + 1]);
+        int64_t id = 0;
+        while (p < end) {
+            uint64_t v = 0;
+            for (int shift = 0; p < end && shift < 64; shift += 7) {
+                v |= (uint64_t)(*p & 0x7f) << shift;
+                if ((*p++ & 0x80) == 0) { break; }
+            }
+            if (ids.empty()) { id = (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+            else { id += v; }
+            ids.push_back((int)id);
+        }
+        return true;
+    }
+};
+
+#endif
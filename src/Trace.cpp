@@ -0,0 +1,151 @@
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include "Trace.hpp"
+#include "common.hpp"
+using namespace std;
+
+atomic<Trace*> Trace::active(nullptr);
+
+/* The calling thread's buffer, and the trace it belongs to. */
+static thread_local void *localBuffer = nullptr;
+static thread_local const Trace *localTrace = nullptr;
+
+Trace::Trace() : origin(now()) {}
+
+Trace::~Trace() {
+    if (get() == this) { setActive(nullptr); }
+    for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+        delete *it;
+    }
+}
+
+/**
+ * Makes trace (or nothing, if nullptr) the trace that events are recorded to.
+ * Must not be called while other threads record.
+ */
+void Trace::setActive(Trace *trace) {
+    active.store(trace);
+}
+
+/* Nanoseconds on a monotonic clock. */
+uint64_t Trace::now() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Trace::Buffer *Trace::getBuffer() {
+    if (localTrace == this) { return static_cast<Buffer*>(localBuffer); }
+    Buffer *buffer = new Buffer{0, vector<Event>(), 0, 0};
+    sem.dec();
+    buffer->tid = buffers.size() + 1;
+    buffers.push_back(buffer);
+    sem.inc();
+    localBuffer = buffer;
+    localTrace = this;
+    return buffer;
+}
+
+/**
+ * Records an event of the calling thread from start (see now) until now.
+ */
+void Trace::add(const char *name, const char *category, uint64_t start,
+        int file, const string *detail) {
+    Buffer *buffer = getBuffer();
+    Event event{name, category, file, detail != nullptr ? *detail : string(),
+        start, now() - start};
+    if (buffer->events.size() < TRACE_BUFFER_SIZE) {
+        buffer->events.push_back(move(event));
+        return;
+    }
+    buffer->events[buffer->next] = move(event);
+    buffer->next = (buffer->next + 1) % TRACE_BUFFER_SIZE;
+    ++buffer->overwritten;
+}
+
+/**
+ * Start of something that may block, to pass to endWait; 0 if not tracing.
+ */
+uint64_t Trace::beginWait() {
+    return get() != nullptr ? now() : 0;
+}
+
+/**
+ * Records a wait begun at start, if it took long enough to matter.
+ */
+void Trace::endWait(const char *name, uint64_t start) {
+    Trace *trace = get();
+    if (start == 0 || trace == nullptr
+            || now() - start < TRACE_MIN_WAIT_NS) {
+        return;
+    }
+    trace->add(name, "wait", start);
+}
+
+/**
+ * Takes sem (see Semaphore::dec), recording the wait under name.
+ */
+void Trace::lock(Semaphore &sem, const char *name) {
+    uint64_t start = beginWait();
+    sem.dec();
+    endWait(name, start);
+}
+
+/**
+ * Writes all events as Chrome trace-event JSON, times in microseconds since
+ * the trace was created. Call once no thread records any more.
+ *
+ * @param files     names of the input files, for the events' file numbers.
+ */
+bool Trace::write(const string &filename, const vector<string> &files) {
+    ofstream out(filename);
+    if (!out.is_open()) { return false; }
+    out << fixed << setprecision(3) << "{\"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+        << "\"args\": {\"name\": \"bam2tcc\"}}";
+    for (auto b = buffers.begin(); b != buffers.end(); ++b) {
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            << "\"tid\": " << (*b)->tid << ", \"args\": {\"name\": \""
+            << ((*b)->tid == 1 ? "main" : "thread " + to_string((*b)->tid))
+            << "\", \"overwritten\": " << (*b)->overwritten << "}}";
+        for (auto e = (*b)->events.begin(); e != (*b)->events.end(); ++e) {
+            out << ",\n{\"name\": \"" << e->name << "\", \"cat\": \""
+                << e->category << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                << (*b)->tid << ", \"ts\": "
+                << (e->start - min(e->start, origin)) / 1000.0
+                << ", \"dur\": " << e->duration / 1000.0;
+            if (e->file != -1 || e->detail.size() != 0) {
+                out << ", \"args\": {";
+                if (e->file != -1) {
+                    out << "\"file\": ";
+                    writeString(out, e->file < (int)files.size()
+                            ? files[e->file] : to_string(e->file));
+                    if (e->detail.size() != 0) { out << ", "; }
+                }
+                if (e->detail.size() != 0) {
+                    out << "\"detail\": ";
+                    writeString(out, e->detail);
+                }
+                out << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    return !out.fail();
+}
+
+TraceSpan::TraceSpan(const char *name, const char *category, int file,
+        const string *detail) : trace(Trace::get()), name(name),
+        category(category), file(file), start(0) {
+    if (trace == nullptr) { return; }
+    if (detail != nullptr) { this->detail = *detail; }
+    start = Trace::now();
+}
+
+TraceSpan::~TraceSpan() {
+    if (trace != nullptr) {
+        trace->add(name, category, start, file, &detail);
+    }
+}
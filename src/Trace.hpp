@@ -0,0 +1,77 @@
+#ifndef __TRACE_HPP__
+#define __TRACE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Semaphore.hpp"
+
+/* Events kept per thread; once full, the oldest are overwritten. */
+#define TRACE_BUFFER_SIZE (1 << 16)
+/* Waits (locks, queues) shorter than this (ns) are not recorded. */
+#define TRACE_MIN_WAIT_NS 10000
+
+/**
+ * Timeline of what each thread does, for --trace, written in the Chrome
+ * trace-event format that chrome://tracing and Perfetto load. Events go to a
+ * ring buffer of the recording thread, so threads only share a lock the first
+ * time they record. Recording is a no-op unless a Trace is active.
+ */
+class Trace {
+private:
+    struct Event {
+        const char *name, *category;
+        /* Input file (-1 if none) and further detail, e.g. a chromosome. */
+        int file;
+        std::string detail;
+        uint64_t start, duration;
+    };
+    struct Buffer {
+        int tid;
+        std::vector<Event> events;
+        size_t next;
+        uint64_t overwritten;
+    };
+    static std::atomic<Trace*> active;
+    std::vector<Buffer*> buffers;
+    Semaphore sem;
+    uint64_t origin;
+    Buffer *getBuffer();
+public:
+    Trace();
+    ~Trace();
+    Trace(const Trace&) = delete;
+    Trace &operator=(const Trace&) = delete;
+    static Trace *get() { return active.load(std::memory_order_relaxed); }
+    static void setActive(Trace *trace);
+    static uint64_t now();
+    void add(const char *name, const char *category, uint64_t start,
+            int file=-1, const std::string *detail=nullptr);
+    static uint64_t beginWait();
+    static void endWait(const char *name, uint64_t start);
+    static void lock(Semaphore &sem, const char *name);
+    bool write(const std::string &filename,
+            const std::vector<std::string> &files);
+};
+
+/**
+ * Records a span of the active trace, if any, from construction to
+ * destruction: a task, e.g. mapping a chromosome of a file.
+ */
+class TraceSpan {
+private:
+    Trace *trace;
+    const char *name, *category;
+    int file;
+    std::string detail;
+    uint64_t start;
+public:
+    TraceSpan(const char *name, const char *category, int file=-1,
+            const std::string *detail=nullptr);
+    ~TraceSpan();
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan &operator=(const TraceSpan&) = delete;
+};
+
+#endif
@@ -1,15 +1,17 @@
 #include "Transcript.hpp"
 using namespace std;
 
-Transcript::Transcript() {}
+Transcript::Transcript() : id(-1), start(0), end(0) {}
 
 Transcript::Transcript(int id, const seqan::GffRecord &entry) : id(id),
         start(entry.beginPos),
         end(entry.endPos) {};
 
-int Transcript::getID() { return id; }
+int Transcript::getID() const { return id; }
 
-int Transcript::getEnd() { return end; }
+int Transcript::getStart() const { return start; }
+
+int Transcript::getEnd() const { return end; }
 
 void Transcript::addExonEntry(const seqan::GffRecord &entry) {
     if (entry.strand == '+') {
@@ -20,7 +22,7 @@ void Transcript::addExonEntry(const seqan::GffRecord &entry) {
 }
 
 bool Transcript::mapsToTranscript(const vector<Exon> &alignmentExons,
-        bool genomebam) {
+        bool genomebam) const {
     if (alignmentExons.begin()->start < start
             || alignmentExons[alignmentExons.size() - 1].end > end
             || alignmentExons.size() > exons.size()) {
@@ -11,11 +11,12 @@ private:
 public:
     Transcript();
     Transcript(int id, const seqan::GffRecord &entry);
-    int getID();
-    int getEnd();
+    int getID() const;
+    int getStart() const;
+    int getEnd() const;
     void addExonEntry(const seqan::GffRecord &entry);
     bool mapsToTranscript(const std::vector<Exon> &alignmentExons,
-            bool genomebam);
+            bool genomebam) const;
     bool operator<(const Transcript &other) const;
 };
 
@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "BusWriter.hpp"
+#include "Whitelist.hpp"
+using namespace std;
+
+Whitelist::Whitelist() : length(0) {}
+
+/**
+ * Reads one barcode per line; anything from a `-` on (as in 10x's
+ * barcodes.tsv, e.g. AAACCCAAGAAACACT-1) is ignored. All barcodes must be of
+ * the length of the first, at most 32 bases of ACGT; other lines are skipped
+ * with a warning.
+ *
+ * @return      false if the file can't be read or lists no barcodes.
+ */
+bool Whitelist::load(const string &filename) {
+    ifstream in(filename);
+    if (!in.is_open()) { return false; }
+    string line;
+    int skipped = 0;
+    while (getline(in, line)) {
+        line = line.substr(0, line.find_first_of("-\t\r"));
+        if (line.size() == 0) { continue; }
+        if (length == 0) { length = line.size(); }
+        uint64_t code;
+        if (line.size() != length || !BusWriter::encode(line, code)) {
+            ++skipped;
+            continue;
+        }
+        codes.push_back(code);
+    }
+    if (skipped != 0) {
+        cerr << "  WARNING: skipped " << skipped << " barcodes of "
+            << filename << " that are not " << length << " bases of ACGT"
+            << endl;
+    }
+    sort(codes.begin(), codes.end());
+    codes.erase(unique(codes.begin(), codes.end()), codes.end());
+    return codes.size() != 0;
+}
+
+bool Whitelist::contains(uint64_t code) const {
+    return binary_search(codes.begin(), codes.end(), code);
+}
+
+/**
+ * Counts the listed barcodes that differ from code only at position (0 for
+ * the first base), the last of them in match.
+ */
+int Whitelist::findNeighbor(uint64_t code, int position, uint64_t &match)
+    const {
+    int shift = 2 * (length - 1 - position), found = 0;
+    uint64_t base = (code >> shift) & 3;
+    for (uint64_t other = 0; other < 4; ++other) {
+        if (other == base) { continue; }
+        uint64_t neighbor = (code & ~(3ULL << shift)) | (other << shift);
+        if (contains(neighbor)) {
+            match = neighbor;
+            ++found;
+        }
+    }
+    return found;
+}
+
+/**
+ * Whether barcode is listed, after correcting it if need be: a barcode with
+ * one base other than ACGT (e.g. N), or one that is not listed, is replaced
+ * by the one listed barcode differing from it by a single substitution, if
+ * there is exactly one. As in load, anything from a `-` on (CellRanger's CB
+ * tags end in -1) is ignored, and kept on the corrected barcode.
+ */
+bool Whitelist::correct(string &barcode) const {
+    size_t end = min(barcode.find_first_of("-\t\r"), barcode.size());
+    if (end != length) { return false; }
+    int unknown = -1;
+    string seq = barcode.substr(0, end);
+    for (size_t i = 0; i < seq.size(); ++i) {
+        if (seq[i] != '\0' && strchr(BusWriter::BASES, seq[i]) != nullptr) {
+            continue;
+        }
+        if (unknown != -1) { return false; }
+        unknown = i;
+        seq[i] = 'A';
+    }
+    uint64_t code, match = 0;
+    BusWriter::encode(seq, code);
+    int found = 0;
+    if (unknown != -1) {
+        found = contains(code) + findNeighbor(code, unknown, match);
+        if (contains(code)) { match = code; }
+    } else if (contains(code)) {
+        return true;
+    } else {
+        for (size_t i = 0; i < length && found < 2; ++i) {
+            found += findNeighbor(code, i, match);
+        }
+    }
+    if (found != 1) { return false; }
+    barcode.replace(0, length, BusWriter::decode(match, length));
+    return true;
+}
+
+size_t Whitelist::size() const {
+    return codes.size();
+}
@@ -0,0 +1,27 @@
+#ifndef __WHITELIST_HPP__
+#define __WHITELIST_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A list of the cell barcodes that may occur, e.g. 10x's, held as a sorted
+ * array of 2-bit packed barcodes (8 bytes each, however many millions there
+ * are). Observed barcodes are looked up by binary search and corrected if
+ * exactly one listed barcode is a single substitution away.
+ */
+class Whitelist {
+private:
+    std::vector<uint64_t> codes;
+    size_t length;
+    bool contains(uint64_t code) const;
+    int findNeighbor(uint64_t code, int position, uint64_t &match) const;
+public:
+    Whitelist();
+    bool load(const std::string &filename);
+    bool correct(std::string &barcode) const;
+    size_t size() const;
+};
+
+#endif
@@ -0,0 +1,452 @@
+/**
+ * Microbenchmarks of the kernels that mapping and counting spend their time
+ * in, run on generated inputs (fixed seed, so runs are comparable):
+ *
+ *   bam2tcc_bench [-n <ops>] [-p <threads>] [filter]
+ *
+ * Prints nanoseconds and heap allocations per operation of each benchmark
+ * whose name contains filter. -n scales the number of operations (default
+ * 1000000), -p is the most threads inc_TCC is run with (default: all cores).
+ * The binary TCC output is also read back and checked against the counts it
+ * was written from; the exit status is 1 if it doesn't match.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <getopt.h>
+#include <seqan/bam_io.h>
+#include <seqan/gff_io.h>
+#include "Exon.hpp"
+#include "Mapper.hpp"
+#include "Read.hpp"
+#include "TCC_Matrix.hpp"
+#include "TccBinary.hpp"
+#include "Transcript.hpp"
+#include "common.hpp"
+using namespace std;
+
+/* Transcripts, and alignments generated from them, per benchmark. */
+#define BENCH_TRANSCRIPTS 2000
+#define BENCH_ALIGNMENTS 20000
+#define BENCH_READ_LENGTH 100
+
+/* Heap allocations so far, by all threads. The operators are kept out of
+ * line so that the compiler doesn't pair an inlined malloc with delete. */
+static atomic<uint64_t> allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) { throw bad_alloc(); }
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+/* Results are added here so that the compiler keeps the work. */
+static volatile long sink;
+
+static string filter;
+
+/**
+ * Runs f, which performs ops operations, and prints its time and allocations
+ * per operation, unless name doesn't match the filter.
+ */
+template<typename F> void bench(const string &name, long ops, F f) {
+    if (name.find(filter) == string::npos) { return; }
+    uint64_t allocs = allocations.load();
+    auto start = chrono::steady_clock::now();
+    f();
+    double ns = chrono::duration<double, nano>(
+            chrono::steady_clock::now() - start).count();
+    allocs = allocations.load() - allocs;
+    cout << left << setw(40) << name << right << fixed
+        << setw(12) << setprecision(1) << ns / ops << " ns/op"
+        << setw(10) << setprecision(2) << (double)allocs / ops
+        << " allocs/op" << endl;
+}
+
+/**
+ * Transcripts of 1 to 15 exons of 50 to 300 bases, separated by introns of
+ * 100 to 5000 bases, tiled along one chromosome so that neighbours overlap.
+ */
+static void makeTranscripts(mt19937 &rng, vector<Transcript> &transcripts) {
+    uniform_int_distribution<int> exonCount(1, 15), exonLength(50, 300),
+        intronLength(100, 5000), gap(0, 3000);
+    int pos = 0;
+    seqan::GffRecord rec;
+    rec.strand = '+';
+    for (int id = 0; id < BENCH_TRANSCRIPTS; ++id) {
+        pos += gap(rng);
+        vector<Exon> exons;
+        int end = pos, count = exonCount(rng);
+        for (int i = 0; i < count; ++i) {
+            if (i != 0) { end += intronLength(rng); }
+            exons.push_back(Exon(end, end + exonLength(rng)));
+            end = exons.back().end;
+        }
+        rec.beginPos = pos;
+        rec.endPos = end;
+        Transcript transcript(id, rec);
+        for (auto exon = exons.begin(); exon != exons.end(); ++exon) {
+            rec.beginPos = exon->start;
+            rec.endPos = exon->end;
+            transcript.addExonEntry(rec);
+        }
+        transcripts.push_back(transcript);
+    }
+}
+
+/**
+ * An alignment of a read of BENCH_READ_LENGTH bases: unspliced, or (a third
+ * of them) with an N of intron length, sometimes soft-clipped.
+ */
+static void makeAlignment(mt19937 &rng, seqan::BamAlignmentRecord &rec) {
+    uniform_int_distribution<int> pos(0, 10000000), split(10, 90),
+        intron(100, 5000), kind(0, 5);
+    seqan::clear(rec.cigar);
+    rec.beginPos = pos(rng);
+    int k = kind(rng);
+    if (k >= 2) {
+        seqan::appendValue(rec.cigar,
+                seqan::CigarElement<>('M', BENCH_READ_LENGTH));
+        return;
+    }
+    int left = split(rng);
+    if (k == 1) { seqan::appendValue(rec.cigar, seqan::CigarElement<>('S', 5)); }
+    seqan::appendValue(rec.cigar, seqan::CigarElement<>('M', left));
+    seqan::appendValue(rec.cigar, seqan::CigarElement<>('N', intron(rng)));
+    seqan::appendValue(rec.cigar,
+            seqan::CigarElement<>('M', BENCH_READ_LENGTH - left));
+}
+
+/* Alignment exons of a read lying within a transcript's exons. */
+static vector<Exon> exonsWithin(mt19937 &rng, const Transcript &transcript) {
+    uniform_int_distribution<int> offset(0, 5000);
+    int begin = transcript.getStart() + offset(rng);
+    int end = min(begin + BENCH_READ_LENGTH, transcript.getEnd());
+    return vector<Exon>{Exon(min(begin, end - 1), end)};
+}
+
+static void benchMapsToTranscript(mt19937 &rng, long ops) {
+    vector<Transcript> transcripts;
+    makeTranscripts(rng, transcripts);
+    vector<vector<Exon>> alignments;
+    for (int i = 0; i < BENCH_ALIGNMENTS; ++i) {
+        alignments.push_back(exonsWithin(rng,
+                    transcripts[i % BENCH_TRANSCRIPTS]));
+    }
+    /* Each alignment is tested against its transcript and three neighbours,
+     * as when scanning a chromosome's overlapping transcripts. */
+    for (int genomebam = 0; genomebam < 2; ++genomebam) {
+        bench(genomebam ? "Transcript::mapsToTranscript (genomebam)"
+                : "Transcript::mapsToTranscript", ops, [&] {
+                    long hits = 0;
+                    for (long i = 0; i < ops; ++i) {
+                        long a = (i / 4) % BENCH_ALIGNMENTS;
+                        const Transcript &t = transcripts[(a + i % 4)
+                            % BENCH_TRANSCRIPTS];
+                        hits += t.mapsToTranscript(alignments[a], genomebam);
+                    }
+                    sink = hits;
+                });
+    }
+}
+
+static void benchGetAlignmentExons(mt19937 &rng, long ops) {
+    vector<seqan::BamAlignmentRecord> records(BENCH_ALIGNMENTS);
+    for (auto rec = records.begin(); rec != records.end(); ++rec) {
+        makeAlignment(rng, *rec);
+    }
+    bench("getAlignmentExons", ops, [&] {
+                long exons = 0;
+                for (long i = 0; i < ops; ++i) {
+                    exons += getAlignmentExons(
+                            records[i % BENCH_ALIGNMENTS]).size();
+                }
+                sink = exons;
+            });
+}
+
+/* Appends an NH:C tag, as stored in BAM records. */
+static void setNH(seqan::BamAlignmentRecord &rec, int nh) {
+    seqan::clear(rec.tags);
+    seqan::appendValue(rec.tags, 'N');
+    seqan::appendValue(rec.tags, 'H');
+    seqan::appendValue(rec.tags, 'C');
+    seqan::appendValue(rec.tags, (char)nh);
+}
+
+/**
+ * Templates of paired reads with 1 to 4 alignments (NH), each a pair of
+ * mates, with the ECs of each mate.
+ */
+struct BenchTemplate {
+    vector<seqan::BamAlignmentRecord> records;
+    vector<vector<int>> ECs;
+};
+
+static void benchRead(mt19937 &rng, long ops) {
+    uniform_int_distribution<int> nh(1, 4), pos(0, 10000000), insert(150, 400),
+        transcript(0, BENCH_TRANSCRIPTS - 1), ecSize(1, 4);
+    vector<BenchTemplate> templates(BENCH_ALIGNMENTS / 4);
+    for (auto t = templates.begin(); t != templates.end(); ++t) {
+        int n = nh(rng);
+        for (int i = 0; i < n; ++i) {
+            seqan::BamAlignmentRecord first, second;
+            makeAlignment(rng, first);
+            first.rID = first.rNextId = 0;
+            first.pNext = first.beginPos + insert(rng);
+            first.flag = 0x1 | 0x2 | 0x20 | 0x40;
+            second = first;
+            second.beginPos = first.pNext;
+            second.pNext = first.beginPos;
+            second.flag = 0x1 | 0x2 | 0x10 | 0x80;
+            setNH(first, n);
+            setNH(second, n);
+            vector<int> EC;
+            for (int j = ecSize(rng); j > 0; --j) {
+                EC.push_back(transcript(rng));
+            }
+            t->records.push_back(first);
+            t->records.push_back(second);
+            t->ECs.push_back(EC);
+            t->ECs.push_back(EC);
+        }
+    }
+    bench("Read::addAlignment + getEC (template)", ops, [&] {
+                long size = 0;
+                vector<int> EC;
+                for (long i = 0; i < ops; ++i) {
+                    const BenchTemplate &t = templates[i % templates.size()];
+                    Read read(t.records[0], t.ECs[0]);
+                    for (size_t j = 1; j < t.records.size(); ++j) {
+                        read.addAlignment(t.records[j], t.ECs[j], false);
+                    }
+                    read.getEC(EC);
+                    size += EC.size() + read.isComplete();
+                }
+                sink = size;
+            });
+}
+
+/**
+ * inc_TCC by nThreads threads at once; ops is their total. Three in five ECs
+ * are singletons, counted in the dense array.
+ */
+static void benchIncTCC(mt19937 &rng, long ops, int maxThreads) {
+    const int files = 4;
+    uniform_int_distribution<int> transcript(0, BENCH_TRANSCRIPTS - 1),
+        ecSize(2, 6), kind(0, 4);
+    vector<vector<int>> ECs;
+    for (int i = 0; i < BENCH_ALIGNMENTS; ++i) {
+        vector<int> EC{transcript(rng)};
+        if (kind(rng) >= 3) {
+            for (int j = ecSize(rng); j > 1; --j) {
+                EC.push_back(transcript(rng));
+            }
+            sort(EC.begin(), EC.end());
+            EC.erase(unique(EC.begin(), EC.end()), EC.end());
+        }
+        ECs.push_back(EC);
+    }
+    /* 1, 2, 4, ... threads, and maxThreads. */
+    vector<int> threadCounts;
+    for (int n = 1; n < maxThreads; n *= 2) { threadCounts.push_back(n); }
+    threadCounts.push_back(maxThreads);
+    for (auto n = threadCounts.begin(); n != threadCounts.end(); ++n) {
+        int nThreads = *n;
+        TCC_Matrix matrix(files, BENCH_TRANSCRIPTS);
+        bench("TCC_Matrix::inc_TCC (" + to_string(nThreads) + " threads)",
+                ops, [&] {
+                    vector<future<void>> threads;
+                    for (int t = 0; t < nThreads; ++t) {
+                        threads.push_back(async(launch::async, [&, t] {
+                                    for (long i = t; i < ops; i += nThreads) {
+                                        matrix.inc_TCC(
+                                                ECs[i % BENCH_ALIGNMENTS],
+                                                i % files);
+                                    }
+                                }));
+                    }
+                    for (auto it = threads.begin(); it != threads.end();
+                            ++it) {
+                        it->get();
+                    }
+                });
+    }
+}
+
+/**
+ * Checks the rows and columns of the binary TCC file in against the counts,
+ * by EC and file, that it was written from.
+ *
+ * @return      an error message, or "" if they match.
+ */
+static string checkTccBinary(const TccReader &in,
+        const map<vector<int>, vector<int>> &counts, int files) {
+    if (in.fileCount() != (uint32_t)files) { return "wrong file count"; }
+    size_t nnz = 0, matched = 0;
+    vector<int> EC;
+    /* Column entries still expected for each file, from the rows. */
+    vector<vector<TccEntry>> columns(files);
+    for (uint64_t r = 0; r < in.rowCount(); ++r) {
+        if (!in.getEC(r, EC)) { return "row without an EC"; }
+        auto expected = counts.find(EC);
+        TccSlice row = in.row(r);
+        for (size_t k = 0; k < row.size; ++k) {
+            const TccEntry &e = row.entries[k];
+            if (expected == counts.end() || e.index >= (uint32_t)files
+                    || expected->second[e.index] != e.count
+                    || (k != 0 && row.entries[k - 1].index >= e.index)) {
+                return "row " + to_string(r) + " doesn't match its counts";
+            }
+            columns[e.index].push_back(TccEntry{(uint32_t)r, e.count});
+        }
+        nnz += row.size;
+        if (expected != counts.end()) {
+            size_t nonzero = files - count(expected->second.begin(),
+                    expected->second.end(), 0);
+            if (nonzero != row.size) {
+                return "row " + to_string(r) + " is missing counts";
+            }
+            ++matched;
+        }
+    }
+    if (matched != counts.size()) { return "missing ECs"; }
+    if (nnz != in.nnz()) { return "wrong nnz"; }
+    for (int j = 0; j < files; ++j) {
+        TccSlice column = in.column(j);
+        if (column.size != columns[j].size()) {
+            return "column " + to_string(j) + " has the wrong size";
+        }
+        for (size_t k = 0; k < column.size; ++k) {
+            if (column.entries[k].index != columns[j][k].index
+                    || column.entries[k].count != columns[j][k].count) {
+                return "column " + to_string(j) + " doesn't match the rows";
+            }
+        }
+    }
+    return "";
+}
+
+/**
+ * write_to_file_binary of a matrix of ops counts by nThreads threads, then a
+ * check of the file read back with TccReader.
+ *
+ * @return      false if the file doesn't match the counts.
+ */
+static bool benchTccBinary(mt19937 &rng, long ops, int nThreads) {
+    const int files = 64;
+    uniform_int_distribution<int> transcript(0, BENCH_TRANSCRIPTS - 1),
+        ecSize(1, 4), file(0, files - 1);
+    TCC_Matrix matrix(files, BENCH_TRANSCRIPTS);
+    map<vector<int>, vector<int>> counts;
+    for (long i = 0; i < ops; ++i) {
+        vector<int> EC;
+        for (int j = ecSize(rng); j > 0; --j) {
+            EC.push_back(transcript(rng));
+        }
+        sort(EC.begin(), EC.end());
+        EC.erase(unique(EC.begin(), EC.end()), EC.end());
+        int j = file(rng);
+        matrix.inc_TCC(EC, j);
+        auto it = counts.emplace(EC, vector<int>(files, 0)).first;
+        ++it->second[j];
+    }
+    string prefix = string(P_tmpdir) + "/bam2tcc_bench."
+        + to_string(getpid());
+    int err = 0;
+    bench("TCC_Matrix::write_to_file_binary", ops, [&] {
+                err = matrix.write_to_file_binary(prefix, 0, nThreads);
+            });
+    string message = err != 0 ? "failed to write " + prefix + ".tcc" : "";
+    TccReader in;
+    if (message.empty() && !in.open(prefix + ".tcc")) {
+        message = "failed to read " + prefix + ".tcc";
+    }
+    if (message.empty()) {
+        message = checkTccBinary(in, counts, files);
+    }
+    in.close();
+    remove((prefix + ".tcc").c_str());
+    if (!message.empty()) {
+        cerr << "ERROR: binary TCC round trip: " << message << endl;
+        return false;
+    }
+    return true;
+}
+
+static void benchStrings(long ops) {
+    const string line = "chr1\tENSEMBL\ttranscript\t11869\t14409\t.\t+\t.\t"
+        "gene_id \"ENSG00000223972\"; transcript_id \"ENST00000456328\";";
+    bench("parseString (GFF line, all fields)", ops, [&] {
+                long size = 0;
+                for (long i = 0; i < ops; ++i) {
+                    size += parseString(line, "\t", 0).size();
+                }
+                sink = size;
+            });
+    bench("parseString (GFF line, 3 fields)", ops, [&] {
+                long size = 0;
+                for (long i = 0; i < ops; ++i) {
+                    size += parseString(line, "\t", 3).size();
+                }
+                sink = size;
+            });
+    const string types[] = {"transcript", "Exon", "CDS", "five_prime_UTR"};
+    bench("lower", ops, [&] {
+                long size = 0;
+                for (long i = 0; i < ops; ++i) {
+                    size += lower(types[i % 4]).size();
+                }
+                sink = size;
+            });
+}
+
+int main(int argc, char **argv) {
+    long ops = 1000000;
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    int c;
+    while ((c = getopt(argc, argv, "n:p:")) != -1) {
+        switch (c) {
+            case 'n':   ops = atol(optarg); break;
+            case 'p':   maxThreads = atoi(optarg); break;
+            default:
+                cerr << "Usage: bam2tcc_bench [-n <ops>] [-p <threads>] "
+                    << "[filter]" << endl;
+                return 1;
+        }
+    }
+    if (optind < argc) { filter = argv[optind]; }
+    if (ops <= 0 || maxThreads <= 0) {
+        cerr << "ERROR: -n and -p must be positive" << endl;
+        return 1;
+    }
+
+    mt19937 rng(42);
+    benchMapsToTranscript(rng, ops);
+    benchGetAlignmentExons(rng, ops);
+    benchRead(rng, ops / 4);
+    benchIncTCC(rng, ops, maxThreads);
+    bool matches = benchTccBinary(rng, ops, maxThreads);
+    benchStrings(ops);
+    return matches ? 0 : 1;
+}
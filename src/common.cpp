@@ -1,3 +1,4 @@
+#include <iomanip>
 #include "common.hpp"
 using namespace std;
 
@@ -31,3 +32,15 @@ string lower(string s) {
 bool isNumber(string s) {
     return s.find_first_not_of("0123456789") == string::npos;
 }
+
+/* Writes s as a JSON string. */
+void writeString(ostream &out, const string &s) {
+    out << '"';
+    for (auto c = s.begin(); c != s.end(); ++c) {
+        if (*c == '"' || *c == '\\') { out << '\\' << *c; }
+        else if ((unsigned char)*c < 0x20) {
+            out << "\\u" << hex << setw(4) << setfill('0') << (int)*c << dec;
+        } else { out << *c; }
+    }
+    out << '"';
+}
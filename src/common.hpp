@@ -1,6 +1,7 @@
 #ifndef __COMMON_HPP__
 #define __COMMON_HPP__
 
+#include <ostream>
 #include <string>
 #include <vector>
 
@@ -11,4 +12,6 @@ std::string lower(std::string s);
 
 bool isNumber(std::string s);
 
+void writeString(std::ostream &out, const std::string &s);
+
 #endif
@@ -487,18 +487,15 @@ int salmon_EQ_to_TCC(string infile, string outprefix, string transcriptome,
     in.close();
 
     vector<string> *kallisto_order = new vector<string>;
-    unordered_set<string> *kallisto_ecs = new unordered_set<string>;
-    int err = getECOrder(ref_ec, *kallisto_order,
-                                    *kallisto_ecs);
+    int err = getECOrder(ref_ec, *kallisto_order);
     if (err != -1) {
         err = matrix->write_to_file_in_order_sparse(outprefix,
-            *kallisto_order, *kallisto_ecs);
+            *kallisto_order);
     }
     delete m;
     delete m1;
     delete matrix;
     delete kallisto_order;
-    delete kallisto_ecs;
     return err;
 }
 
@@ -1,11 +1,17 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <time.h>
 #include <getopt.h>
+#include <zlib.h>
 #include <seqan/bam_io.h>
 #include <seqan/gff_io.h>
 #include "TCC_Matrix.hpp"
 #include "Mapper.hpp"
+#include "FileUtil.hpp"
+#include "Stats.hpp"
+#include "Trace.hpp"
+#include "Whitelist.hpp"
 #include "common.hpp"
 using namespace std;
 
@@ -252,10 +258,13 @@ void usage() {
     cerr << "Usage: thing [options]* -g <GFF> -S <BAM/SAM> [-o output]" << endl
     << "  <GFF>                     Comma-separated list of GFFs." << endl
     << "  <SAM/BAM>                 Comma-separated list of SAM/BAM files "
-    << "sorted by genomic coordinate." << endl
+    << "sorted by genomic coordinate. Use - to read from stdin." << endl
     << "  <output>                  Prefix of output files (defaults to "
     << "`matrix`)" << endl
     << endl << "Options:" << endl
+    << "  --manifest <file>         Also map the SAM/BAM files listed in <file>, "
+    << "one per line, each optionally followed by a tab and its name in the "
+    << ".cells file." << endl
     << "  -U                        Indicate that reads are unpaired." << endl
     << "  -k                        Indicate that the input SAM/BAM files were "
     << "generated by kallisto genomebam. Required for BAM files." << endl
@@ -269,8 +278,36 @@ void usage() {
     << "ECs will be appended." << endl
     << "  -p <threads>              Number of threads to use. " << endl
     << "  --full-matrix             Output full (not sparse) matrix." << endl
+    << "  --mtx                     Output a MatrixMarket matrix (.mtx) of "
+    << "ECs by files instead of the .tsv, entries ordered by EC." << endl
+    << "  --mtx-column-major        As --mtx, entries ordered by file." << endl
+    << "  --bus <file>              Also write a BUS record of each read counted "
+    << "to <file>, for bustools. The ECs it refers to are those of the .ec."
+    << " Needs --cell-tag; cannot be used with -e or --binary." << endl
+    << "  --cell-tag <tag>          Count reads by the cell barcode in tag CB or "
+    << "CR instead of by input file: one column per barcode." << endl
+    << "  --umi                     Count each molecule (UMI from the UB or UR "
+    << "tag) once per EC and column. Reads without a UMI are not counted."
+    << endl
+    << "  --whitelist <file>        Drop reads whose cell barcode is not in "
+    << "<file> (one per line), after correcting those one substitution away "
+    << "from a single listed barcode." << endl
+    << "  --binary                  Output ECs and counts in one binary file "
+    << "(.tcc) instead of the .ec and .tsv. See src/TccBinary.hpp." << endl
+    << "  --stats-json <file>       Write the time taken by each stage and "
+    << "chromosome, throughput and counts to <file> as JSON." << endl
+    << "  --trace <file>            Write a timeline of each thread's tasks "
+    << "and waits to <file>, for chrome://tracing or Perfetto." << endl
     << "  -u, --unmapped <SAM/BAM>  Output unmapped reads to files <SAM/BAM>."
-    << " Must provide one for each input SAM/BAM file." << endl
+    << " Must provide one for each input SAM/BAM file, in its format, and "
+    << "can't be used with streamed input." << endl
+    << "  --compression-level <n>   Compression level (0-9) of BAM outputs. "
+    << "0 or 1 for fast scratch files." << endl
+    << "  -M, --mate-cigar          Resolve properly paired reads from the "
+    << "leftmost mate alone when it carries the MC (mate CIGAR) tag." << endl
+    << "  --collated                Input SAM/BAM files are grouped by read "
+    << "name (e.g. unsorted aligner output) instead of sorted by coordinate."
+    << endl
 #if READ_DIST
     << "  -m, --mapped <SAM/BAM>    Output mapped reads to files <SAM/BAM>. "
     << "Must provide one for each input SAM/BAM file." << endl
@@ -281,14 +318,21 @@ void usage() {
 
 int main(int argc, char **argv) {
     time_t startTime = time(0);
-    vector<string> gff, bam, fa, unmapped;
+    Stats stats;
+    Stats::Clock clock = Stats::start();
+    vector<string> gff, bam, fa, unmapped, labels;
 #if READ_DIST
     vector<string> mapped;
 #endif
-    string outprefix = "matrix", ec = "";
-    bool paired = true, full = false, checkGFFOnly = false,
-         pgProvided = false, genomebam = false, rapmap = false;
-    int threads = 1;
+    string outprefix = "matrix", ec = "", bus = "", cellTag = "",
+           whitelistFile = "", manifest = "", statsFile = "",
+           traceFile = "";
+    bool paired = true, full = false, mtx = false, columnMajor = false,
+         binary = false, collapseUMIs = false,
+         checkGFFOnly = false,
+         pgProvided = false, genomebam = false, rapmap = false,
+         mateCigar = false, collated = false;
+    int threads = 1, compressionLevel = Z_DEFAULT_COMPRESSION;
     
     /* Parse options. */
     struct option opts[] = {
@@ -302,14 +346,27 @@ int main(int argc, char **argv) {
         {"EC", required_argument, 0, 'e'},
         {"threads", required_argument, 0, 'p'},
         {"full-matrix", no_argument, no_argument, 'f'},
+        {"mtx", no_argument, no_argument, 'X'},
+        {"mtx-column-major", no_argument, no_argument, 'Y'},
+        {"binary", no_argument, no_argument, 'B'},
+        {"bus", required_argument, 0, 'b'},
+        {"cell-tag", required_argument, 0, 'c'},
+        {"umi", no_argument, no_argument, 'I'},
+        {"whitelist", required_argument, 0, 'W'},
+        {"manifest", required_argument, 0, 'F'},
+        {"stats-json", required_argument, 0, 'J'},
+        {"trace", required_argument, 0, 'T'},
         {"unmapped", required_argument, 0, 'u'},
+        {"mate-cigar", no_argument, no_argument, 'M'},
+        {"collated", no_argument, no_argument, 'C'},
+        {"compression-level", required_argument, 0, 'L'},
 #if READ_DIST
         {"mapped", required_argument, 0, 'm'},
 #endif
         {"check-gff", no_argument, no_argument, 'G'}
     };
     int opt_index = 0;
-    string stringopts = "g:S:o:Ut:p:e:fu:kR";
+    string stringopts = "g:S:o:Ut:p:e:fu:kRM";
 #if READ_DIST
     stringopts += "m:";
 #endif
@@ -327,7 +384,20 @@ int main(int argc, char **argv) {
             case 'p':   threads = atoi(optarg); break;
             case 'e':   ec = optarg; break;
             case 'f':   full = true; break;
+            case 'X':   mtx = true; break;
+            case 'Y':   mtx = true; columnMajor = true; break;
+            case 'B':   binary = true; break;
+            case 'b':   bus = optarg; break;
+            case 'c':   cellTag = optarg; break;
+            case 'I':   collapseUMIs = true; break;
+            case 'W':   whitelistFile = optarg; break;
+            case 'F':   manifest = optarg; break;
+            case 'J':   statsFile = optarg; break;
+            case 'T':   traceFile = optarg; break;
             case 'u':   unmapped = parseString(optarg, ",", 0); break;
+            case 'M':   mateCigar = true; break;
+            case 'C':   collated = true; break;
+            case 'L':   compressionLevel = atoi(optarg); break;
 #if READ_DIST
             case 'm':   mapped = parseString(optarg, ",", 0); break;
 #endif
@@ -335,10 +405,21 @@ int main(int argc, char **argv) {
         }
     }
 
+    labels.resize(bam.size());
+    if (manifest.size() != 0 && !readManifest(manifest, bam, labels)) {
+        cerr << "ERROR: failed to read manifest " << manifest << endl;
+        return 1;
+    }
+
     /* Make sure all required files are present. */
     if ((checkGFFOnly && gff.size() == 0)
            || (!checkGFFOnly && bam.size() == 0)
            || (unmapped.size() != 0 && unmapped.size() != bam.size())
+           || compressionLevel < Z_DEFAULT_COMPRESSION || compressionLevel > 9
+           || (bus.size() != 0
+               && (ec.size() != 0 || binary || cellTag.size() == 0))
+           || (cellTag.size() != 0 && cellTag.compare("CB") != 0
+               && cellTag.compare("CR") != 0)
 #if READ_DIST
            || (mapped.size() != 0 && mapped.size() != bam.size())
 #endif
@@ -359,6 +440,27 @@ int main(int argc, char **argv) {
         seqan::close(f);
     }
     for (auto file = bam.begin(); file != bam.end(); ++file) {
+        /* Streams can't be opened twice, so they're only checked when read. */
+        if (isStreamInput(*file)) {
+            if (file->compare("-") == 0 && find(bam.begin(), file, "-") != file)
+            {
+                cerr << "ERROR: stdin (-) given more than once" << endl;
+                return 1;
+            }
+            if (unmapped.size() != 0) {
+                cerr << "ERROR: cannot output unmapped reads of streamed input "
+                    << *file << endl;
+                return 1;
+            }
+            continue;
+        }
+        /* Unmapped records are copied from the input as they are. */
+        if (unmapped.size() != 0 && hasSAMExt(*file)
+                != hasSAMExt(unmapped[file - bam.begin()])) {
+            cerr << "ERROR: unmapped output " << unmapped[file - bam.begin()]
+                << " must be in the format (SAM or BAM) of " << *file << endl;
+            return 1;
+        }
         seqan::BamFileIn f;
         if (!seqan::open(f, file->c_str())) {
             cerr << "ERROR: failed to open SAM/BAM file " << *file << endl;
@@ -376,17 +478,24 @@ int main(int argc, char **argv) {
             return 1;
         }
     }
+    Whitelist whitelist;
+    if (whitelistFile.size() != 0 && !whitelist.load(whitelistFile)) {
+        cerr << "ERROR: failed to read barcode whitelist " << whitelistFile
+            << endl;
+        return 1;
+    }
     if (ec.size() != 0 && !testOpen(ec, 0)) {
             cerr << "ERROR: failed to open reference EC " << ec << endl;
             return 1;
     }
-    if (!testOpen(outprefix + ".ec", 1)) {
+    if (!binary && !testOpen(outprefix + ".ec", 1)) {
         cerr << "ERROR: failed to open output file " << outprefix << ".ec"
             << endl;
         return 1;
     }
-    if (!testOpen(outprefix + ".tsv", 1)) {
-        cerr << "ERROR: failed to open output file " << outprefix << ".tsv"
+    string matrixExt = binary ? ".tcc" : mtx ? ".mtx" : ".tsv";
+    if (!testOpen(outprefix + matrixExt, 1)) {
+        cerr << "ERROR: failed to open output file " << outprefix << matrixExt
             << endl;
         return 1;
     }
@@ -395,6 +504,18 @@ int main(int argc, char **argv) {
             << endl;
         return 1;
     }
+    if (traceFile.size() != 0 && !testOpen(traceFile, 1)) {
+        cerr << "ERROR: failed to open output file " << traceFile << endl;
+        return 1;
+    }
+    if (statsFile.size() != 0 && !testOpen(statsFile, 1)) {
+        cerr << "ERROR: failed to open output file " << statsFile << endl;
+        return 1;
+    }
+    if (bus.size() != 0 && !testOpen(bus, 1)) {
+        cerr << "ERROR: failed to open output file " << bus << endl;
+        return 1;
+    }
     for (auto file = unmapped.begin(); file != unmapped.end(); ++file) {
         if (!testOpen(*file, 1)) {
             cerr << "ERROR: failed to open output file " << *file << endl;
@@ -422,16 +543,40 @@ int main(int argc, char **argv) {
     if (checkGFFOnly) { return 0; }
 
     /* Map and write */
-    Mapper mapper(gff, bam, fa, paired, unmapped.size() != 0,
-           pgProvided, genomebam, rapmap);
+    stats.endStage("preflight", clock);
+    Trace trace;
+    if (traceFile.size() != 0) {
+        Trace::setActive(&trace);
+    }
+    clock = Stats::start();
+    uint64_t traceStart = Trace::now();
+    Mapper mapper(gff, bam, fa, paired, unmapped,
+           pgProvided, genomebam, rapmap, mateCigar, collated,
+           compressionLevel, bus, cellTag, collapseUMIs,
+           whitelistFile.size() != 0 ? &whitelist : nullptr, labels,
+           statsFile.size() != 0 ? &stats : nullptr);
+    stats.endStage("gff_prescan", clock);
+    if (Trace::get() != nullptr) {
+        trace.add("scan GFF", "io", traceStart);
+    }
     cout << "Mapping reads..." << endl;
     mapper.mapReads(threads);
     cout << "Writing to file..." << endl;
-    mapper.writeToFile(outprefix, unmapped,
+    clock = Stats::start();
+    mapper.writeToFile(outprefix,
 #if READ_DIST
             mapped,
 #endif
-            full, ec);
+            full, ec, mtx, columnMajor, binary);
+    stats.endStage("write", clock);
+    if (statsFile.size() != 0
+            && !stats.writeJSON(statsFile, mapper.getNumECs(), bam)) {
+        cerr << "WARNING: failed to write " << statsFile << endl;
+    }
+    Trace::setActive(nullptr);
+    if (traceFile.size() != 0 && !trace.write(traceFile, bam)) {
+        cerr << "WARNING: failed to write " << traceFile << endl;
+    }
     
     printTime(time(0) - startTime);
     return 0;
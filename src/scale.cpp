@@ -0,0 +1,462 @@
+/**
+ * End-to-end scaling benchmark: runs bam2tcc on fixed synthetic workloads
+ * (made once by bam2tcc_synth) at 1, 2, 4, ... threads, and reports each
+ * run's wall time, records/s, parallel efficiency and peak RSS, and whether
+ * its counts match the golden ones: those saved with --update-golden, or
+ * else the truth bam2tcc_synth wrote.
+ *
+ *   bam2tcc_scale [options]*
+ *
+ * Results are written as JSON (one run per line), which can be saved and
+ * given back with --baseline; runs slower, or using more memory, than their
+ * baseline run by more than the threshold are flagged, as are runs whose
+ * output differs. The exit status is 1 if any run was flagged.
+ */
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "common.hpp"
+using namespace std;
+
+/* A workload: how to generate it, and what bam2tcc is given besides it. */
+struct Workload {
+    string name;
+    vector<string> synthArgs, mapArgs;
+    int files;
+};
+
+static const vector<Workload> WORKLOADS = {
+    {"small", {"--genes", "2000", "-r", "100000"}, {}, 1},
+    {"medium", {"--genes", "20000", "-r", "1000000", "-b"}, {}, 1},
+    {"large", {"--chromosomes", "8", "--genes", "60000", "-r", "10000000",
+        "-b"}, {}, 1},
+    {"genomebam", {"--genes", "20000", "-r", "1000000", "-b", "-k"}, {}, 1},
+    {"rapmap", {"--genes", "20000", "-r", "1000000", "-b", "-R"}, {}, 1},
+    {"many-files", {"--genes", "20000", "-r", "100000", "-b", "-n", "16"},
+        {}, 16},
+};
+
+/* One run of bam2tcc on a workload. */
+struct Run {
+    string workload;
+    int threads;
+    long records;
+    double wall;
+    long rss;
+    double efficiency;
+    /* "match", "differ (n)", or "failed". */
+    string output;
+    vector<string> flags;
+};
+
+/**
+ * Runs args[0] with args, stdout and stderr to log. Sets wall (seconds) and
+ * rss (peak, in KB). Returns whether it ran and exited with 0.
+ */
+static bool run(const vector<string> &args, const string &log, double &wall,
+        long &rss) {
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == -1) { return false; }
+    if (pid == 0) {
+        int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd != -1) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+            close(fd);
+        }
+        vector<char*> argv;
+        for (auto it = args.begin(); it != args.end(); ++it) {
+            argv.push_back(const_cast<char*>(it->c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) { return false; }
+    wall = chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+    rss = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Whether s is a nonnegative integer. */
+static bool isCount(const string &s) {
+    return !s.empty() && isNumber(s);
+}
+
+static bool exists(const string &filename) {
+    return access(filename.c_str(), F_OK) == 0;
+}
+
+/**
+ * Generates w in dir unless already there. Sets records to the number of
+ * records in its SAM/BAM files, from bam2tcc_synth's log.
+ */
+static bool generate(const string &bin, const string &dir, const Workload &w,
+        long &records) {
+    string prefix = dir + "/" + w.name, log = prefix + ".synth.log";
+    if (!exists(prefix + ".truth.tsv")) {
+        cout << "Generating " << w.name << "..." << endl;
+        vector<string> args{bin + "/bam2tcc_synth", "-o", prefix};
+        args.insert(args.end(), w.synthArgs.begin(), w.synthArgs.end());
+        double wall;
+        long rss;
+        if (!run(args, log, wall, rss)) {
+            unlink((prefix + ".truth.tsv").c_str());
+            return false;
+        }
+    }
+    ifstream in(log);
+    string line;
+    records = 0;
+    while (getline(in, line)) {
+        vector<string> words = parseString(line, " ", 0);
+        if (words.size() == 3 && words[2].compare("records") == 0
+                && isCount(words[1])) {
+            records += stol(words[1]);
+        }
+    }
+    return records != 0;
+}
+
+/* The SAM/BAM files of w in dir. */
+static vector<string> inputs(const string &dir, const Workload &w) {
+    string prefix = dir + "/" + w.name;
+    string ext = find(w.synthArgs.begin(), w.synthArgs.end(), "-b")
+        != w.synthArgs.end() ? ".bam" : ".sam";
+    vector<string> files;
+    for (int i = 0; i < w.files; ++i) {
+        files.push_back(prefix + (w.files == 1 ? "" : "." + to_string(i))
+                + ext);
+    }
+    return files;
+}
+
+/**
+ * Reads the counts of a bam2tcc output (prefix.ec and sparse prefix.tsv) as
+ * "EC<tab>file" to count, so that outputs compare whatever their EC order.
+ */
+static bool readOutput(const string &prefix, map<string, long> &counts) {
+    ifstream ec(prefix + ".ec"), tsv(prefix + ".tsv");
+    if (!ec.is_open() || !tsv.is_open()) { return false; }
+    vector<string> ecs;
+    string line;
+    while (getline(ec, line)) {
+        vector<string> fields = parseString(line, "\t", 0);
+        if (fields.size() != 2) { return false; }
+        ecs.push_back(fields[1]);
+    }
+    while (getline(tsv, line)) {
+        vector<string> fields = parseString(line, "\t", 0);
+        if (fields.size() != 3 || !isCount(fields[0]) || !isCount(fields[2])
+                || stol(fields[0]) >= ecs.size()) {
+            return false;
+        }
+        counts[ecs[stol(fields[0])] + "\t" + fields[1]] += stol(fields[2]);
+    }
+    return true;
+}
+
+/* Reads counts written by writeGolden (or bam2tcc_synth's truth). */
+static bool readGolden(const string &filename, map<string, long> &counts) {
+    ifstream in(filename);
+    if (!in.is_open()) { return false; }
+    string line;
+    while (getline(in, line)) {
+        vector<string> fields = parseString(line, "\t", 0);
+        if (fields.size() != 3 || !isCount(fields[2])) { return false; }
+        counts[fields[0] + "\t" + fields[1]] += stol(fields[2]);
+    }
+    return true;
+}
+
+static bool writeGolden(const string &filename,
+        const map<string, long> &counts) {
+    ofstream out(filename);
+    if (!out.is_open()) { return false; }
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+        out << it->first << '\t' << it->second << '\n';
+    }
+    return out.good();
+}
+
+/* Number of (EC, file) entries whose counts differ between a and b. */
+static long compare(const map<string, long> &a, const map<string, long> &b) {
+    long differ = 0;
+    for (auto it = a.begin(); it != a.end(); ++it) {
+        auto other = b.find(it->first);
+        differ += other == b.end() || other->second != it->second;
+    }
+    for (auto it = b.begin(); it != b.end(); ++it) {
+        differ += a.find(it->first) == a.end();
+    }
+    return differ;
+}
+
+/* The value of "key": in a line of JSON written by writeResults. */
+static string getValue(const string &line, const string &key) {
+    size_t start = line.find("\"" + key + "\": ");
+    if (start == string::npos) { return ""; }
+    start += key.size() + 4;
+    if (line[start] == '"') {
+        return line.substr(start + 1, line.find('"', start + 1) - start - 1);
+    }
+    return line.substr(start, line.find_first_of(",}", start) - start);
+}
+
+/**
+ * Reads the runs of a results file, by workload and thread count.
+ */
+static bool readBaseline(const string &filename,
+        map<pair<string, int>, Run> &runs) {
+    ifstream in(filename);
+    if (!in.is_open()) { return false; }
+    string line;
+    while (getline(in, line)) {
+        Run r;
+        r.workload = getValue(line, "workload");
+        string threads = getValue(line, "threads");
+        if (r.workload.empty() || !isCount(threads)) { continue; }
+        r.threads = stoi(threads);
+        r.wall = atof(getValue(line, "wall_s").c_str());
+        r.rss = atol(getValue(line, "peak_rss_kb").c_str());
+        runs[make_pair(r.workload, r.threads)] = r;
+    }
+    return true;
+}
+
+static bool writeResults(const string &filename, const vector<Run> &runs,
+        double threshold) {
+    ofstream out(filename);
+    if (!out.is_open()) { return false; }
+    out << fixed << setprecision(3) << "{\n  \"threshold\": " << threshold
+        << ",\n  \"runs\": [";
+    for (size_t i = 0; i < runs.size(); ++i) {
+        const Run &r = runs[i];
+        out << (i == 0 ? "\n" : ",\n") << "    {\"workload\": \"" << r.workload
+            << "\", \"threads\": " << r.threads << ", \"records\": "
+            << r.records << ", \"wall_s\": " << r.wall
+            << ", \"records_per_s\": " << (r.wall > 0 ? r.records / r.wall : 0)
+            << ", \"efficiency\": " << r.efficiency << ", \"peak_rss_kb\": "
+            << r.rss << ", \"output\": \"" << r.output << "\", \"flags\": [";
+        for (size_t j = 0; j < r.flags.size(); ++j) {
+            out << (j == 0 ? "\"" : ", \"") << r.flags[j] << "\"";
+        }
+        out << "]}";
+    }
+    out << "\n  ]\n}\n";
+    return out.good();
+}
+
+void usage() {
+    cerr << "Usage: bam2tcc_scale [options]*" << endl
+    << "  -b, --bin <dir>           Directory of bam2tcc and bam2tcc_synth "
+    << "(default: that of bam2tcc_scale)." << endl
+    << "  -w, --work <dir>          Directory for workloads and outputs "
+    << "(default scale_work). Workloads are generated once." << endl
+    << "  -W, --workloads <names>   Comma-separated workloads to run (default "
+    << "all): small, medium, large, genomebam, rapmap, many-files." << endl
+    << "  -p, --threads <n>         Most threads; runs use 1, 2, 4, ... and n "
+    << "(default: all cores)." << endl
+    << "  -r, --repeats <n>         Runs of each, keeping the fastest "
+    << "(default 1)." << endl
+    << "  -g, --golden <dir>        Directory of golden outputs (default: "
+    << "compare with bam2tcc_synth's truth)." << endl
+    << "  --update-golden           Save each workload's 1-thread output as "
+    << "its golden output." << endl
+    << "  -B, --baseline <file>     Results of an earlier run to compare with."
+    << endl
+    << "  -t, --threshold <f>       Flag runs slower or larger than their "
+    << "baseline by more than this fraction (default 0.1)." << endl
+    << "  -o, --output <file>       Results file (default scale.json)."
+    << endl;
+}
+
+int main(int argc, char **argv) {
+    string bin, work = "scale_work", golden, baseline, output = "scale.json";
+    vector<string> names;
+    int maxThreads = max(1u, thread::hardware_concurrency()), repeats = 1;
+    double threshold = 0.1;
+    bool updateGolden = false;
+    struct option opts[] = {
+        {"bin", required_argument, 0, 'b'},
+        {"work", required_argument, 0, 'w'},
+        {"workloads", required_argument, 0, 'W'},
+        {"threads", required_argument, 0, 'p'},
+        {"repeats", required_argument, 0, 'r'},
+        {"golden", required_argument, 0, 'g'},
+        {"update-golden", no_argument, no_argument, 'U'},
+        {"baseline", required_argument, 0, 'B'},
+        {"threshold", required_argument, 0, 't'},
+        {"output", required_argument, 0, 'o'},
+        {0, 0, 0, 0}
+    };
+    int opt_index = 0;
+    while (true) {
+        int c = getopt_long(argc, argv, "b:w:W:p:r:g:B:t:o:", opts,
+                &opt_index);
+        if (c == -1) { break; }
+        switch (c) {
+            case 'b':   bin = optarg; break;
+            case 'w':   work = optarg; break;
+            case 'W':   names = parseString(optarg, ",", 0); break;
+            case 'p':   maxThreads = atoi(optarg); break;
+            case 'r':   repeats = atoi(optarg); break;
+            case 'g':   golden = optarg; break;
+            case 'U':   updateGolden = true; break;
+            case 'B':   baseline = optarg; break;
+            case 't':   threshold = atof(optarg); break;
+            case 'o':   output = optarg; break;
+            default:    usage(); return 1;
+        }
+    }
+    if (optind != argc || maxThreads < 1 || repeats < 1 || threshold < 0
+            || (updateGolden && golden.empty())) {
+        usage();
+        return 1;
+    }
+    if (bin.empty()) {
+        string self = argv[0];
+        size_t slash = self.rfind('/');
+        bin = slash == string::npos ? "." : self.substr(0, slash);
+    }
+
+    vector<Workload> workloads;
+    if (names.empty()) { workloads = WORKLOADS; }
+    for (auto name = names.begin(); name != names.end(); ++name) {
+        auto w = WORKLOADS.begin();
+        while (w != WORKLOADS.end() && w->name.compare(*name) != 0) { ++w; }
+        if (w == WORKLOADS.end()) {
+            cerr << "ERROR: no workload " << *name << endl;
+            return 1;
+        }
+        workloads.push_back(*w);
+    }
+    map<pair<string, int>, Run> base;
+    if (!baseline.empty() && !readBaseline(baseline, base)) {
+        cerr << "ERROR: failed to read baseline " << baseline << endl;
+        return 1;
+    }
+    if ((mkdir(work.c_str(), 0755) != 0 && errno != EEXIST)
+            || (!golden.empty() && mkdir(golden.c_str(), 0755) != 0
+                && errno != EEXIST)) {
+        cerr << "ERROR: failed to create " << work << " or " << golden << endl;
+        return 1;
+    }
+
+    vector<int> threadCounts;
+    for (int n = 1; n < maxThreads; n *= 2) { threadCounts.push_back(n); }
+    threadCounts.push_back(maxThreads);
+
+    vector<Run> runs;
+    bool flagged = false;
+    cout << left << setw(12) << "workload" << right << setw(8) << "threads"
+        << setw(10) << "wall (s)" << setw(14) << "records/s" << setw(12)
+        << "efficiency" << setw(14) << "peak RSS (MB)" << "  output" << endl;
+    for (auto w = workloads.begin(); w != workloads.end(); ++w) {
+        long records;
+        if (!generate(bin, work, *w, records)) {
+            cerr << "ERROR: failed to generate " << w->name << "; see "
+                << work << "/" << w->name << ".synth.log" << endl;
+            return 1;
+        }
+        string prefix = work + "/" + w->name;
+        string goldenFile = golden.empty() ? prefix + ".truth.tsv"
+            : golden + "/" + w->name + ".tsv";
+        map<string, long> expected;
+        bool haveGolden = !updateGolden && readGolden(goldenFile, expected);
+        double serial = 0;
+        for (auto t = threadCounts.begin(); t != threadCounts.end(); ++t) {
+            Run r{w->name, *t, records, 0, 0, 0, "", vector<string>()};
+            string out = prefix + ".p" + to_string(*t);
+            vector<string> args{bin + "/bam2tcc", "-g", prefix + ".gtf",
+                "-t", prefix + ".fa", "-S", "", "-o", out, "-p",
+                to_string(*t)};
+            vector<string> files = inputs(work, *w);
+            for (auto f = files.begin(); f != files.end(); ++f) {
+                args[6] += (f == files.begin() ? "" : ",") + *f;
+            }
+            args.insert(args.end(), w->mapArgs.begin(), w->mapArgs.end());
+            bool success = true;
+            for (int i = 0; i < repeats && success; ++i) {
+                double wall;
+                long rss;
+                success = run(args, out + ".log", wall, rss);
+                if (i == 0 || wall < r.wall) { r.wall = wall; }
+                r.rss = max(r.rss, rss);
+            }
+
+            map<string, long> counts;
+            if (!success || !readOutput(out, counts)) {
+                r.output = "failed";
+                r.flags.push_back("failed");
+            } else if (updateGolden && *t == 1) {
+                if (!writeGolden(goldenFile, counts)) {
+                    cerr << "ERROR: failed to write " << goldenFile << endl;
+                    return 1;
+                }
+                expected = counts;
+                haveGolden = true;
+                r.output = "golden";
+            } else if (haveGolden) {
+                long differ = compare(counts, expected);
+                r.output = differ == 0 ? "match"
+                    : "differ (" + to_string(differ) + ")";
+                if (differ != 0) { r.flags.push_back("output"); }
+            } else {
+                r.output = "no golden";
+            }
+
+            if (*t == 1) { serial = r.wall; }
+            r.efficiency = serial > 0 && r.wall > 0
+                ? serial / (r.wall * *t) : 0;
+            auto b = base.find(make_pair(r.workload, r.threads));
+            if (b != base.end() && r.output.compare("failed") != 0) {
+                if (r.wall > b->second.wall * (1 + threshold)) {
+                    r.flags.push_back("slower");
+                }
+                if (r.rss > b->second.rss * (1 + threshold)) {
+                    r.flags.push_back("memory");
+                }
+            }
+            flagged = flagged || !r.flags.empty();
+
+            cout << left << setw(12) << r.workload << right << setw(8)
+                << r.threads << fixed << setprecision(2) << setw(10) << r.wall
+                << setprecision(0) << setw(14)
+                << (r.wall > 0 ? r.records / r.wall : 0) << setprecision(2)
+                << setw(12) << r.efficiency << setprecision(1) << setw(14)
+                << r.rss / 1024.0 << "  " << r.output;
+            if (b != base.end()) {
+                cout << setprecision(2) << "  (baseline " << b->second.wall
+                    << " s)";
+            }
+            for (auto f = r.flags.begin(); f != r.flags.end(); ++f) {
+                cout << "  ** " << *f;
+            }
+            cout << endl;
+            runs.push_back(r);
+        }
+    }
+    if (!writeResults(output, runs, threshold)) {
+        cerr << "ERROR: failed to write " << output << endl;
+        return 1;
+    }
+    return flagged ? 1 : 0;
+}
@@ -0,0 +1,874 @@
+/**
+ * Generates a synthetic annotation and alignments of reads to it, with the
+ * equivalence class each read should get, for testing bam2tcc at any scale
+ * without real data:
+ *
+ *   <prefix>.gtf           Ensembl-format annotation: genes on numbered
+ *                          chromosomes, each with isoforms made of some of its
+ *                          exons.
+ *   <prefix>.fa            The transcriptome, to give bam2tcc with -t so that
+ *                          transcript IDs (0, 1, ...) are their order in both.
+ *   <prefix>.sam/.bam      Coordinate-sorted alignments (<prefix>.<i>.sam/.bam
+ *                          with several files), as a genome aligner (HISAT2),
+ *                          kallisto --genomebam (-k) or RapMap (-R) writes.
+ *   <prefix>.truth.tsv     EC, file and count of every EC that a read should
+ *                          be counted under, by the rules bam2tcc counts by.
+ *
+ * Reads are drawn from transcripts (expression is log-normal), as fragments of
+ * each transcript's exons or (--intronic) of its pre-mRNA. Multimapping reads
+ * get further alignments at the same offset of isoforms of other genes
+ * downstream, as if they were paralogs.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <zlib.h>
+#include "Exon.hpp"
+#include "RecordWriter.hpp"
+#include "common.hpp"
+using namespace std;
+
+/* Genes downstream of a read's that its paralog alignments may be in. */
+#define SYNTH_PARALOG_WINDOW 20
+/* Bytes of records collected before they are handed to the writer. */
+#define SYNTH_WRITE_SIZE (1 << 20)
+/* Longest chromosome: the most that BAM index bins cover. */
+#define SYNTH_MAX_CHROM_LENGTH (1 << 29)
+
+struct SynthOptions {
+    string prefix = "synth";
+    int chromosomes = 2, genes = 2000, files = 1, threads = 1;
+    double density = 10, isoforms = 3, exons = 8;
+    int exonMin = 50, exonMax = 400, intronMin = 100, intronMax = 10000;
+    long reads = 1000000;
+    bool paired = true, bam = false, genomebam = false, rapmap = false;
+    int readLength = 100, fragmentMean = 300, fragmentSD = 50, maxNH = 4;
+    double multimap = 0.1, spliced = -1, intronic = 0, unmapped = 0;
+    int compressionLevel = Z_DEFAULT_COMPRESSION;
+    unsigned seed = 1;
+};
+
+struct SynthTranscript {
+    int gene;
+    char strand;
+    /* In increasing genomic order, whatever the strand. */
+    vector<Exon> exons;
+    int length;
+    double weight;
+};
+
+struct SynthGene {
+    int chrom, start, end;
+    /* Its transcripts are IDs first to first + count - 1. */
+    int first, count;
+};
+
+struct SynthAnnotation {
+    vector<int> chromLengths;
+    vector<SynthGene> genes;
+    vector<SynthTranscript> transcripts;
+};
+
+/* Mean distance between genes, for density genes per Mb. */
+static double getMeanGap(const SynthOptions &o) {
+    double meanGene = o.exons * (o.exonMin + o.exonMax) / 2.0
+        + (o.exons - 1) * (o.intronMin + o.intronMax) / 2.0;
+    return max(100.0, 1e6 / o.density - meanGene);
+}
+
+/* Most bases a gene and the gap before it may take. */
+static double getLongestGene(const SynthOptions &o) {
+    int exons = max(1, (int)(2 * o.exons) - 1);
+    return getMeanGap(o) * 3 / 2 + (double)exons * o.exonMax
+        + (exons - 1.0) * o.intronMax;
+}
+
+/**
+ * Fills a with genes tiled along the chromosomes, density per Mb on average.
+ * A chromosome is added whenever the next gene might not fit within
+ * SYNTH_MAX_CHROM_LENGTH. Each gene has a set of exons; its first isoform has
+ * all of them, the others skip some and may start or end within their first
+ * or last exon.
+ */
+static void makeAnnotation(const SynthOptions &o, SynthAnnotation &a) {
+    mt19937_64 rng(o.seed);
+    uniform_int_distribution<int> exonLength(o.exonMin, o.exonMax),
+        intronLength(o.intronMin, o.intronMax),
+        exonCount(1, max(1, (int)(2 * o.exons) - 1)),
+        isoformCount(1, max(1, (int)(2 * o.isoforms) - 1));
+    bernoulli_distribution coin(0.5), keep(0.7), altEnd(0.3);
+    lognormal_distribution<double> expression(0, 1.5);
+    int meanGap = getMeanGap(o);
+    uniform_int_distribution<int> gap(meanGap / 2, meanGap * 3 / 2);
+    double longest = getLongestGene(o) + meanGap;
+
+    int perChrom = (o.genes + o.chromosomes - 1) / o.chromosomes;
+    int chrom = -1, inChrom = perChrom;
+    for (int g = 0; g < o.genes; ++g) {
+        if (inChrom == perChrom
+                || a.chromLengths[chrom] + longest > SYNTH_MAX_CHROM_LENGTH) {
+            a.chromLengths.push_back(0);
+            ++chrom;
+            inChrom = 0;
+        }
+        ++inChrom;
+        int pos = a.chromLengths[chrom] + gap(rng);
+        vector<Exon> exons;
+        for (int i = exonCount(rng); i > 0; --i) {
+            if (!exons.empty()) { pos += intronLength(rng); }
+            exons.push_back(Exon(pos, pos + exonLength(rng)));
+            pos = exons.back().end;
+        }
+        char strand = coin(rng) ? '+' : '-';
+        SynthGene gene{chrom, exons.front().start, exons.back().end,
+            (int)a.transcripts.size(), isoformCount(rng)};
+        for (int i = 0; i < gene.count; ++i) {
+            SynthTranscript t{g, strand, exons, 0, expression(rng)};
+            if (i != 0) {
+                t.exons.clear();
+                for (auto e = exons.begin(); e != exons.end(); ++e) {
+                    if (keep(rng)) { t.exons.push_back(*e); }
+                }
+                if (t.exons.empty()) {
+                    t.exons.push_back(exons[uniform_int_distribution<int>(0,
+                                exons.size() - 1)(rng)]);
+                }
+                Exon &first = t.exons.front(), &last = t.exons.back();
+                if (altEnd(rng) && first.end - first.start > 1) {
+                    first.start = uniform_int_distribution<int>(first.start,
+                            first.end - 1)(rng);
+                }
+                if (altEnd(rng) && last.end - last.start > 1) {
+                    last.end = uniform_int_distribution<int>(last.start + 1,
+                            last.end)(rng);
+                }
+            }
+            for (auto e = t.exons.begin(); e != t.exons.end(); ++e) {
+                t.length += e->end - e->start;
+            }
+            a.transcripts.push_back(t);
+        }
+        a.genes.push_back(gene);
+        a.chromLengths[chrom] = gene.end;
+    }
+    for (auto it = a.chromLengths.begin(); it != a.chromLengths.end(); ++it) {
+        *it += meanGap;
+    }
+}
+
+static string transcriptName(int id) {
+    string n = to_string(id);
+    return "SYNT" + string(n.size() < 11 ? 11 - n.size() : 0, '0') + n;
+}
+
+static string geneName(int id) {
+    string n = to_string(id);
+    return "SYNG" + string(n.size() < 11 ? 11 - n.size() : 0, '0') + n;
+}
+
+/**
+ * Writes a as an Ensembl GTF: by chromosome, by gene, each transcript
+ * followed by its exons in order along its strand.
+ */
+static bool writeGTF(const string &filename, const SynthAnnotation &a) {
+    ofstream out(filename);
+    if (!out.is_open()) { return false; }
+    for (int g = 0; g < a.genes.size(); ++g) {
+        const SynthGene &gene = a.genes[g];
+        string chrom = to_string(gene.chrom + 1);
+        string geneAttr = "gene_id \"" + geneName(g) + "\";";
+        char strand = a.transcripts[gene.first].strand;
+        out << chrom << "\tsynth\tgene\t" << gene.start + 1 << '\t' << gene.end
+            << "\t.\t" << strand << "\t.\t" << geneAttr
+            << " gene_biotype \"protein_coding\";\n";
+        for (int id = gene.first; id < gene.first + gene.count; ++id) {
+            const SynthTranscript &t = a.transcripts[id];
+            string attr = geneAttr + " transcript_id \"" + transcriptName(id)
+                + "\";";
+            out << chrom << "\tsynth\ttranscript\t"
+                << t.exons.front().start + 1 << '\t' << t.exons.back().end
+                << "\t.\t" << strand << "\t.\t" << attr << '\n';
+            for (int i = 0; i < t.exons.size(); ++i) {
+                int e = strand == '+' ? i : t.exons.size() - 1 - i;
+                out << chrom << "\tsynth\texon\t" << t.exons[e].start + 1
+                    << '\t' << t.exons[e].end << "\t.\t" << strand << "\t.\t"
+                    << attr << " exon_number \"" << i + 1 << "\";\n";
+            }
+        }
+    }
+    return out.good();
+}
+
+/**
+ * Writes the transcriptome: a record per transcript, in ID order, for -t. No
+ * genome is generated, so the sequences are all N.
+ */
+static bool writeFasta(const string &filename, const SynthAnnotation &a) {
+    ofstream out(filename);
+    if (!out.is_open()) { return false; }
+    for (int id = 0; id < a.transcripts.size(); ++id) {
+        out << '>' << transcriptName(id) << " gene:" << geneName(
+                a.transcripts[id].gene) << '\n';
+        for (int left = a.transcripts[id].length; left > 0; left -= 60) {
+            out << string(min(left, 60), 'N') << '\n';
+        }
+    }
+    return out.good();
+}
+
+/**
+ * The blocks of genome that length bases from offset of t's spliced
+ * sequence (counted in increasing genomic order) cover.
+ */
+static void project(const SynthTranscript &t, int offset, int length,
+        vector<Exon> &blocks) {
+    blocks.clear();
+    for (auto e = t.exons.begin(); e != t.exons.end() && length > 0; ++e) {
+        int size = e->end - e->start;
+        if (offset >= size) {
+            offset -= size;
+            continue;
+        }
+        int n = min(length, size - offset);
+        blocks.push_back(Exon(e->start + offset, e->start + offset + n));
+        length -= n;
+        offset = 0;
+    }
+}
+
+/**
+ * Whether an alignment with these blocks is compatible with t, as bam2tcc
+ * decides it: each block within an exon, exons consecutive, and blocks
+ * meeting at a splice ending and starting exactly where the exons do. With
+ * loose (kallisto --genomebam), only each block lying within an exon, in
+ * order, is required.
+ */
+static bool compatible(const SynthTranscript &t, const vector<Exon> &blocks,
+        bool loose) {
+    auto e = t.exons.begin();
+    while (e != t.exons.end() && e->end <= blocks.front().start) { ++e; }
+    for (int i = 0; i < blocks.size(); ++i) {
+        const Exon &b = blocks[i];
+        if (loose) {
+            while (e != t.exons.end() && e->end < b.end) { ++e; }
+        }
+        if (e == t.exons.end() || b.start < e->start || b.end > e->end
+                || (!loose && i != 0 && b.start != e->start)
+                || (!loose && i != blocks.size() - 1 && b.end != e->end)) {
+            return false;
+        }
+        ++e;
+    }
+    return true;
+}
+
+/* Offset in t's spliced sequence of genomic position pos, within an exon. */
+static int toTranscript(const SynthTranscript &t, int pos) {
+    int offset = 0;
+    for (auto e = t.exons.begin(); e != t.exons.end(); ++e) {
+        if (pos < e->end) { return offset + pos - e->start; }
+        offset += e->end - e->start;
+    }
+    return offset;
+}
+
+/* One record to write, with the bam2tcc-relevant fields. */
+struct SynthRecord {
+    int rID, pos, rNext, pNext, tlen, flag, nh;
+    string cigar;       /* As text, e.g. 40M300N60M. */
+    int span;           /* Bases of reference covered. */
+};
+
+static string cigarOf(const vector<Exon> &blocks) {
+    string cigar;
+    for (int i = 0; i < blocks.size(); ++i) {
+        if (i != 0) {
+            cigar += to_string(blocks[i].start - blocks[i - 1].end) + "N";
+        }
+        cigar += to_string(blocks[i].end - blocks[i].start) + "M";
+    }
+    return cigar;
+}
+
+/* Bin of [beg, end) in the BAM index, as in the SAM specification. */
+static int reg2bin(int beg, int end) {
+    --end;
+    if (beg >> 14 == end >> 14) { return ((1 << 15) - 1) / 7 + (beg >> 14); }
+    if (beg >> 17 == end >> 17) { return ((1 << 12) - 1) / 7 + (beg >> 17); }
+    if (beg >> 20 == end >> 20) { return ((1 << 9) - 1) / 7 + (beg >> 20); }
+    if (beg >> 23 == end >> 23) { return ((1 << 6) - 1) / 7 + (beg >> 23); }
+    if (beg >> 26 == end >> 26) { return ((1 << 3) - 1) / 7 + (beg >> 26); }
+    return 0;
+}
+
+template<typename T> static void append(string &out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * Appends rec named qName to out as a SAM line, or a BAM record, with no
+ * sequence or qualities. Reference names are those of refs.
+ */
+static void format(const SynthRecord &rec, const string &qName,
+        const vector<string> &refs, bool bam, string &out) {
+    if (!bam) {
+        out += qName + '\t' + to_string(rec.flag) + '\t'
+            + (rec.rID == -1 ? "*" : refs[rec.rID]) + '\t'
+            + to_string(rec.pos + 1) + '\t' + (rec.nh == 1 ? "60" : "1") + '\t'
+            + (rec.cigar.empty() ? "*" : rec.cigar) + '\t'
+            + (rec.rNext == -1 ? "*" : rec.rNext == rec.rID ? "="
+                    : refs[rec.rNext]) + '\t'
+            + to_string(rec.pNext + 1) + '\t' + to_string(rec.tlen) + "\t*\t*";
+        if (rec.nh != 0) { out += "\tNH:i:" + to_string(rec.nh); }
+        out += '\n';
+        return;
+    }
+    vector<uint32_t> cigar;
+    for (int i = 0, count = 0; i < rec.cigar.size(); ++i) {
+        if (isdigit(rec.cigar[i])) {
+            count = count * 10 + rec.cigar[i] - '0';
+            continue;
+        }
+        cigar.push_back(count << 4 | (uint32_t)(strchr("MIDNSHP=X",
+                        rec.cigar[i]) - "MIDNSHP=X"));
+        count = 0;
+    }
+    size_t start = out.size();
+    append<int32_t>(out, 0);
+    append<int32_t>(out, rec.rID);
+    append<int32_t>(out, rec.pos);
+    append<uint8_t>(out, qName.size() + 1);
+    append<uint8_t>(out, rec.nh == 1 ? 60 : 1);
+    append<uint16_t>(out, rec.rID == -1 ? 4680
+            : reg2bin(rec.pos, rec.pos + max(1, rec.span)));
+    append<uint16_t>(out, cigar.size());
+    append<uint16_t>(out, rec.flag);
+    append<uint32_t>(out, 0);
+    append<int32_t>(out, rec.rNext);
+    append<int32_t>(out, rec.pNext);
+    append<int32_t>(out, rec.tlen);
+    out.append(qName.c_str(), qName.size() + 1);
+    for (auto it = cigar.begin(); it != cigar.end(); ++it) {
+        append<uint32_t>(out, *it);
+    }
+    if (rec.nh != 0) {
+        out += "NHC";
+        append<uint8_t>(out, rec.nh);
+    }
+    int32_t size = out.size() - start - 4;
+    memcpy(&out[start], &size, 4);
+}
+
+/**
+ * The header naming refs, with the @PG line bam2tcc tells the aligner by.
+ */
+static string makeHeader(const SynthOptions &o, const vector<string> &refs,
+        const vector<int> &lengths) {
+    string text = "@HD\tVN:1.6\tSO:coordinate\n";
+    for (int i = 0; i < refs.size(); ++i) {
+        text += "@SQ\tSN:" + refs[i] + "\tLN:" + to_string(lengths[i]) + "\n";
+    }
+    text += o.genomebam ? "@PG\tID:kallisto\tPN:kallisto\tVN:0.46.0\n"
+        : o.rapmap ? "@PG\tID:rapmap\tPN:rapmap\tVN:0.6.0\n"
+        : "@PG\tID:hisat2\tPN:hisat2\tVN:2.1.0\n";
+    if (!o.bam) { return text; }
+    string header = "BAM\1";
+    append<int32_t>(header, text.size());
+    header += text;
+    append<int32_t>(header, refs.size());
+    for (int i = 0; i < refs.size(); ++i) {
+        append<int32_t>(header, refs[i].size() + 1);
+        header.append(refs[i].c_str(), refs[i].size() + 1);
+        append<int32_t>(header, lengths[i]);
+    }
+    return header;
+}
+
+/**
+ * Records waiting to be written until generation has passed their position;
+ * (reference, position, order generated) is the order they are written in.
+ */
+struct PendingRecord {
+    uint64_t key, order;
+    string data;
+    bool operator<(const PendingRecord &other) const {
+        return key != other.key ? key > other.key : order > other.order;
+    }
+};
+
+static uint64_t sortKey(int rID, int pos) {
+    return (uint64_t)rID << 32 | (uint32_t)pos;
+}
+
+/* Writes out the records of pending that lie before key, in order. */
+static void release(vector<PendingRecord> &pending, uint64_t key,
+        string &buffer, RecordWriter &writer) {
+    while (!pending.empty() && pending.front().key < key) {
+        pop_heap(pending.begin(), pending.end());
+        buffer += pending.back().data;
+        pending.pop_back();
+        if (buffer.size() >= SYNTH_WRITE_SIZE) {
+            writer.write(buffer);
+            buffer.clear();
+        }
+    }
+}
+
+/* Where a read's fragment lies: in which transcript, its offset and size. */
+struct SynthFragment {
+    int transcript, offset, length, readLength;
+    bool intronic;
+};
+
+/**
+ * The genomic blocks of each mate (one if unpaired) of f, leftmost first.
+ */
+static void mateBlocks(const SynthAnnotation &a, const SynthFragment &f,
+        bool paired, vector<vector<Exon>> &mates) {
+    const SynthTranscript &t = a.transcripts[f.transcript];
+    mates.assign(paired ? 2 : 1, vector<Exon>());
+    int offsets[] = {f.offset, f.offset + f.length - f.readLength};
+    for (int m = 0; m < mates.size(); ++m) {
+        if (f.intronic) {
+            int start = t.exons.front().start + offsets[m];
+            mates[m].push_back(Exon(start, start + f.readLength));
+        } else {
+            project(t, offsets[m], f.readLength, mates[m]);
+        }
+    }
+}
+
+/**
+ * Generates one file's reads and writes them, adding the EC each read should
+ * be counted under to truth. Returns false if the file can't be written.
+ */
+static bool writeFile(const SynthOptions &o, const SynthAnnotation &a,
+        int fileNum, const string &filename, int threads,
+        map<vector<int>, long> &truth, long &records) {
+    mt19937_64 rng(o.seed + 1 + fileNum);
+    bernoulli_distribution coin(0.5), multimap(o.multimap),
+        spliced(max(0.0, o.spliced)), intronic(o.intronic);
+    normal_distribution<double> fragment(o.fragmentMean, o.fragmentSD);
+    uniform_int_distribution<int> paralogs(1, max(1, o.maxNH - 1));
+
+    vector<string> refs;
+    vector<int> lengths;
+    if (o.rapmap) {
+        for (int id = 0; id < a.transcripts.size(); ++id) {
+            refs.push_back(transcriptName(id));
+            lengths.push_back(a.transcripts[id].length);
+        }
+    } else {
+        for (int i = 0; i < a.chromLengths.size(); ++i) {
+            refs.push_back(to_string(i + 1));
+            lengths.push_back(a.chromLengths[i]);
+        }
+    }
+    RecordWriter writer;
+    if (!writer.open(filename, !o.bam, makeHeader(o, refs, lengths),
+                o.compressionLevel, threads)) {
+        return false;
+    }
+
+    long unmapped = binomial_distribution<long>(o.reads, o.unmapped)(rng);
+    long remaining = o.reads - unmapped, readNum = 0;
+    double weight = 0;
+    for (auto t = a.transcripts.begin(); t != a.transcripts.end(); ++t) {
+        weight += t->weight;
+    }
+    vector<PendingRecord> pending;
+    uint64_t order = 0;
+    string buffer;
+    records = 0;
+    vector<vector<Exon>> mates;
+    vector<int> EC;
+    for (int g = 0; g < a.genes.size(); ++g) {
+        const SynthGene &gene = a.genes[g];
+        release(pending, o.rapmap ? sortKey(gene.first, 0)
+                : sortKey(gene.chrom, gene.start), buffer, writer);
+        for (int id = gene.first; id < gene.first + gene.count; ++id) {
+            const SynthTranscript &t = a.transcripts[id];
+            /* Reads are shared out multinomially, one transcript at a time. */
+            long count = id == a.transcripts.size() - 1 || weight <= 0
+                ? remaining
+                : binomial_distribution<long>(remaining,
+                        min(1.0, t.weight / weight))(rng);
+            remaining -= count;
+            weight -= t.weight;
+            for (long r = 0; r < count; ++r) {
+                SynthFragment f{id, 0, 0, 0, !o.rapmap && intronic(rng)};
+                int length = f.intronic
+                    ? t.exons.back().end - t.exons.front().start : t.length;
+                f.readLength = min(o.readLength, length);
+                f.length = !o.paired ? f.readLength : max(f.readLength,
+                        min(length, (int)lround(fragment(rng))));
+                f.offset = uniform_int_distribution<int>(0,
+                        length - f.length)(rng);
+                if (o.spliced >= 0 && !f.intronic) {
+                    /* Move the leftmost mate across a junction, or into an
+                     * exon, if the transcript allows. */
+                    vector<int> choices;
+                    bool across = spliced(rng);
+                    for (int i = 0, end = 0; i < t.exons.size(); ++i) {
+                        int begin = end;
+                        end += t.exons[i].end - t.exons[i].start;
+                        int lo = across ? max(0, end - f.readLength + 1)
+                            : begin, hi = across ? end - 1 : end - f.readLength;
+                        hi = min(hi, length - f.length);
+                        if (across && i == t.exons.size() - 1) { break; }
+                        if (lo <= hi) {
+                            choices.push_back(lo);
+                            choices.push_back(hi);
+                        }
+                    }
+                    if (!choices.empty()) {
+                        int c = 2 * uniform_int_distribution<int>(0,
+                                choices.size() / 2 - 1)(rng);
+                        f.offset = uniform_int_distribution<int>(choices[c],
+                                choices[c + 1])(rng);
+                    }
+                }
+
+                /* Its alignments: this locus, and paralogs downstream. */
+                vector<SynthFragment> loci{f};
+                if (!f.intronic && multimap(rng)) {
+                    int last = min((int)a.genes.size() - 1,
+                            g + SYNTH_PARALOG_WINDOW);
+                    while (last > g && a.genes[last].chrom != gene.chrom) {
+                        --last;
+                    }
+                    vector<int> others;
+                    for (int h = g + 1; h <= last; ++h) { others.push_back(h); }
+                    shuffle(others.begin(), others.end(), rng);
+                    int n = min((int)others.size(), paralogs(rng));
+                    for (int i = 0; i < n; ++i) {
+                        const SynthGene &other = a.genes[others[i]];
+                        int pick = other.first + uniform_int_distribution<int>(
+                                0, other.count - 1)(rng);
+                        if (a.transcripts[pick].length < f.length) { continue; }
+                        SynthFragment p = f;
+                        p.transcript = pick;
+                        p.offset = min(f.offset,
+                                a.transcripts[pick].length - f.length);
+                        loci.push_back(p);
+                    }
+                }
+
+                /* Each locus is one alignment (genome) or one per isoform it
+                 * is compatible with (RapMap). EC is the union of loci's. */
+                EC.clear();
+                vector<pair<int, vector<vector<Exon>>>> alignments;
+                for (auto l = loci.begin(); l != loci.end(); ++l) {
+                    mateBlocks(a, *l, o.paired, mates);
+                    const SynthGene &lg =
+                        a.genes[a.transcripts[l->transcript].gene];
+                    for (int i = lg.first; i < lg.first + lg.count; ++i) {
+                        bool all = true;
+                        for (auto m = mates.begin(); m != mates.end(); ++m) {
+                            all = all && compatible(a.transcripts[i], *m,
+                                    o.genomebam);
+                        }
+                        if (!all) { continue; }
+                        EC.push_back(i);
+                        if (o.rapmap) { alignments.push_back({i, mates}); }
+                    }
+                    if (!o.rapmap) {
+                        alignments.push_back({lg.chrom, mates});
+                    }
+                }
+                if (alignments.empty()) { continue; }
+                sort(EC.begin(), EC.end());
+                if (!EC.empty()) { ++truth[EC]; }
+
+                string qName = "r" + to_string(fileNum) + "."
+                    + to_string(readNum++);
+                bool firstLeft = coin(rng);
+                for (auto al = alignments.begin(); al != alignments.end();
+                        ++al) {
+                    vector<SynthRecord> recs;
+                    for (auto m = al->second.begin(); m != al->second.end();
+                            ++m) {
+                        SynthRecord rec{al->first, m->front().start, -1, -1,
+                            0, 0, (int)alignments.size(), cigarOf(*m),
+                            m->back().end - m->front().start};
+                        if (o.rapmap) {
+                            const SynthTranscript &rt =
+                                a.transcripts[al->first];
+                            rec.pos = toTranscript(rt, m->front().start);
+                            if (rt.strand == '-') {
+                                rec.pos = rt.length - rec.pos - f.readLength;
+                            }
+                            rec.cigar = to_string(f.readLength) + "M";
+                            rec.span = f.readLength;
+                        }
+                        recs.push_back(rec);
+                    }
+                    if (o.paired) {
+                        /* Leftmost on the reference forward, its mate
+                         * reverse (FR). */
+                        if (recs[1].pos < recs[0].pos) {
+                            swap(recs[0], recs[1]);
+                        }
+                        int tlen = max(recs[0].pos + recs[0].span,
+                                recs[1].pos + recs[1].span) - recs[0].pos;
+                        for (int m = 0; m < 2; ++m) {
+                            SynthRecord &rec = recs[m], &mate = recs[1 - m];
+                            rec.rNext = mate.rID;
+                            rec.pNext = mate.pos;
+                            rec.tlen = m == 0 ? tlen : -tlen;
+                            rec.flag = 0x1 | 0x2 | (m == 0 ? 0x20 : 0x10)
+                                | ((m == 0) == firstLeft ? 0x40 : 0x80);
+                        }
+                    }
+                    for (auto rec = recs.begin(); rec != recs.end(); ++rec) {
+                        if (alignments.size() > 1 && al != alignments.begin()) {
+                            rec->flag |= 0x100;
+                        }
+                        PendingRecord p{sortKey(rec->rID, rec->pos), order++,
+                            ""};
+                        format(*rec, qName, refs, o.bam, p.data);
+                        pending.push_back(move(p));
+                        push_heap(pending.begin(), pending.end());
+                        ++records;
+                    }
+                }
+            }
+        }
+    }
+    release(pending, UINT64_MAX, buffer, writer);
+
+    /* Unmapped reads go last, as samtools sort puts them. */
+    for (long r = 0; r < unmapped; ++r) {
+        string qName = "r" + to_string(fileNum) + "." + to_string(readNum++);
+        SynthRecord rec{-1, -1, -1, -1, 0, 0x4, 0, "", 0};
+        for (int m = 0; m < (o.paired ? 2 : 1); ++m) {
+            if (o.paired) { rec.flag = 0x1 | 0x4 | 0x8 | (m ? 0x80 : 0x40); }
+            format(rec, qName, refs, o.bam, buffer);
+            ++records;
+        }
+        if (buffer.size() >= SYNTH_WRITE_SIZE) {
+            writer.write(buffer);
+            buffer.clear();
+        }
+    }
+    writer.write(buffer);
+    return writer.close();
+}
+
+static bool writeTruth(const string &filename,
+        const vector<map<vector<int>, long>> &truth) {
+    ofstream out(filename);
+    if (!out.is_open()) { return false; }
+    for (int f = 0; f < truth.size(); ++f) {
+        for (auto it = truth[f].begin(); it != truth[f].end(); ++it) {
+            for (int i = 0; i < it->first.size(); ++i) {
+                out << (i == 0 ? "" : ",") << it->first[i];
+            }
+            out << '\t' << f << '\t' << it->second << '\n';
+        }
+    }
+    return out.good();
+}
+
+void usage() {
+    cerr << "Usage: bam2tcc_synth [options]* [-o <prefix>]" << endl
+    << "Writes <prefix>.gtf, <prefix>.fa (for -t), <prefix>.sam (or .bam, or "
+    << "<prefix>.<i>.sam with several files) and <prefix>.truth.tsv, the EC, "
+    << "file and count of every EC the reads should be counted under." << endl
+    << "  -o, --output <prefix>     Prefix of output files (default synth)."
+    << endl
+    << "  --seed <n>                Random seed (default 1)." << endl
+    << "Annotation:" << endl
+    << "  --chromosomes <n>         Number of chromosomes (default 2)." << endl
+    << "  --genes <n>               Number of genes (default 2000)." << endl
+    << "  --density <n>             Genes per Mb (default 10)." << endl
+    << "  --isoforms <n>            Mean transcripts per gene (default 3)."
+    << endl
+    << "  --exons <n>               Mean exons per gene (default 8)." << endl
+    << "  --exon-length <min,max>   Exon lengths (default 50,400)." << endl
+    << "  --intron-length <min,max> Intron lengths (default 100,10000)." << endl
+    << "Alignments:" << endl
+    << "  -r, --reads <n>           Reads (pairs) per file (default 1000000)."
+    << endl
+    << "  -n, --files <n>           Number of files (default 1)." << endl
+    << "  -U, --Unpaired            Single-end reads." << endl
+    << "  -b, --bam                 Write BAM instead of SAM." << endl
+    << "  -k, --kallisto            As kallisto --genomebam writes." << endl
+    << "  -R, --RapMap              As RapMap writes: aligned to transcripts."
+    << endl
+    << "  --read-length <n>         Read length (default 100)." << endl
+    << "  --fragment <mean,sd>      Fragment length (default 300,50)." << endl
+    << "  --multimap <f>            Fraction of reads also aligned to paralogs "
+    << "(default 0.1)." << endl
+    << "  --max-nh <n>              Most alignments of a read (default 4)."
+    << endl
+    << "  --spliced <f>             Fraction of reads (leftmost mates) drawn "
+    << "across a splice junction, the rest within one exon, where the "
+    << "transcript allows (default: drawn uniformly)." << endl
+    << "  --intronic <f>            Fraction of reads drawn from pre-mRNA "
+    << "(default 0). Not with -R." << endl
+    << "  --unmapped <f>            Fraction of reads unmapped (default 0)."
+    << endl
+    << "  -p, --threads <n>         Threads to write files and compress BAM "
+    << "with (default 1)." << endl
+    << "  --compression-level <n>   Compression level (0-9) of BAM outputs."
+    << endl;
+}
+
+/* Parses "a,b" into two ints. */
+static bool parsePair(const string &s, int &a, int &b) {
+    vector<string> v = parseString(s, ",", 0);
+    if (v.size() != 2 || !isNumber(v[0]) || !isNumber(v[1])) { return false; }
+    a = stoi(v[0]);
+    b = stoi(v[1]);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    SynthOptions o;
+    bool valid = true;
+    struct option opts[] = {
+        {"output", required_argument, 0, 'o'},
+        {"seed", required_argument, 0, 's'},
+        {"chromosomes", required_argument, 0, 'c'},
+        {"genes", required_argument, 0, 'g'},
+        {"density", required_argument, 0, 'd'},
+        {"isoforms", required_argument, 0, 'i'},
+        {"exons", required_argument, 0, 'e'},
+        {"exon-length", required_argument, 0, 'E'},
+        {"intron-length", required_argument, 0, 'I'},
+        {"reads", required_argument, 0, 'r'},
+        {"files", required_argument, 0, 'n'},
+        {"Unpaired", no_argument, no_argument, 'U'},
+        {"bam", no_argument, no_argument, 'b'},
+        {"kallisto", no_argument, no_argument, 'k'},
+        {"RapMap", no_argument, no_argument, 'R'},
+        {"read-length", required_argument, 0, 'l'},
+        {"fragment", required_argument, 0, 'f'},
+        {"multimap", required_argument, 0, 'm'},
+        {"max-nh", required_argument, 0, 'N'},
+        {"spliced", required_argument, 0, 'S'},
+        {"intronic", required_argument, 0, 'P'},
+        {"unmapped", required_argument, 0, 'u'},
+        {"threads", required_argument, 0, 'p'},
+        {"compression-level", required_argument, 0, 'L'},
+        {0, 0, 0, 0}
+    };
+    int opt_index = 0;
+    while (true) {
+        int c = getopt_long(argc, argv, "o:r:n:UbkRp:", opts, &opt_index);
+        if (c == -1) { break; }
+        switch (c) {
+            case 'o':   o.prefix = optarg; break;
+            case 's':   o.seed = atol(optarg); break;
+            case 'c':   o.chromosomes = atoi(optarg); break;
+            case 'g':   o.genes = atoi(optarg); break;
+            case 'd':   o.density = atof(optarg); break;
+            case 'i':   o.isoforms = atof(optarg); break;
+            case 'e':   o.exons = atof(optarg); break;
+            case 'E':   valid &= parsePair(optarg, o.exonMin, o.exonMax); break;
+            case 'I':   valid &= parsePair(optarg, o.intronMin, o.intronMax);
+                        break;
+            case 'r':   o.reads = atol(optarg); break;
+            case 'n':   o.files = atoi(optarg); break;
+            case 'U':   o.paired = false; break;
+            case 'b':   o.bam = true; break;
+            case 'k':   o.genomebam = true; break;
+            case 'R':   o.rapmap = true; break;
+            case 'l':   o.readLength = atoi(optarg); break;
+            case 'f':   valid &= parsePair(optarg, o.fragmentMean,
+                                o.fragmentSD);
+                        break;
+            case 'm':   o.multimap = atof(optarg); break;
+            case 'N':   o.maxNH = atoi(optarg); break;
+            case 'S':   o.spliced = atof(optarg); break;
+            case 'P':   o.intronic = atof(optarg); break;
+            case 'u':   o.unmapped = atof(optarg); break;
+            case 'p':   o.threads = atoi(optarg); break;
+            case 'L':   o.compressionLevel = atoi(optarg); break;
+            default:    valid = false; break;
+        }
+    }
+    if (!valid || optind != argc || o.chromosomes < 1 || o.genes < o.chromosomes
+            || o.density <= 0 || o.isoforms < 1 || o.exons < 1
+            || o.exonMin < 1 || o.exonMax < o.exonMin || o.intronMin < 1
+            || o.intronMax < o.intronMin || o.reads < 0 || o.files < 1
+            || (o.genomebam && o.rapmap) || o.readLength < 1 || o.maxNH < 1
+            || o.maxNH > 255 || o.multimap < 0 || o.multimap > 1
+            || o.spliced > 1 || o.intronic < 0 || o.intronic > 1
+            || o.unmapped < 0 || o.unmapped > 1 || o.threads < 1
+            || o.compressionLevel < Z_DEFAULT_COMPRESSION
+            || o.compressionLevel > 9) {
+        usage();
+        return 1;
+    }
+    if (getLongestGene(o) + getMeanGap(o) * 2 > SYNTH_MAX_CHROM_LENGTH) {
+        cerr << "ERROR: genes and the gaps between them may be longer than a "
+            << "chromosome can be (" << SYNTH_MAX_CHROM_LENGTH << ")" << endl;
+        return 1;
+    }
+    if (o.maxNH == 1) { o.multimap = 0; }
+
+    SynthAnnotation a;
+    makeAnnotation(o, a);
+    if (a.chromLengths.size() > o.chromosomes) {
+        cerr << "WARNING: using " << a.chromLengths.size() << " chromosomes "
+            << "so that none is longer than " << SYNTH_MAX_CHROM_LENGTH << endl;
+    }
+    if (!writeGTF(o.prefix + ".gtf", a) || !writeFasta(o.prefix + ".fa", a)) {
+        cerr << "ERROR: failed to write " << o.prefix << ".gtf or "
+            << o.prefix << ".fa" << endl;
+        return 1;
+    }
+
+    /* Files are written concurrently, with the threads left over (if any)
+     * compressing. */
+    string ext = o.bam ? ".bam" : ".sam";
+    int concurrent = min(o.threads, o.files);
+    vector<map<vector<int>, long>> truth(o.files);
+    vector<long> records(o.files);
+    bool success = true;
+    for (int first = 0; first < o.files; first += concurrent) {
+        vector<future<bool>> threads;
+        for (int f = first; f < min(o.files, first + concurrent); ++f) {
+            string filename = o.prefix + (o.files == 1 ? ""
+                    : "." + to_string(f)) + ext;
+            threads.push_back(async(launch::async, writeFile, cref(o),
+                        cref(a), f, filename, o.threads / concurrent,
+                        ref(truth[f]), ref(records[f])));
+        }
+        for (int i = 0; i < threads.size(); ++i) {
+            if (!threads[i].get()) {
+                cerr << "ERROR: failed to write file " << first + i << endl;
+                success = false;
+            }
+        }
+    }
+    if (!success) { return 1; }
+    if (!writeTruth(o.prefix + ".truth.tsv", truth)) {
+        cerr << "ERROR: failed to write " << o.prefix << ".truth.tsv" << endl;
+        return 1;
+    }
+
+    long ecs = 0, counted = 0;
+    for (int f = 0; f < o.files; ++f) {
+        ecs += truth[f].size();
+        for (auto it = truth[f].begin(); it != truth[f].end(); ++it) {
+            counted += it->second;
+        }
+        cout << o.prefix << (o.files == 1 ? "" : "." + to_string(f)) << ext
+            << ": " << records[f] << " records" << endl;
+    }
+    cout << a.genes.size() << " genes, " << a.transcripts.size()
+        << " transcripts; " << counted << " reads counted under " << ecs
+        << " (EC, file) pairs" << endl;
+    return 0;
+}